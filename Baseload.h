@@ -0,0 +1,197 @@
+#ifndef INCLUDED_BASELOAD_H
+#define INCLUDED_BASELOAD_H
+
+/**
+ * BaseloadTracker keeps track of the baseload (always-on power): the lowest
+ * average power of any window (of e.g. 15 minutes) within the horizon (of
+ * e.g. the last 24 hours, or N windows).
+ *
+ * The sliding minimum is kept in a monotonic deque: a window average is
+ * only kept while no later window had a lower (or equal) average. Every
+ * average is added and removed at most once, so the amortized work per
+ * window is O(1), and the memory is fixed at N entries.
+ *
+ * Additionally, the lowest window average during the night (from
+ * NIGHT_FROM_H to NIGHT_UNTIL_H, wall clock) is reported once a day, after
+ * the night is over. Without a wall clock, there is no overnight figure,
+ * and the daily report is done every 24 hours worth of windows instead.
+ *
+ * Usage:
+ *
+ *   BaseloadTracker<96> baseload(900000);    // 96 x 15 minutes
+ *   // for every new 1.8.0/2.8.0 reading
+ *   baseload.set_energy_totals(millis(), pos_wh, neg_wh, hour_or_minus_1);
+ *   if (baseload.take_daily(&current, &overnight))
+ *       publish(current, overnight);
+ */
+template<unsigned char N> class BaseloadTracker
+{
+public:
+    static const int NIGHT_FROM_H = 1;
+    static const int NIGHT_UNTIL_H = 5;
+    static const int UNKNOWN = -32768;
+
+private:
+    struct entry_t {
+        unsigned short seq; /* window sequence number (wraps) */
+        int watt;
+    };
+    entry_t _dq[N];             /* ring buffer, increasing watt */
+    unsigned char _head;
+    unsigned char _len;
+    unsigned short _seq;        /* sequence number of the next window */
+
+    unsigned long _window_ms;
+    unsigned long _t0;          /* start of the current window */
+    unsigned long _pos0;
+    unsigned long _neg0;
+    bool _started;
+
+    int _night_min;             /* lowest average this night */
+    bool _in_night;
+    unsigned short _daily_seq;  /* sequence number at the last report */
+    bool _daily_due;
+    int _daily_night;
+
+    inline entry_t &_at(unsigned char i) {
+        return _dq[(_head + i) % N];
+    }
+
+public:
+    BaseloadTracker(unsigned long window_ms) :
+            _head(0), _len(0), _seq(0), _window_ms(window_ms),
+            _started(false), _night_min(UNKNOWN), _in_night(false),
+            _daily_seq(0), _daily_due(false) {}
+
+    /* Add the average power of a completed window */
+    void push(int watt, int hour) {
+        /* Drop everything from the back that is not lower than this */
+        while (_len && _at(_len - 1).watt >= watt) {
+            --_len;
+        }
+        /* Drop the front if it fell out of the horizon; that is at most
+         * one, as only one window is added at a time */
+        if (_len && (unsigned short)(_seq - _at(0).seq) >= N) {
+            _head = (_head + 1) % N;
+            --_len;
+        }
+        _at(_len).seq = _seq;
+        _at(_len).watt = watt;
+        ++_len;
+        ++_seq;
+
+        /* Overnight minimum, reported when the night is over */
+        bool night = (hour >= NIGHT_FROM_H && hour < NIGHT_UNTIL_H);
+        if (night) {
+            if (_night_min == UNKNOWN || watt < _night_min) {
+                _night_min = watt;
+            }
+        } else if (_in_night) {
+            _daily_night = _night_min;
+            _daily_due = true;
+            _night_min = UNKNOWN;
+        } else if (hour < 0 && (unsigned long)(unsigned short)(
+                    _seq - _daily_seq) * _window_ms >= 86400000UL) {
+            _daily_night = UNKNOWN;
+            _daily_due = true;
+        }
+        _in_night = night;
+    }
+
+    /* Feed the current totals; completes a window every window_ms */
+    void set_energy_totals(
+            unsigned long time_ms, unsigned long pos_wh,
+            unsigned long neg_wh, int hour) {
+        if (!_started) {
+            _t0 = time_ms;
+            _pos0 = pos_wh;
+            _neg0 = neg_wh;
+            _started = true;
+            return;
+        }
+        unsigned long dt = time_ms - _t0;
+        if (dt < _window_ms) {
+            return;
+        }
+        long wh = (long)(pos_wh - _pos0) - (long)(neg_wh - _neg0);
+        push((int)(wh * 3600000.0f / (float)dt), hour);
+        _t0 = time_ms;
+        _pos0 = pos_wh;
+        _neg0 = neg_wh;
+    }
+
+    /* Do we have a baseload at all? */
+    inline bool has_value() {
+        return _len != 0;
+    }
+
+    /* Lowest window average within the horizon */
+    inline int get_baseload() {
+        return _len ? _at(0).watt : UNKNOWN;
+    }
+
+    /* Once a day: get the current and overnight (or UNKNOWN) baseload */
+    bool take_daily(int *current, int *overnight) {
+        if (!_daily_due) {
+            return false;
+        }
+        *current = get_baseload();
+        *overnight = _daily_night;
+        _daily_due = false;
+        _daily_seq = _seq;
+        return true;
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_baseload()
+{
+    int current, overnight;
+    BaseloadTracker<4> baseload(900000);
+    INT_EQ("baseload(empty)", baseload.has_value(), 0);
+
+    /* 300, 200, 400, 250: the minimum is 200 */
+    baseload.push(300, 23);
+    baseload.push(200, 0);
+    baseload.push(400, 1);
+    baseload.push(250, 1);
+    INT_EQ("baseload(min)", baseload.get_baseload(), 200);
+    /* The horizon of 4 windows includes the newest one */
+    baseload.push(500, 2);
+    INT_EQ("baseload(horizon)", baseload.get_baseload(), 200);
+    baseload.push(600, 3);
+    INT_EQ("baseload(expire)", baseload.get_baseload(), 250);
+    baseload.push(700, 4);
+    INT_EQ("baseload(expire)", baseload.get_baseload(), 250);
+    baseload.push(800, 4);
+    INT_EQ("baseload(expire)", baseload.get_baseload(), 500);
+    INT_EQ("baseload(not-daily)", baseload.take_daily(&current, &overnight), 0);
+    /* Night is over: the lowest of 400, 250, 500, 600, 700, 800 */
+    baseload.push(900, 5);
+    INT_EQ("baseload(daily)", baseload.take_daily(&current, &overnight), 1);
+    INT_EQ("baseload(daily-current)", current, 600);
+    INT_EQ("baseload(daily-overnight)", overnight, 250);
+    INT_EQ("baseload(daily-once)", baseload.take_daily(&current, &overnight), 0);
+
+    /* Window averages from totals: 50 Wh in 15 minutes is 200 W */
+    BaseloadTracker<96> totals(900000);
+    totals.set_energy_totals(0, 1000, 7, -1);
+    totals.set_energy_totals(600000, 1030, 7, -1);
+    INT_EQ("baseload(totals)", totals.has_value(), 0);
+    totals.set_energy_totals(900000, 1051, 8, -1);
+    INT_EQ("baseload(totals)", totals.get_baseload(), 200);
+    /* Without a clock, the daily report comes after 96 windows */
+    for (int i = 2; i <= 96; ++i) {
+        totals.set_energy_totals(i * 900000UL, 1051 + i * 100, 8, -1);
+    }
+    INT_EQ("baseload(no-clock)", totals.take_daily(&current, &overnight), 1);
+    INT_EQ("baseload(no-clock)", overnight, totals.UNKNOWN);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_BASELOAD_H
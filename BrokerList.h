@@ -0,0 +1,228 @@
+#ifndef INCLUDED_BROKERLIST_H
+#define INCLUDED_BROKERLIST_H
+
+/**
+ * BrokerSelector decides which MQTT broker of an ordered list to connect
+ * to, and when. It does no I/O itself: the caller does the (time limited)
+ * connect and reports the outcome.
+ *
+ * Per broker it keeps the number of consecutive failures, an exponential
+ * backoff (1s, 2s, 4s, ... up to 5 minutes) and an average connect latency
+ * (of the successful connects: a timeout says nothing about the speed).
+ * Brokers are preferred in list order, but one that is backing off is
+ * skipped, and one that is slow (average latency above slow_ms) is only
+ * used if no fast one is available. So we fail over to the next broker
+ * immediately, and never retry a dead broker on every publish. A slow
+ * broker is tried again (and its latency measured again) once failback_ms
+ * has passed since its last connect: a single slow TLS handshake does not
+ * put it aside for good.
+ *
+ * Once we have been connected to a less preferred broker for failback_ms,
+ * should_failback() tells us to disconnect and try the preferred one again,
+ * but only if pick() would choose it. If that fails, it backs off and we
+ * end up on the fallback again.
+ *
+ * Usage:
+ *
+ *   BrokerSelector<3> brokers(600000, 1500);
+ *   if (!connected) {
+ *       int idx = brokers.pick(millis());
+ *       if (idx >= 0) {
+ *           unsigned long t0 = millis();
+ *           bool ok = connect(hosts[idx]);
+ *           brokers.on_connect(idx, millis(), millis() - t0, ok);
+ *       }
+ *   } else if (brokers.should_failback(millis())) {
+ *       disconnect();
+ *       brokers.on_disconnect(millis(), false);
+ *   }
+ */
+template<unsigned char N> class BrokerSelector
+{
+public:
+    static const unsigned long MAX_BACKOFF_MS = 300000UL;
+
+private:
+    unsigned char _failures[N];     /* consecutive failures */
+    unsigned long _retry_at[N];     /* millis() after which to retry */
+    unsigned short _latency_ms[N];  /* average connect latency */
+    unsigned long _measured_at[N];  /* millis() at the last connect */
+    unsigned long _failback_ms;
+    unsigned short _slow_ms;
+    unsigned long _since;           /* millis() at connect */
+    signed char _current;           /* connected broker, or -1 */
+
+    inline bool _backing_off(int idx, unsigned long time_ms) {
+        return _failures[idx] && (long)(time_ms - _retry_at[idx]) < 0;
+    }
+
+    inline bool _slow(int idx, unsigned long time_ms) {
+        return _latency_ms[idx] > _slow_ms &&
+            time_ms - _measured_at[idx] < _failback_ms;
+    }
+
+    void _fail(int idx, unsigned long time_ms) {
+        if (_failures[idx] < 255) {
+            ++_failures[idx];
+        }
+        unsigned long backoff = MAX_BACKOFF_MS;
+        if (_failures[idx] <= 9) {
+            backoff = 1000UL << (_failures[idx] - 1);
+            if (backoff > MAX_BACKOFF_MS) {
+                backoff = MAX_BACKOFF_MS;
+            }
+        }
+        _retry_at[idx] = time_ms + backoff;
+    }
+
+public:
+    BrokerSelector(unsigned long failback_ms, unsigned short slow_ms) :
+            _failback_ms(failback_ms), _slow_ms(slow_ms), _current(-1) {
+        for (int i = 0; i < N; ++i) {
+            _failures[i] = 0;
+            _latency_ms[i] = 0;
+            _measured_at[i] = 0;
+        }
+    }
+
+    /* Which broker to try now; -1 if all are backing off */
+    int pick(unsigned long time_ms) {
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int i = 0; i < N; ++i) {
+                if (_backing_off(i, time_ms)) {
+                    continue;
+                }
+                if (pass == 0 && _slow(i, time_ms)) {
+                    continue;
+                }
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    /* Report the outcome of a connect attempt */
+    void on_connect(int idx, unsigned long time_ms, unsigned long latency_ms,
+                    bool ok) {
+        if (latency_ms > 65535UL) {
+            latency_ms = 65535UL;
+        }
+        if (ok) {
+            /* Moving average, 1/4 weight for the new value */
+            _latency_ms[idx] = (_latency_ms[idx]
+                ? (3UL * _latency_ms[idx] + latency_ms) / 4 : latency_ms);
+            _measured_at[idx] = time_ms;
+            _failures[idx] = 0;
+            _current = idx;
+            _since = time_ms;
+        } else {
+            _fail(idx, time_ms);
+        }
+    }
+
+    /* Report that the connection was lost (or closed, for failback) */
+    void on_disconnect(unsigned long time_ms, bool failed) {
+        if (_current < 0) {
+            return;
+        }
+        if (failed) {
+            _fail(_current, time_ms);
+        }
+        _current = -1;
+    }
+
+    /* Should we leave a fallback broker, to retry a preferred one? */
+    bool should_failback(unsigned long time_ms) {
+        if (_current <= 0 || (time_ms - _since) < _failback_ms) {
+            return false;
+        }
+        int idx = pick(time_ms);
+        return idx >= 0 && idx < _current;
+    }
+
+    inline int get_current() { return _current; }
+    inline unsigned get_latency(int idx) { return _latency_ms[idx]; }
+    inline unsigned get_failures(int idx) { return _failures[idx]; }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_brokerlist()
+{
+    BrokerSelector<3> brokers(600000, 1500);
+    INT_EQ("brokerlist(primary)", brokers.pick(0), 0);
+
+    /* Primary is down: fail over to the next one right away */
+    brokers.on_connect(0, 1000, 1000, false);
+    INT_EQ("brokerlist(failover)", brokers.pick(1000), 1);
+    brokers.on_connect(1, 1200, 200, true);
+    INT_EQ("brokerlist(current)", brokers.get_current(), 1);
+    INT_EQ("brokerlist(latency)", brokers.get_latency(1), 200);
+
+    /* Not yet stable long enough to fail back */
+    INT_EQ("brokerlist(no-failback)", brokers.should_failback(300000), 0);
+    INT_EQ("brokerlist(failback)", brokers.should_failback(601200), 1);
+    brokers.on_disconnect(601200, false);
+    INT_EQ("brokerlist(failback)", brokers.pick(601200), 0);
+
+    /* Primary still down: exponential backoff, 1s, 2s, 4s */
+    brokers.on_connect(0, 601200, 1000, false);
+    INT_EQ("brokerlist(failures)", brokers.get_failures(0), 2);
+    INT_EQ("brokerlist(backoff)", brokers.pick(602000), 1);
+    brokers.on_connect(1, 602000, 200, true);
+    brokers.on_disconnect(602100, true);        /* lost the connection */
+    INT_EQ("brokerlist(backoff)", brokers.pick(602100), 2);
+    brokers.on_connect(2, 602100, 3000, false);
+    INT_EQ("brokerlist(all-down)", brokers.pick(602100), -1);
+    INT_EQ("brokerlist(retry)", brokers.pick(603100), 1);
+    INT_EQ("brokerlist(retry)", brokers.pick(603200), 0);
+
+    /* A slow broker is only used when nothing else is available */
+    BrokerSelector<2> slow(600000, 1500);
+    slow.on_connect(0, 0, 4000, true);
+    slow.on_disconnect(10000, false);
+    INT_EQ("brokerlist(slow)", slow.pick(10000), 1);
+    slow.on_connect(1, 10000, 100, false);
+    INT_EQ("brokerlist(slow)", slow.pick(10000), 0);
+
+    /* With the firmware settings (1500ms timeout, slow above 750ms), a
+     * timed out connect must not make the primary "slow" for good */
+    BrokerSelector<2> fw(600000, 750);
+    fw.on_connect(0, 0, 1500, false);
+    INT_EQ("brokerlist(timeout)", fw.pick(0), 1);
+    fw.on_connect(1, 0, 100, true);
+    INT_EQ("brokerlist(timeout-latency)", fw.get_latency(0), 0);
+    INT_EQ("brokerlist(timeout-failback)", fw.should_failback(600000), 1);
+    fw.on_disconnect(600000, false);
+    INT_EQ("brokerlist(timeout-primary)", fw.pick(600000), 0);
+
+    /* A primary with a slow (TLS) handshake is retried after failback_ms,
+     * and we only fail back if we would pick it */
+    BrokerSelector<2> tls(600000, 750);
+    tls.on_connect(0, 0, 900, true);
+    tls.on_disconnect(1000, true);
+    INT_EQ("brokerlist(tls-fallback)", tls.pick(2000), 1);
+    tls.on_connect(1, 2000, 100, true);
+    INT_EQ("brokerlist(tls-slow)", tls.pick(2000), 1);
+    INT_EQ("brokerlist(tls-failback)", tls.should_failback(602000), 1);
+    tls.on_disconnect(602000, false);
+    INT_EQ("brokerlist(tls-retried)", tls.pick(602000), 0);
+
+    /* Nothing better available: stay on the fallback */
+    BrokerSelector<3> busy(600000, 750);
+    busy.on_connect(0, 0, 100, false);
+    busy.on_connect(1, 0, 100, true);
+    busy.on_disconnect(1000, true);
+    busy.on_connect(2, 1000, 100, true);
+    INT_EQ("brokerlist(no-better)", busy.should_failback(601000), 1);
+    busy.on_connect(0, 601000, 100, false);     /* still down */
+    busy.on_connect(1, 601000, 100, false);     /* and this one too */
+    INT_EQ("brokerlist(no-better)", busy.should_failback(601000), 0);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_BROKERLIST_H
@@ -0,0 +1,274 @@
+#ifndef INCLUDED_EXPORTLANE_H
+#define INCLUDED_EXPORTLANE_H
+
+/**
+ * LaneAggregate summarizes the EnergyGauge outputs over a window, for an
+ * export lane that publishes less often than we read the meter (like a
+ * cloud broker that charges per message). It is fed after every read
+ * cycle, and keeps only the window totals, so it is the same size for a
+ * minute or for an hour.
+ *
+ * The average power comes from the Wh totals at the window edges, so no
+ * energy is lost between publishes: the next window starts where the
+ * previous one ended. If a publish fails, just do not restart(): the
+ * window grows until the next attempt succeeds.
+ *
+ * Usage:
+ *
+ *   LaneAggregate lane(60000);
+ *   lane.add(millis(), gauge.get_positive_active_energy_total(),
+ *            gauge.get_negative_active_energy_total(),
+ *            gauge.get_instantaneous_power());
+ *   if (lane.is_due(millis()) && publish_somewhere(lane.get_power(), ...))
+ *       lane.restart();
+ */
+class LaneAggregate
+{
+private:
+    unsigned long _window_ms;
+    unsigned long _t0;          /* window start */
+    unsigned long _t1;          /* last sample */
+    unsigned long _pos0, _neg0; /* totals at the window start [Wh] */
+    unsigned long _pos1, _neg1; /* latest totals [Wh] */
+    int _min_watt;
+    int _max_watt;
+    int _last_watt;
+    bool _have;
+
+public:
+    LaneAggregate(unsigned long window_ms) :
+            _window_ms(window_ms), _min_watt(0), _max_watt(0),
+            _last_watt(0), _have(false) {}
+
+    void add(unsigned long time_ms, unsigned long pos_wh,
+             unsigned long neg_wh, int watt) {
+        if (!_have) {
+            _t0 = time_ms;
+            _pos0 = pos_wh;
+            _neg0 = neg_wh;
+            _min_watt = _max_watt = watt;
+            _have = true;
+        }
+        _t1 = time_ms;
+        _pos1 = pos_wh;
+        _neg1 = neg_wh;
+        _last_watt = watt;
+        if (watt < _min_watt) {
+            _min_watt = watt;
+        }
+        if (watt > _max_watt) {
+            _max_watt = watt;
+        }
+    }
+
+    inline bool is_due(unsigned long time_ms) const {
+        return _have && time_ms - _t0 >= _window_ms;
+    }
+
+    /* Start the next window at the last sample */
+    void restart() {
+        _t0 = _t1;
+        _pos0 = _pos1;
+        _neg0 = _neg1;
+        _min_watt = _max_watt = _last_watt;
+    }
+
+    inline unsigned long get_positive_active_energy_total() const {
+        return _pos1;
+    }
+    inline unsigned long get_negative_active_energy_total() const {
+        return _neg1;
+    }
+    inline unsigned long get_duration_ms() const { return _t1 - _t0; }
+
+    /* Average net power over the window [W] (negative when producing) */
+    int get_power() const {
+        if (_t1 == _t0) {
+            return _last_watt;
+        }
+        long wh = (long)(_pos1 - _pos0) - (long)(_neg1 - _neg0);
+        return (int)(wh * 3600000.0f / (float)(_t1 - _t0));
+    }
+    inline int get_min_power() const { return _min_watt; }
+    inline int get_max_power() const { return _max_watt; }
+};
+
+/**
+ * RollingLane is a LaneAggregate that is due every slice, but whose
+ * figures cover the last K slices: an export lane can publish the last
+ * 15 minutes every minute, with RollingLane<15>(60000). It keeps the
+ * totals and extremes per slice; restart() starts the next slice and
+ * drops the oldest one. With K = 1, it is a LaneAggregate.
+ *
+ * Usage: as LaneAggregate.
+ */
+template<unsigned char K> class RollingLane
+{
+private:
+    struct Slice {
+        unsigned long t0;           /* slice start */
+        unsigned long pos0, neg0;   /* totals at the slice start [Wh] */
+        int min_watt;
+        int max_watt;
+    };
+
+    Slice _slices[K];
+    unsigned long _slice_ms;
+    unsigned long _t1;          /* last sample */
+    unsigned long _pos1, _neg1; /* latest totals [Wh] */
+    int _last_watt;
+    unsigned char _head;        /* current slice */
+    unsigned char _len;         /* 0 until the first sample */
+
+    inline const Slice &oldest() const {
+        return _slices[(_head + K + 1 - _len) % K];
+    }
+    void start(unsigned long time_ms, unsigned long pos_wh,
+               unsigned long neg_wh, int watt) {
+        Slice &s = _slices[_head];
+        s.t0 = time_ms;
+        s.pos0 = pos_wh;
+        s.neg0 = neg_wh;
+        s.min_watt = s.max_watt = watt;
+    }
+
+public:
+    RollingLane(unsigned long slice_ms) :
+            _slice_ms(slice_ms), _last_watt(0), _head(0), _len(0) {}
+
+    void add(unsigned long time_ms, unsigned long pos_wh,
+             unsigned long neg_wh, int watt) {
+        if (!_len) {
+            start(time_ms, pos_wh, neg_wh, watt);
+            _len = 1;
+        }
+        _t1 = time_ms;
+        _pos1 = pos_wh;
+        _neg1 = neg_wh;
+        _last_watt = watt;
+        Slice &s = _slices[_head];
+        if (watt < s.min_watt) {
+            s.min_watt = watt;
+        }
+        if (watt > s.max_watt) {
+            s.max_watt = watt;
+        }
+    }
+
+    inline bool is_due(unsigned long time_ms) const {
+        return _len && time_ms - _slices[_head].t0 >= _slice_ms;
+    }
+
+    /* Start the next slice at the last sample */
+    void restart() {
+        _head = (_head + 1) % K;
+        if (_len < K) {
+            ++_len;
+        }
+        start(_t1, _pos1, _neg1, _last_watt);
+    }
+
+    inline unsigned long get_positive_active_energy_total() const {
+        return _pos1;
+    }
+    inline unsigned long get_negative_active_energy_total() const {
+        return _neg1;
+    }
+    inline unsigned long get_duration_ms() const { return _t1 - oldest().t0; }
+
+    /* Average net power over the slices [W] (negative when producing) */
+    int get_power() const {
+        const Slice &s = oldest();
+        if (_t1 == s.t0) {
+            return _last_watt;
+        }
+        long wh = (long)(_pos1 - s.pos0) - (long)(_neg1 - s.neg0);
+        return (int)(wh * 3600000.0f / (float)(_t1 - s.t0));
+    }
+    int get_min_power() const {
+        int watt = _slices[_head].min_watt;
+        for (unsigned char i = 1; i < _len; ++i) {
+            int w = _slices[(_head + K - i) % K].min_watt;
+            watt = (w < watt ? w : watt);
+        }
+        return watt;
+    }
+    int get_max_power() const {
+        int watt = _slices[_head].max_watt;
+        for (unsigned char i = 1; i < _len; ++i) {
+            int w = _slices[(_head + K - i) % K].max_watt;
+            watt = (w > watt ? w : watt);
+        }
+        return watt;
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_exportlane()
+{
+    LaneAggregate lane(60000);
+    INT_EQ("exportlane(empty)", lane.is_due(120000), 0);
+
+    /* 600 W for 30s, then 2400 W for 30s: 25 Wh in a minute, 1500 W */
+    unsigned long wh = 1000;
+    long due_at = -1;
+    for (unsigned long t = 0; t <= 60000; t += 1000) {
+        if (t > 0 && t <= 30000 && t % 6000 == 0) {
+            ++wh;
+        } else if (t > 30000 && t % 3000 == 0) {
+            wh += 2;
+        }
+        lane.add(t, wh, 7, (t <= 30000 ? 600 : 2400));
+        if (due_at < 0 && lane.is_due(t)) {
+            due_at = t;
+        }
+    }
+    INT_EQ("exportlane(due)", due_at, 60000);
+    INT_EQ("exportlane(power)", lane.get_power(), 1500);
+    INT_EQ("exportlane(min)", lane.get_min_power(), 600);
+    INT_EQ("exportlane(max)", lane.get_max_power(), 2400);
+    INT_EQ("exportlane(pos)", lane.get_positive_active_energy_total(), 1025);
+
+    /* Not restarted (failed publish): the window keeps growing */
+    lane.add(90000, 1045, 7, 2400);
+    INT_EQ("exportlane(grown)", lane.get_duration_ms(), 90000);
+    lane.restart();
+    INT_EQ("exportlane(restart)", lane.is_due(90000), 0);
+    lane.add(150000, 1045, 17, -600);
+    INT_EQ("exportlane(producing)", lane.get_power(), -600);
+    INT_EQ("exportlane(next-due)", lane.is_due(150000), 1);
+
+    /* Every minute, the last three: 3600 W, 7200 W, 0 W, 3600 W */
+    RollingLane<3> rolling(60000);
+    static const int watts[] = {3600, 7200, 0, 3600};
+    unsigned long wh2 = 5000;
+    int due = 0;
+    for (unsigned long t = 0; t <= 240000; t += 1000) {
+        int watt = watts[t == 0 ? 0 : (t - 1) / 60000];
+        wh2 += (t ? watt / 3600 : 0);
+        rolling.add(t, wh2, 0, watt);
+        if (rolling.is_due(t)) {
+            ++due;
+            if (t == 180000) {
+                INT_EQ("rollinglane(power)", rolling.get_power(), 3600);
+                INT_EQ("rollinglane(min)", rolling.get_min_power(), 0);
+                INT_EQ("rollinglane(max)", rolling.get_max_power(), 7200);
+                INT_EQ("rollinglane(window)", rolling.get_duration_ms(),
+                       180000);
+            }
+            rolling.restart();
+        }
+    }
+    INT_EQ("rollinglane(due)", due, 4);
+    /* The first two minutes have rolled out */
+    INT_EQ("rollinglane(dropped)", rolling.get_power(), 1800);
+    INT_EQ("rollinglane(dropped-window)", rolling.get_duration_ms(), 120000);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_EXPORTLANE_H
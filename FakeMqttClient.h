@@ -0,0 +1,94 @@
+#ifndef INCLUDED_FAKEMQTTCLIENT_H
+#define INCLUDED_FAKEMQTTCLIENT_H
+
+#include <string.h>
+
+/**
+ * MqttClient stand-in for the TEST_BUILD: it accepts everything the
+ * ArduinoMqttClient would, and counts the messages and the bytes they
+ * would take on the wire. The last payload is kept, so tests and the
+ * publish benchmark can inspect (or decode) it. With a topic filter set,
+ * messages to other topics (like /debug) are neither counted nor kept.
+ *
+ * Usage:
+ *
+ *   MqttClient mqttClient;
+ *   mqttClient.beginMessage("some/topic");
+ *   mqttClient.print(F("key=value"));
+ *   mqttClient.endMessage();
+ *   // mqttClient.messages == 1, mqttClient.get_payload() == "key=value"
+ */
+class MqttClient : public Print
+{
+private:
+    char _payload[512];
+    size_t _len;
+    size_t _topic_len;
+    char _filter[64];
+    bool _skip;
+    bool _connected;
+
+public:
+    unsigned long messages;
+    unsigned long long wire_bytes;  /* PUBLISH packets, headers included */
+
+    MqttClient() : _len(0), _topic_len(0), _skip(false), _connected(false),
+            messages(0), wire_bytes(0) {
+        _filter[0] = '\0';
+    }
+
+    inline int connect(const char * /*host*/, int /*port*/) {
+        _connected = true;
+        return 1;
+    }
+    inline bool connected() { return _connected; }
+    inline int connectError() { return 0; }
+    inline void poll() {}
+    inline void stop() { _connected = false; }
+    inline void setConnectionTimeout(unsigned long /*ms*/) {}
+    inline void setUsernamePassword(const char *, const char *) {}
+
+    inline int beginMessage(const char *topic) {
+        _skip = (_filter[0] != '\0' && strcmp(topic, _filter) != 0);
+        if (_skip) {
+            return 1;
+        }
+        _len = 0;
+        _topic_len = strlen(topic);
+        return 1;
+    }
+    virtual size_t write(uint8_t ch) {
+        if (_skip) {
+            return 1;
+        }
+        if (_len < sizeof(_payload) - 1) {
+            _payload[_len] = ch;
+        }
+        ++_len;
+        return 1;
+    }
+    int endMessage() {
+        if (_skip) {
+            return 1;
+        }
+        size_t remaining = 2 + _topic_len + _len;
+        wire_bytes += 1 + (remaining < 128 ? 1 : remaining < 16384 ? 2 : 3) +
+            remaining;
+        ++messages;
+        _payload[_len < sizeof(_payload) ? _len : sizeof(_payload) - 1] = '\0';
+        return 1;
+    }
+
+    /* The payload of the last message (truncated at 511 bytes) */
+    inline const char *get_payload() { return _payload; }
+    inline void reset_counters() { messages = 0; wire_bytes = 0; }
+
+    /* Only count (and keep) messages to topic; NULL counts them all */
+    inline void set_topic_filter(const char *topic) {
+        strncpy(_filter, topic ? topic : "", sizeof(_filter) - 1);
+        _filter[sizeof(_filter) - 1] = '\0';
+    }
+};
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_FAKEMQTTCLIENT_H
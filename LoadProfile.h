@@ -0,0 +1,253 @@
+#ifndef INCLUDED_LOADPROFILE_H
+#define INCLUDED_LOADPROFILE_H
+
+#include "WallClock.h"
+
+/**
+ * LoadProfileParser parses the IEC 62056-21 load profile (P.01) response
+ * one character at a time, so it can be fed block by block while a
+ * multi-block (EOT/ACK) response is still coming in.
+ *
+ * Request (R5 command, times as ZYYMMDDhhmm with Z being the season):
+ *
+ *   \SOH R5\STX P.01(02103140000;02103141200)\ETX $BCC
+ *
+ * Response (one header line, followed by one line per interval; a new
+ * header appears whenever the status changes or after a gap):
+ *
+ *   P.01(02103140015)(00)(15)(2)(1.5)(kW)(2.5)(kW)\r\n
+ *   (0.512)(0.000)\r\n
+ *   (0.498)(0.000)\r\n
+ *
+ * The header holds: time of the first record, status, period in minutes,
+ * the number of channels and then a (code)(unit) pair per channel. Values
+ * in kW or kWh are scaled to W and Wh. Every record gets the header time
+ * plus the period for every record seen before it.
+ */
+class LoadProfileParser
+{
+public:
+    enum Result {
+        BUSY = 0,   /* need more data */
+        RECORD,     /* a record is available through get_*() */
+        FAILED      /* the meter responded with (ERROR) */
+    };
+
+    static const unsigned char MAX_CHANNELS = 4;
+
+private:
+    static const unsigned char LINE_SIZE = 72;
+
+    char _line[LINE_SIZE + 1];
+    unsigned char _linelen;         /* 0xff if the line overflowed */
+    unsigned char _channels;        /* 0 until we have seen a header */
+    unsigned long _t;               /* time of the next record */
+    unsigned long _record_t;        /* time of the current record */
+    unsigned short _period_s;
+    char _codes[MAX_CHANNELS][8];   /* "1.5", "1.8.0", ... */
+    char _units[MAX_CHANNELS][4];   /* "W", "Wh", ... (without 'k') */
+    bool _kilo[MAX_CHANNELS];
+    long _values[MAX_CHANNELS];
+
+    /* Copy the contents of the next "(...)" group into dst */
+    static const char *_group(const char *p, char *dst, int dstsize) {
+        while (*p != '\0' && *p != '(')
+            ++p;
+        if (*p == '\0')
+            return NULL;
+        ++p;
+        int i = 0;
+        for (; *p != '\0' && *p != ')'; ++p) {
+            if (i < dstsize - 1) {
+                dst[i++] = *p;
+            }
+        }
+        dst[i] = '\0';
+        return (*p == ')') ? p + 1 : NULL;
+    }
+
+    /* Parse "0.512" as thousandths: 512 */
+    static long _parse_milli(const char *p) {
+        long val = 0;
+        int decimals = -1;
+        bool negative = (*p == '-');
+        for (; *p != '\0'; ++p) {
+            if (*p == '.') {
+                decimals = 0;
+            } else if (*p >= '0' && *p <= '9' && decimals < 3) {
+                val = val * 10 + (*p - '0');
+                if (decimals >= 0) {
+                    ++decimals;
+                }
+            }
+        }
+        for (decimals = (decimals < 0 ? 0 : decimals); decimals < 3;
+                ++decimals) {
+            val *= 10;
+        }
+        return negative ? -val : val;
+    }
+
+    /* Parse "[Z]YYMMDDhhmm"; uses the last ten digits */
+    static unsigned long _parse_time(const char *p) {
+        int len = 0;
+        while (p[len] != '\0')
+            ++len;
+        if (len < 10)
+            return 0;
+        p += len - 10;
+        int v[5];
+        for (int i = 0; i < 5; ++i) {
+            v[i] = (p[i * 2] - '0') * 10 + (p[i * 2 + 1] - '0');
+        }
+        return WallClock::from_civil(2000 + v[0], v[1], v[2], v[3], v[4], 0);
+    }
+
+    void _on_header(const char *p) {
+        char buf[16];
+        _channels = 0;
+        if ((p = _group(p, buf, sizeof(buf))) == NULL)
+            return;
+        _t = _parse_time(buf);
+        if ((p = _group(p, buf, sizeof(buf))) == NULL) /* status */
+            return;
+        if ((p = _group(p, buf, sizeof(buf))) == NULL)
+            return;
+        _period_s = atoi(buf) * 60;
+        if ((p = _group(p, buf, sizeof(buf))) == NULL)
+            return;
+        int channels = atoi(buf);
+        if (channels > MAX_CHANNELS) {
+            channels = MAX_CHANNELS;
+        }
+        for (int i = 0; i < channels; ++i) {
+            if ((p = _group(p, _codes[i], sizeof(_codes[i]))) == NULL)
+                return;
+            if ((p = _group(p, buf, sizeof(buf))) == NULL)
+                return;
+            _kilo[i] = (buf[0] == 'k');
+            strncpy(_units[i], buf + (_kilo[i] ? 1 : 0), sizeof(_units[i]));
+            _units[i][sizeof(_units[i]) - 1] = '\0';
+        }
+        if (_t && _period_s) {
+            _channels = channels;
+        }
+    }
+
+    Result _on_line() {
+        char buf[16];
+        if (memcmp(_line, "P.01(", 5) == 0) {
+            _on_header(_line + 4);
+            return BUSY;
+        }
+        if (memcmp(_line, "(ERROR)", 7) == 0) {
+            return FAILED;
+        }
+        if (_line[0] != '(' || _channels == 0) {
+            return BUSY;
+        }
+        const char *p = _line;
+        for (int i = 0; i < _channels; ++i) {
+            if ((p = _group(p, buf, sizeof(buf))) == NULL) {
+                return BUSY;
+            }
+            long milli = _parse_milli(buf);
+            _values[i] = (_kilo[i] ? milli : milli / 1000);
+        }
+        _record_t = _t;
+        _t += _period_s;
+        return RECORD;
+    }
+
+public:
+    LoadProfileParser() : _linelen(0), _channels(0) {}
+
+    /* Start over, for a new request */
+    inline void reset() {
+        _linelen = 0;
+        _channels = 0;
+    }
+
+    /* Feed a single character of the data between STX and EOT/ETX */
+    Result feed(char ch) {
+        if (ch == '\n') {
+            Result res = BUSY;
+            if (_linelen != 0xff) {
+                _line[_linelen] = '\0';
+                res = _on_line();
+            }
+            _linelen = 0;
+            return res;
+        } else if (ch == '\r') {
+            ;
+        } else if (_linelen < LINE_SIZE) {
+            _line[_linelen++] = ch;
+        } else {
+            _linelen = 0xff; /* overflow, skip this line */
+        }
+        return BUSY;
+    }
+
+    /* Record accessors, valid after feed() returned RECORD */
+    inline unsigned long get_time() { return _record_t; }
+    inline unsigned short get_period() { return _period_s; }
+    inline unsigned char get_channels() { return _channels; }
+    inline long get_value(int channel) { return _values[channel]; }
+    inline const char *get_code(int channel) { return _codes[channel]; }
+    inline const char *get_unit(int channel) { return _units[channel]; }
+};
+
+#ifdef TEST_BUILD
+static int STR_EQ(const char *func, const char *got, const char *expected);
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static int _feed_profile(LoadProfileParser &parser, const char *p)
+{
+    int records = 0;
+    for (; *p != '\0'; ++p) {
+        LoadProfileParser::Result res = parser.feed(*p);
+        if (res == LoadProfileParser::RECORD) {
+            ++records;
+        } else if (res == LoadProfileParser::FAILED) {
+            return -1;
+        }
+    }
+    return records;
+}
+
+static void test_loadprofile()
+{
+    LoadProfileParser parser;
+    /* Two blocks, with the second line split across them */
+    INT_EQ("loadprofile(block1)", _feed_profile(parser, (
+        "P.01(02103140015)(00)(15)(2)(1.5)(kW)(2.5)(kW)\r\n"
+        "(0.512)(0.000)\r\n"
+        "(0.49")), 1);
+    INT_EQ("loadprofile(block2)", _feed_profile(parser, (
+        "8)(0.000)\r\n")), 1);
+    INT_EQ("loadprofile(time)", parser.get_time(),
+        WallClock::from_civil(2021, 3, 14, 0, 30, 0));
+    INT_EQ("loadprofile(period)", parser.get_period(), 900);
+    INT_EQ("loadprofile(channels)", parser.get_channels(), 2);
+    INT_EQ("loadprofile(value)", parser.get_value(0), 498);
+    STR_EQ("loadprofile(code)", parser.get_code(1), "2.5");
+    STR_EQ("loadprofile(unit)", parser.get_unit(1), "W");
+
+    /* A new header restarts the timestamps */
+    INT_EQ("loadprofile(block3)", _feed_profile(parser, (
+        "P.01(02103141200)(08)(15)(1)(1.8.0)(Wh)\r\n"
+        "(12)\r\n")), 1);
+    INT_EQ("loadprofile(time)", parser.get_time(),
+        WallClock::from_civil(2021, 3, 14, 12, 0, 0));
+    INT_EQ("loadprofile(value)", parser.get_value(0), 12);
+
+    parser.reset();
+    INT_EQ("loadprofile(error)", _feed_profile(parser, "(ERROR)\r\n"), -1);
+    INT_EQ("loadprofile(no-header)", _feed_profile(parser, "(1.0)\r\n"), 0);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_LOADPROFILE_H
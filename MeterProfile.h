@@ -0,0 +1,148 @@
+#ifndef INCLUDED_METERPROFILE_H
+#define INCLUDED_METERPROFILE_H
+
+/**
+ * Meter profiles hold what we know about the meter (and the board we read
+ * it with) at compile time: how fast it may react, what its values look
+ * like, which registers it has and which noise to expect. Pick one with
+ * METER_PROFILE in config.h; the protocol engine uses it as Meter::...
+ * so the compiler drops the code paths the meter does not need.
+ *
+ * Profile members:
+ * - REACTION_MS: delay before we send; the spec allows 20ms for meters
+ *   that say so (uppercase manufacturer letter), 200ms otherwise;
+ * - BAUD_CHAR: the baud rate identification char after which we switch
+ *   to 9600 baud ('5'), or 0 to stay at 300 baud;
+ * - ENERGY_DIGITS, ENERGY_DECIMALS: the fixed layout of the energy
+ *   values, like "(0032835.698*kWh)"; 0 digits for "any layout";
+ * - HAS_CLOCK: whether the meter has the 0.9.1/0.9.2 time/date registers;
+ * - SKIPS_DEL: whether to drop stray 0x7f (DEL) bytes at the start of a
+ *   response; only seen on the Arduino Uno (CustomSoftwareSerial).
+ *
+ * Usage:
+ *
+ *   typedef MeterProfileIskraME162 Meter;
+ *   unsigned long wh;
+ *   if (meter_parse_energy<Meter>("(0032835.698*kWh)", 17, &wh))
+ *       ...
+ */
+
+#if defined(ARDUINO_ARCH_AVR)
+# define METER_PROFILE_BOARD_SKIPS_DEL true
+#else
+# define METER_PROFILE_BOARD_SKIPS_DEL false
+#endif
+
+/* The ISKRA ME-162, the meter this project was written for */
+struct MeterProfileIskraME162
+{
+    static const unsigned short REACTION_MS = 20;
+    static const char BAUD_CHAR = '5';
+    static const unsigned char ENERGY_DIGITS = 7;
+    static const unsigned char ENERGY_DECIMALS = 3;
+    static const bool HAS_CLOCK = true;
+    static const bool SKIPS_DEL = METER_PROFILE_BOARD_SKIPS_DEL;
+};
+
+/* Any IEC 62056-21 mode C meter with 1.8.0/2.8.0 in kWh: be careful */
+struct MeterProfileGeneric
+{
+    static const unsigned short REACTION_MS = 200;
+    static const char BAUD_CHAR = '5';
+    static const unsigned char ENERGY_DIGITS = 0;
+    static const unsigned char ENERGY_DECIMALS = 0;
+    static const bool HAS_CLOCK = false;
+    static const bool SKIPS_DEL = METER_PROFILE_BOARD_SKIPS_DEL;
+};
+
+/* "(0032835.698*kWh)" to Wh; data is not NUL-terminated at end */
+template<class P> static bool meter_parse_energy(
+        const char *data, unsigned end, unsigned long *wh)
+{
+    static const char unit[] = "*kWh)";
+    unsigned long val = 0;
+    unsigned pos = 1;
+
+    if (end < 1 + 1 + 5 || data[0] != '(') {
+        return false;
+    }
+    if (P::ENERGY_DIGITS) {
+        /* Fixed layout: the bounds are known, only check the chars */
+        if (end != 1u + P::ENERGY_DIGITS + 1 + P::ENERGY_DECIMALS + 5 ||
+                data[1 + P::ENERGY_DIGITS] != '.') {
+            return false;
+        }
+        for (; pos < end - 5; ++pos) {
+            if (pos == 1u + P::ENERGY_DIGITS) {
+                continue; /* the '.' */
+            }
+            unsigned digit = (unsigned char)data[pos] - '0';
+            if (digit > 9) {
+                return false;
+            }
+            val = val * 10 + digit;
+        }
+    } else {
+        /* Any number of digits and decimals (up to Wh precision) */
+        unsigned decimals = 0;
+        bool dot = false;
+        for (; pos < end - 5; ++pos) {
+            if (data[pos] == '.' && !dot) {
+                dot = true;
+            } else if (data[pos] >= '0' && data[pos] <= '9') {
+                if (!dot || decimals < 3) {
+                    val = val * 10 + (data[pos] - '0');
+                    decimals += dot;
+                }
+            } else {
+                return false;
+            }
+        }
+        for (; decimals < 3; ++decimals) {
+            val *= 10;
+        }
+    }
+    for (unsigned i = 0; i < 5; ++i) {
+        if (data[end - 5 + i] != unit[i]) {
+            return false;
+        }
+    }
+    *wh = val;
+    return true;
+}
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_meterprofile()
+{
+    unsigned long wh = 0;
+    INT_EQ("meterprofile(me162)", meter_parse_energy<MeterProfileIskraME162>(
+        "(0032835.698*kWh)", 17, &wh), 1);
+    INT_EQ("meterprofile(me162-wh)", wh, 32835698);
+    INT_EQ("meterprofile(me162-layout)",
+        meter_parse_energy<MeterProfileIskraME162>(
+            "(032835.698*kWh)", 16, &wh), 0);
+    INT_EQ("meterprofile(me162-digit)",
+        meter_parse_energy<MeterProfileIskraME162>(
+            "(003283:.698*kWh)", 17, &wh), 0);
+    INT_EQ("meterprofile(me162-unit)",
+        meter_parse_energy<MeterProfileIskraME162>(
+            "(0032835.698*kvarh)", 19, &wh), 0);
+
+    INT_EQ("meterprofile(generic)", meter_parse_energy<MeterProfileGeneric>(
+        "(032835.7*kWh)", 14, &wh), 1);
+    INT_EQ("meterprofile(generic-wh)", wh, 32835700);
+    INT_EQ("meterprofile(generic-long)",
+        meter_parse_energy<MeterProfileGeneric>(
+            "(0032835.6985*kWh)", 18, &wh), 1);
+    INT_EQ("meterprofile(generic-long-wh)", wh, 32835698);
+    INT_EQ("meterprofile(generic-bad)", meter_parse_energy<MeterProfileGeneric>(
+        "(0032835.698*kWh", 16, &wh), 0);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_METERPROFILE_H
@@ -0,0 +1,391 @@
+#ifndef INCLUDED_PAYLOADDECODER_H
+#define INCLUDED_PAYLOADDECODER_H
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE2__) && !defined(PAYLOAD_DECODER_NO_SIMD)
+# include <emmintrin.h>
+# define PAYLOAD_DECODER_SSE2
+#endif
+
+#include "PayloadFields.h"
+
+/**
+ * PayloadDecoder decodes the MQTT payloads published by this project, for
+ * use by the ingest side. It is header-only and does not allocate: the
+ * decoded message refers to the payload buffer, which must outlive it.
+ *
+ * Delimiters are found 16 bytes at a time with SSE2 (if available at
+ * compile time; define PAYLOAD_DECODER_NO_SIMD for the scalar version).
+ * Numbers are parsed in place. Values are not percent-decoded, as the
+ * firmware does not encode them either.
+ *
+ * Usage:
+ *
+ *   PayloadMessage msg;
+ *   if (PayloadDecoder::decode(buf, len, &msg)) {
+ *       if (msg.has(PayloadMessage::E_INST_POWER_W))
+ *           watt = msg.get_int(PayloadMessage::E_INST_POWER_W);
+ *       // the readout registers (reg_<code>), or the DATA= readout of
+ *       // older firmware, register by register
+ *       PayloadSlice data = msg.get_str(PayloadMessage::DATA);
+ *       const char *p = data.p;
+ *       PayloadRegister reg;
+ *       while (PayloadDecoder::next_register(p, data.p + data.len, &reg))
+ *           ...
+ *   }
+ */
+struct PayloadSlice {
+    const char *p;
+    size_t len;
+
+    inline bool equals(const char *s) const {
+        return strlen(s) == len && memcmp(p, s, len) == 0;
+    }
+};
+
+/* A single "1.8.0(0033402.264*kWh)" line of the DATA= readout */
+struct PayloadRegister {
+    PayloadSlice code;          /* "1.8.0" */
+    PayloadSlice unit;          /* "kWh", or empty */
+    long long milli;            /* 33402264: the value times 1000 */
+};
+
+class PayloadMessage
+{
+public:
+    enum Type { STRING, INTEGER, LIST, RAW };
+
+    enum Field {
+#define PF_ENUM(name, type) name,
+        PAYLOAD_FIELDS(PF_ENUM)
+#undef PF_ENUM
+        FIELD_COUNT
+    };
+
+    /* present has a bit per field */
+    typedef char field_count_check[FIELD_COUNT <= 64 ? 1 : -1];
+
+    static const unsigned char MAX_HIST = 4;
+    static const unsigned char MAX_REGS = 12;
+
+    unsigned long long present;         /* 1 << Field */
+    PayloadSlice values[FIELD_COUNT];
+    long long numbers[FIELD_COUNT];     /* for INTEGER fields */
+    unsigned char hist_count;           /* hist_<code>_<unit> fields */
+    PayloadSlice hist_keys[MAX_HIST];   /* "1.5_W" (without "hist_") */
+    PayloadSlice hist_values[MAX_HIST]; /* LIST */
+    unsigned char reg_count;            /* reg_<code> fields */
+    PayloadSlice reg_keys[MAX_REGS];    /* "1.8.0" (without "reg_") */
+    long long reg_values[MAX_REGS];     /* INTEGER */
+    unsigned char unknown_count;        /* ignored key=value pairs */
+
+    inline bool has(Field f) const { return present & (1ULL << f); }
+    inline long long get_int(Field f) const { return numbers[f]; }
+    inline PayloadSlice get_str(Field f) const { return values[f]; }
+
+    static inline const char *get_key(Field f) {
+        static const char *const keys[FIELD_COUNT] = {
+#define PF_KEY(name, type) PF_KEY_ ## name,
+            PAYLOAD_FIELDS(PF_KEY)
+#undef PF_KEY
+        };
+        return keys[f];
+    }
+
+    static inline Type get_type(Field f) {
+        static const unsigned char types[FIELD_COUNT] = {
+#define PF_TYPE(name, type) type,
+            PAYLOAD_FIELDS(PF_TYPE)
+#undef PF_TYPE
+        };
+        return (Type)types[f];
+    }
+};
+
+class PayloadDecoder
+{
+private:
+    struct Key {
+        const char *name;
+        unsigned char len;
+    };
+
+    static const Key *_keys() {
+        static const Key keys[PayloadMessage::FIELD_COUNT] = {
+#define PF_KEYLEN(name, type) {PF_KEY_ ## name, sizeof(PF_KEY_ ## name) - 1},
+            PAYLOAD_FIELDS(PF_KEYLEN)
+#undef PF_KEYLEN
+        };
+        return keys;
+    }
+
+    /* Find the field; most keys have a distinct length, so the memcmp is
+     * mostly done once */
+    static int _lookup(const char *key, size_t len) {
+        const Key *keys = _keys();
+        for (int i = 0; i < PayloadMessage::FIELD_COUNT; ++i) {
+            if (keys[i].len == len && memcmp(keys[i].name, key, len) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+public:
+    /* Find the first c1 or c2 in [p, end); end if there is none */
+    static const char *scan(const char *p, const char *end, char c1, char c2) {
+#ifdef PAYLOAD_DECODER_SSE2
+        const __m128i v1 = _mm_set1_epi8(c1);
+        const __m128i v2 = _mm_set1_epi8(c2);
+        for (; end - p >= 16; p += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+            int mask = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(chunk, v1), _mm_cmpeq_epi8(chunk, v2)));
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+#endif
+        for (; p < end; ++p) {
+            if (*p == c1 || *p == c2) {
+                return p;
+            }
+        }
+        return end;
+    }
+
+    /* Parse a signed decimal [p, end) into val; false if it is not one */
+    static bool parse_int(const char *p, const char *end, long long *val) {
+        bool negative = (p < end && *p == '-');
+        if (negative) {
+            ++p;
+        }
+        if (p == end || end - p > 18) {
+            return false;
+        }
+        long long v = 0;
+        for (; p < end; ++p) {
+            unsigned digit = (unsigned char)*p - '0';
+            if (digit > 9) {
+                return false;
+            }
+            v = v * 10 + digit;
+        }
+        *val = (negative ? -v : v);
+        return true;
+    }
+
+    /* Get the next number of a LIST value; p is advanced past it */
+    static bool next_int(const char *&p, const char *end, long long *val) {
+        if (p >= end) {
+            return false;
+        }
+        const char *comma = scan(p, end, ',', ',');
+        bool ok = parse_int(p, comma, val);
+        p = (comma < end ? comma + 1 : end);
+        return ok;
+    }
+
+    /* Parse "0033402.264" as thousandths; false if it is not a number */
+    static bool parse_milli(const char *p, const char *end, long long *val) {
+        const char *dot = scan(p, end, '.', '.');
+        long long whole = 0, frac = 0;
+        if (dot == p || !parse_int(p, dot, &whole) || whole < 0) {
+            return false;
+        }
+        int decimals = 0;
+        if (dot < end) {
+            const char *q = dot + 1;
+            for (; q < end && decimals < 3; ++q, ++decimals) {
+                unsigned digit = (unsigned char)*q - '0';
+                if (digit > 9) {
+                    return false;
+                }
+                frac = frac * 10 + digit;
+            }
+        }
+        for (; decimals < 3; ++decimals) {
+            frac *= 10;
+        }
+        *val = whole * 1000 + frac;
+        return true;
+    }
+
+    /* Get the next register of a DATA= readout; p is advanced past it.
+     * Lines without a "(value)" (like the final "!") are skipped. */
+    static bool next_register(
+            const char *&p, const char *end, PayloadRegister *reg) {
+        while (p < end) {
+            const char *eol = scan(p, end, '\n', '\n');
+            const char *line = p;
+            const char *line_end = (eol > p && eol[-1] == '\r' ? eol - 1 : eol);
+            p = (eol < end ? eol + 1 : end);
+
+            const char *open = scan(line, line_end, '(', '(');
+            if (open == line_end || line_end[-1] != ')') {
+                continue;
+            }
+            const char *close = line_end - 1;
+            const char *star = scan(open + 1, close, '*', '*');
+            reg->code.p = line;
+            reg->code.len = open - line;
+            reg->unit.p = (star < close ? star + 1 : close);
+            reg->unit.len = close - reg->unit.p;
+            if (!parse_milli(open + 1, star, &reg->milli)) {
+                reg->milli = 0;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    /* Decode a complete payload; false if it is malformed */
+    static bool decode(const char *msg, size_t len, PayloadMessage *out) {
+        const char *p = msg;
+        const char *end = msg + len;
+        out->present = 0;
+        out->hist_count = 0;
+        out->reg_count = 0;
+        out->unknown_count = 0;
+
+        while (p < end) {
+            const char *eq = scan(p, end, '=', '&');
+            if (eq == end || *eq != '=' || eq == p) {
+                return false;
+            }
+            const char *key = p;
+            size_t keylen = eq - p;
+            const char *val = eq + 1;
+            int field = _lookup(key, keylen);
+
+            const char *val_end;
+            if (field >= 0 && PayloadMessage::get_type(
+                    (PayloadMessage::Field)field) == PayloadMessage::RAW) {
+                val_end = end;
+            } else {
+                val_end = scan(val, end, '&', '&');
+            }
+            p = (val_end < end ? val_end + 1 : end);
+
+            if (field < 0) {
+                if (keylen > sizeof(PF_KEY_HIST_PREFIX) - 1 &&
+                        memcmp(key, PF_KEY_HIST_PREFIX,
+                               sizeof(PF_KEY_HIST_PREFIX) - 1) == 0 &&
+                        out->hist_count < PayloadMessage::MAX_HIST) {
+                    PayloadSlice &k = out->hist_keys[out->hist_count];
+                    k.p = key + sizeof(PF_KEY_HIST_PREFIX) - 1;
+                    k.len = keylen - (sizeof(PF_KEY_HIST_PREFIX) - 1);
+                    out->hist_values[out->hist_count].p = val;
+                    out->hist_values[out->hist_count].len = val_end - val;
+                    ++out->hist_count;
+                } else if (keylen > sizeof(PF_KEY_REG_PREFIX) - 1 &&
+                        memcmp(key, PF_KEY_REG_PREFIX,
+                               sizeof(PF_KEY_REG_PREFIX) - 1) == 0 &&
+                        out->reg_count < PayloadMessage::MAX_REGS) {
+                    PayloadSlice &k = out->reg_keys[out->reg_count];
+                    k.p = key + sizeof(PF_KEY_REG_PREFIX) - 1;
+                    k.len = keylen - (sizeof(PF_KEY_REG_PREFIX) - 1);
+                    if (!parse_int(val, val_end,
+                                   &out->reg_values[out->reg_count])) {
+                        return false;
+                    }
+                    ++out->reg_count;
+                } else if (out->unknown_count < 255) {
+                    ++out->unknown_count;
+                }
+                continue;
+            }
+            out->values[field].p = val;
+            out->values[field].len = val_end - val;
+            if (PayloadMessage::get_type((PayloadMessage::Field)field) ==
+                    PayloadMessage::INTEGER &&
+                    !parse_int(val, val_end, &out->numbers[field])) {
+                return false;
+            }
+            out->present |= (1ULL << field);
+        }
+        return true;
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_payloaddecoder()
+{
+    PayloadMessage msg;
+    const char *publish = (
+        "device_id=EUI48:11:22:33:44:55:66&"
+        "e_pos_act_energy_wh=33271493&e_neg_act_energy_wh=7784&"
+        "e_inst_power_w=-1397&dbg_uptime=31267&something_new=1");
+    INT_EQ("payloaddecoder(publish)",
+        PayloadDecoder::decode(publish, strlen(publish), &msg), 1);
+    INT_EQ("payloaddecoder(device_id)",
+        msg.get_str(PayloadMessage::DEVICE_ID).equals(
+            "EUI48:11:22:33:44:55:66"), 1);
+    INT_EQ("payloaddecoder(energy)",
+        (int)msg.get_int(PayloadMessage::E_POS_ACT_ENERGY_WH), 33271493);
+    INT_EQ("payloaddecoder(power)",
+        (int)msg.get_int(PayloadMessage::E_INST_POWER_W), -1397);
+    INT_EQ("payloaddecoder(absent)", msg.has(PayloadMessage::DBG_PULSE), 0);
+    INT_EQ("payloaddecoder(unknown)", msg.unknown_count, 1);
+
+    /* DATA= is the remainder; this one is longer than 16 bytes per line */
+    const char *readout = (
+        "device_id=X&id=ISK5ME162-0033&DATA=C.1.0(28342193)\r\n"
+        "1.8.0(0033402.264*kWh)\r\n2.8.0(0000013.465*kWh)\r\n!\r\n");
+    INT_EQ("payloaddecoder(readout)",
+        PayloadDecoder::decode(readout, strlen(readout), &msg), 1);
+    PayloadSlice data = msg.get_str(PayloadMessage::DATA);
+    const char *p = data.p;
+    PayloadRegister reg;
+    int count = 0;
+    while (PayloadDecoder::next_register(p, data.p + data.len, &reg)) {
+        ++count;
+    }
+    INT_EQ("payloaddecoder(registers)", count, 3);
+    INT_EQ("payloaddecoder(last-code)", reg.code.equals("2.8.0"), 1);
+    INT_EQ("payloaddecoder(last-unit)", reg.unit.equals("kWh"), 1);
+    INT_EQ("payloaddecoder(last-milli)", (int)reg.milli, 13465);
+
+    /* Changed registers only */
+    const char *delta = (
+        "device_id=X&readout=delta&reg_1.8.0=33402267&reg_F.F=0");
+    INT_EQ("payloaddecoder(delta)",
+        PayloadDecoder::decode(delta, strlen(delta), &msg), 1);
+    INT_EQ("payloaddecoder(delta-regs)", msg.reg_count, 2);
+    INT_EQ("payloaddecoder(delta-key)", msg.reg_keys[0].equals("1.8.0"), 1);
+    INT_EQ("payloaddecoder(delta-value)", (int)msg.reg_values[0], 33402267);
+    INT_EQ("payloaddecoder(delta-type)",
+        msg.get_str(PayloadMessage::READOUT).equals("delta"), 1);
+
+    /* Lists and load profile channels */
+    const char *hist = (
+        "device_id=X&hist_t0=1615681800&hist_period_s=900&"
+        "hist_1.5_W=512,-498,505");
+    INT_EQ("payloaddecoder(hist)",
+        PayloadDecoder::decode(hist, strlen(hist), &msg), 1);
+    INT_EQ("payloaddecoder(hist)", msg.hist_count, 1);
+    INT_EQ("payloaddecoder(hist-key)", msg.hist_keys[0].equals("1.5_W"), 1);
+    p = msg.hist_values[0].p;
+    long long val, sum = 0;
+    while (PayloadDecoder::next_int(
+            p, msg.hist_values[0].p + msg.hist_values[0].len, &val)) {
+        sum += val;
+    }
+    INT_EQ("payloaddecoder(hist-sum)", (int)sum, 519);
+
+    /* Malformed */
+    INT_EQ("payloaddecoder(bad-int)",
+        PayloadDecoder::decode("e_inst_power_w=12a", 18, &msg), 0);
+    INT_EQ("payloaddecoder(no-eq)",
+        PayloadDecoder::decode("device_id&x=1", 13, &msg), 0);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_PAYLOADDECODER_H
@@ -0,0 +1,102 @@
+#ifndef INCLUDED_PAYLOADFIELDS_H
+#define INCLUDED_PAYLOADFIELDS_H
+
+/**
+ * The keys of the application/x-www-form-urlencoded MQTT payloads, shared
+ * by the firmware (publish() and friends) and the PayloadDecoder, so the
+ * two cannot drift apart.
+ *
+ * The firmware uses the key literals directly:
+ *
+ *   mqttClient.print(F("&" PF_KEY_E_INST_POWER_W "="));
+ *
+ * The decoder uses the PAYLOAD_FIELDS() X-macro, which refers to the same
+ * literals: a field without a PF_KEY_ define will not compile.
+ *
+ * Types:
+ * - STRING = any value, as is (values are not percent-encoded);
+ * - INTEGER = a signed decimal number;
+ * - LIST = comma separated signed decimal numbers;
+ * - RAW = the rest of the payload, '&' included (only DATA, which is last;
+ *   sent by older firmware, before the reg_<code> fields).
+ */
+#define PF_KEY_DEVICE_ID            "device_id"
+#define PF_KEY_ID                   "id"
+#define PF_KEY_DATA                 "DATA"
+#define PF_KEY_E_POS_ACT_ENERGY_WH  "e_pos_act_energy_wh"
+#define PF_KEY_E_NEG_ACT_ENERGY_WH  "e_neg_act_energy_wh"
+#define PF_KEY_E_INST_POWER_W       "e_inst_power_w"
+#define PF_KEY_DBG_UPTIME           "dbg_uptime"
+#define PF_KEY_DBG_PULSE            "dbg_pulse"
+#define PF_KEY_DBG_LAG_MS           "dbg_lag_ms"
+#define PF_KEY_HIST_T0              "hist_t0"
+#define PF_KEY_HIST_PERIOD_S        "hist_period_s"
+#define PF_KEY_GRID_T0              "grid_t0"
+#define PF_KEY_GRID_STEP_S          "grid_step_s"
+#define PF_KEY_GRID_POWER_W         "grid_power_w"
+#define PF_KEY_BASELOAD_W           "baseload_w"
+#define PF_KEY_BASELOAD_NIGHT_W     "baseload_night_w"
+#define PF_KEY_ALIGN_T              "align_t"
+#define PF_KEY_SHADOW_NAMES         "shadow_names"
+#define PF_KEY_SHADOW_POWER_W       "shadow_power_w"
+#define PF_KEY_SHADOW_MAD_W         "shadow_mad_w"
+#define PF_KEY_SHADOW_BIAS_W        "shadow_bias_w"
+#define PF_KEY_SHADOW_MAX_W         "shadow_max_w"
+#define PF_KEY_SHADOW_SKIPPED       "shadow_skipped"
+#define PF_KEY_SHADOW_MAX_US        "shadow_max_us"
+#define PF_KEY_READOUT              "readout"
+#define PF_KEY_E_AVG_POWER_W        "e_avg_power_w"
+#define PF_KEY_E_MIN_POWER_W        "e_min_power_w"
+#define PF_KEY_E_MAX_POWER_W        "e_max_power_w"
+#define PF_KEY_WINDOW_S             "window_s"
+#define PF_KEY_STEPS_T0             "steps_t0"
+#define PF_KEY_STEPS_PERIOD_S       "steps_period_s"
+#define PF_KEY_STEP_W               "step_w"
+#define PF_KEY_STEP_S               "step_s"
+#define PF_KEY_STEP_N               "step_n"
+#define PF_KEY_STEP_WH              "step_wh"
+
+/* Load profile channels are published as hist_<code>_<unit> */
+#define PF_KEY_HIST_PREFIX          "hist_"
+/* Data readout registers are published as reg_<code> */
+#define PF_KEY_REG_PREFIX           "reg_"
+
+#define PAYLOAD_FIELDS(X) \
+    X(DEVICE_ID, STRING) \
+    X(ID, STRING) \
+    X(DATA, RAW) \
+    X(E_POS_ACT_ENERGY_WH, INTEGER) \
+    X(E_NEG_ACT_ENERGY_WH, INTEGER) \
+    X(E_INST_POWER_W, INTEGER) \
+    X(DBG_UPTIME, INTEGER) \
+    X(DBG_PULSE, STRING) \
+    X(DBG_LAG_MS, INTEGER) \
+    X(HIST_T0, INTEGER) \
+    X(HIST_PERIOD_S, INTEGER) \
+    X(GRID_T0, INTEGER) \
+    X(GRID_STEP_S, INTEGER) \
+    X(GRID_POWER_W, LIST) \
+    X(BASELOAD_W, INTEGER) \
+    X(BASELOAD_NIGHT_W, INTEGER) \
+    X(ALIGN_T, INTEGER) \
+    X(SHADOW_NAMES, STRING) \
+    X(SHADOW_POWER_W, LIST) \
+    X(SHADOW_MAD_W, LIST) \
+    X(SHADOW_BIAS_W, LIST) \
+    X(SHADOW_MAX_W, LIST) \
+    X(SHADOW_SKIPPED, LIST) \
+    X(SHADOW_MAX_US, INTEGER) \
+    X(READOUT, STRING) \
+    X(E_AVG_POWER_W, INTEGER) \
+    X(E_MIN_POWER_W, INTEGER) \
+    X(E_MAX_POWER_W, INTEGER) \
+    X(WINDOW_S, INTEGER) \
+    X(STEPS_T0, INTEGER) \
+    X(STEPS_PERIOD_S, INTEGER) \
+    X(STEP_W, LIST) \
+    X(STEP_S, LIST) \
+    X(STEP_N, LIST) \
+    X(STEP_WH, LIST)
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_PAYLOADFIELDS_H
@@ -0,0 +1,220 @@
+#ifndef INCLUDED_POWERGRID_H
+#define INCLUDED_POWERGRID_H
+
+/**
+ * PowerGrid resamples the watt hour edges of the positive (1.8.0) and
+ * negative (2.8.0) energy totals onto a uniform time grid, producing the
+ * average net power for every slot (of e.g. 10s) aligned to the wall clock.
+ *
+ * Every time a total changes, the energy since the previous change is
+ * spread evenly over that interval and attributed to the slots it overlaps,
+ * proportional to the overlap. A slot is complete once both totals have
+ * moved past its end. A total that does not change for a long time (like
+ * 2.8.0 without solar panels) is considered idle: it then stops holding up
+ * the other total. Its energy will go to the slots after that, when it
+ * does change eventually.
+ *
+ * Usage:
+ *
+ *   PowerGrid grid(10000);
+ *   grid.set_alignment(millis_at_some_wallclock_boundary);
+ *   grid.set_energy_total(0, millis(), positive_wh);
+ *   grid.set_energy_total(1, millis(), negative_wh);
+ *   grid.tick(millis());
+ *   while (grid.pop(&watt, &slot_start_ms))
+ *       ...
+ */
+class PowerGrid
+{
+public:
+    static const unsigned char MAX_SLOTS = 32;
+
+private:
+    unsigned long _slot_ms;
+    unsigned long _idle_ms;     /* when a total is considered idle */
+    unsigned long _phase;       /* millis() at some slot boundary */
+    unsigned long _base;        /* millis() at the start of _wh[0] */
+    bool _aligned;
+    bool _started;
+    bool _have[2];
+    unsigned long _from_t[2];   /* energy up to here has been attributed */
+    unsigned long _from_wh[2];
+    float _wh[MAX_SLOTS];       /* net energy per slot, starting at _base */
+
+    /* Spread wh over [t0, t1) and attribute it to the slots */
+    void _attribute(unsigned long t0, unsigned long t1, float wh) {
+        if ((long)(t1 - t0) <= 0) {
+            t1 = t0 + 1; /* a (pulse) corrected time before a tick() */
+        }
+        unsigned long dt = t1 - t0;
+        if ((long)(t0 - _base) < 0) {
+            /* Started halfway: only count the part after _base */
+            if ((long)(t1 - _base) <= 0) {
+                return;
+            }
+            wh = wh * (float)(t1 - _base) / (float)dt;
+            t0 = _base;
+            dt = t1 - t0;
+        }
+        unsigned long idx = (t0 - _base) / _slot_ms;
+        unsigned long start = _base + idx * _slot_ms;
+        for (; idx < MAX_SLOTS && (long)(start - t1) < 0;
+                ++idx, start += _slot_ms) {
+            unsigned long lo = ((long)(t0 - start) > 0 ? t0 : start);
+            unsigned long hi = (
+                (long)(t1 - (start + _slot_ms)) < 0 ? t1 : start + _slot_ms);
+            _wh[idx] += wh * (float)(hi - lo) / (float)dt;
+        }
+    }
+
+    /* Time since the last slot boundary (works across millis() wrap) */
+    inline unsigned long _offset(unsigned long time_ms) {
+        long rem = (long)(time_ms - _phase) % (long)_slot_ms;
+        return (rem < 0 ? rem + _slot_ms : rem);
+    }
+
+public:
+    PowerGrid(unsigned long slot_ms) :
+            _slot_ms(slot_ms), _aligned(false), _started(false) {
+        _idle_ms = (MAX_SLOTS - 2) * slot_ms;
+        if (_idle_ms > 300000UL) {
+            _idle_ms = 300000UL; /* same horizon as the WattGauge */
+        }
+        _have[0] = _have[1] = false;
+    }
+
+    /* Get the slot length in milliseconds */
+    inline unsigned long get_slot_ms() {
+        return _slot_ms;
+    }
+
+    /* Set (or update) the millis() value of a wall clock slot boundary.
+     * Small corrections are ignored, larger ones restart the grid. */
+    void set_alignment(unsigned long boundary_ms) {
+        if (_aligned) {
+            unsigned long shift = _offset(boundary_ms);
+            if (shift < 1000 || shift > _slot_ms - 1000) {
+                return;
+            }
+        }
+        _phase = boundary_ms;
+        _aligned = true;
+        _started = false;
+        _have[0] = _have[1] = false;
+    }
+
+    /* Feed a total (0 = positive, 1 = negative) in Wh, read at time_ms */
+    void set_energy_total(int idx, unsigned long time_ms, unsigned long wh) {
+        if (!_aligned) {
+            return;
+        }
+        if (!_have[idx] || wh < _from_wh[idx]) {
+            _from_t[idx] = time_ms;
+            _from_wh[idx] = wh;
+            _have[idx] = true;
+            if (!_started) {
+                /* First slot starts at the next boundary */
+                unsigned long offset = _offset(time_ms);
+                _base = time_ms + (offset ? _slot_ms - offset : 0);
+                _started = true;
+                for (int i = 0; i < MAX_SLOTS; ++i) {
+                    _wh[i] = 0;
+                }
+            }
+            return;
+        }
+        if (wh == _from_wh[idx]) {
+            return;
+        }
+        float delta = (float)(wh - _from_wh[idx]);
+        _attribute(_from_t[idx], time_ms, (idx == 0 ? delta : -delta));
+        _from_t[idx] = time_ms;
+        _from_wh[idx] = wh;
+    }
+
+    /* Call regularly: lets idle totals stop holding up the grid */
+    void tick(unsigned long time_ms) {
+        for (int i = 0; i < 2; ++i) {
+            if (_have[i] && (time_ms - _from_t[i]) > _idle_ms) {
+                _from_t[i] = time_ms;
+            }
+        }
+    }
+
+    /* Get the next completed slot, as average power in Watt */
+    bool pop(int *watt, unsigned long *slot_start_ms) {
+        if (!_started || !(_have[0] || _have[1])) {
+            return false;
+        }
+        unsigned long end = _base + _slot_ms;
+        for (int i = 0; i < 2; ++i) {
+            if (_have[i] && (long)(_from_t[i] - end) < 0) {
+                return false;
+            }
+        }
+        float wh = _wh[0];
+        *watt = (int)(wh * 3600000.0f / (float)_slot_ms +
+                      (wh < 0 ? -0.5f : 0.5f));
+        *slot_start_ms = _base;
+        for (int i = 1; i < MAX_SLOTS; ++i) {
+            _wh[i - 1] = _wh[i];
+        }
+        _wh[MAX_SLOTS - 1] = 0;
+        _base = end;
+        return true;
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_powergrid()
+{
+    int watt;
+    unsigned long start;
+    PowerGrid grid(10000);
+
+    /* Nothing happens until we're aligned */
+    grid.set_energy_total(0, 1000, 100);
+    INT_EQ("powergrid(unaligned)", grid.pop(&watt, &start), 0);
+
+    grid.set_alignment(0);
+    grid.set_energy_total(0, 5000, 100);    /* first slot at 10000 */
+    grid.set_energy_total(1, 5100, 7);
+    grid.set_energy_total(1, 9000, 7);
+    grid.set_energy_total(0, 15000, 101);   /* 1 Wh, half before 10s */
+    grid.set_energy_total(0, 27000, 104);
+    INT_EQ("powergrid(held-up)", grid.pop(&watt, &start), 0);
+    grid.set_energy_total(1, 27100, 7);     /* unchanged: still holding */
+    INT_EQ("powergrid(held-up)", grid.pop(&watt, &start), 0);
+    grid.set_energy_total(1, 28000, 8);     /* 1 Wh back over 5.1..28s */
+    INT_EQ("powergrid(pop)", grid.pop(&watt, &start), 1);
+    INT_EQ("powergrid(start)", start, 10000);
+    /* [10, 20): +0.5 (5/10 of 1) +1.25 (5/12 of 3) -0.437 (10/22.9)
+     * = 1.313 Wh in 10s = 473 W */
+    INT_EQ("powergrid(watt)", watt, 473);
+    /* [20, 30) is not complete: 1.8.0 was last seen at 27s */
+    INT_EQ("powergrid(pop)", grid.pop(&watt, &start), 0);
+
+    /* An idle negative total does not hold up the grid forever */
+    grid.set_energy_total(0, 331000, 105);
+    INT_EQ("powergrid(idle)", grid.pop(&watt, &start), 0);
+    grid.tick(331000);
+    int slots = 0;
+    long energy = 0;
+    while (grid.pop(&watt, &start)) {
+        ++slots;
+        energy += watt;
+    }
+    INT_EQ("powergrid(idle-slots)", slots, 31);
+    INT_EQ("powergrid(idle-start)", start, 320000);
+    /* [20, 30): +1.75 (7/12 of 3) +0.01 (3/304) -0.349 (8/22.9) = 508 W;
+     * then 1 Wh over 304s is 11.8 W per slot; rounded 12 W, 30 slots */
+    INT_EQ("powergrid(idle-energy)", energy, 508 + 30 * 12);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_POWERGRID_H
@@ -0,0 +1,86 @@
+#ifndef INCLUDED_PUBLISHPOLICY_H
+#define INCLUDED_PUBLISHPOLICY_H
+
+/**
+ * PublishPolicy decides whether it is time to publish, given the time
+ * since the last publish, the current power and whether the gauge saw a
+ * significant change. Publish every max_interval_s (120) or more often:
+ * every high_power_interval_s (60) when the power is above high_power_w
+ * (400, either direction), because then we have more detail, and after
+ * change_interval_s (25) when there is a significant change.
+ *
+ * With wall clock aligned publishes, the regular publishes are scheduled
+ * elsewhere; then only should_publish_change() is asked for the
+ * (out-of-band) publishes in between.
+ *
+ * This is the logic of STATE_MAYBE_PUBLISH, shared with the host tools
+ * that simulate what it does at fleet scale.
+ *
+ * Usage:
+ *
+ *   PublishPolicy policy;
+ *   if (policy.should_publish(
+ *           tdelta_s, gauge.get_instantaneous_power(),
+ *           gauge.has_significant_change())) {
+ *       publish();
+ *       gauge.reset();
+ *   }
+ */
+struct PublishPolicy
+{
+    unsigned short max_interval_s;
+    unsigned short high_power_interval_s;
+    unsigned short change_interval_s;
+    int high_power_w;
+
+    PublishPolicy(
+            unsigned short max_interval_s = 120,
+            unsigned short high_power_interval_s = 60,
+            unsigned short change_interval_s = 25,
+            int high_power_w = 400) :
+        max_interval_s(max_interval_s),
+        high_power_interval_s(high_power_interval_s),
+        change_interval_s(change_interval_s),
+        high_power_w(high_power_w) {}
+
+    bool should_publish(
+            unsigned long tdelta_s, int power, bool significant_change) const {
+        return (
+            tdelta_s >= max_interval_s ||
+            (tdelta_s >= high_power_interval_s &&
+             !(-high_power_w < power && power < high_power_w)) ||
+            (tdelta_s >= change_interval_s && significant_change));
+    }
+
+    bool should_publish_change(
+            unsigned long tdelta_s, bool significant_change) const {
+        return (tdelta_s >= change_interval_s && significant_change);
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_publishpolicy()
+{
+    PublishPolicy policy;
+    INT_EQ("publishpolicy(early)", policy.should_publish(59, 1000, false), 0);
+    INT_EQ("publishpolicy(high)", policy.should_publish(60, 1000, false), 1);
+    INT_EQ("publishpolicy(high-neg)", policy.should_publish(60, -400, false), 1);
+    INT_EQ("publishpolicy(low)", policy.should_publish(60, 399, false), 0);
+    INT_EQ("publishpolicy(max)", policy.should_publish(120, 0, false), 1);
+    INT_EQ("publishpolicy(change)", policy.should_publish(24, 0, true), 0);
+    INT_EQ("publishpolicy(change)", policy.should_publish(25, 0, true), 1);
+
+    INT_EQ("publishpolicy(oob)", policy.should_publish_change(200, false), 0);
+    INT_EQ("publishpolicy(oob)", policy.should_publish_change(25, true), 1);
+
+    PublishPolicy sparse(300, 300, 300);
+    INT_EQ("publishpolicy(sparse)", sparse.should_publish(120, 5000, true), 0);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_PUBLISHPOLICY_H
@@ -0,0 +1,187 @@
+#ifndef INCLUDED_READOUTDELTA_H
+#define INCLUDED_READOUTDELTA_H
+
+#include <string.h>
+
+/**
+ * ReadoutDelta keeps the last published value of every register of a
+ * data readout (up to N codes, in the order first seen), so only the ones
+ * that changed need publishing. Every keyframe_every readouts (and the
+ * first one), all registers are published again, so a backend that
+ * missed a message catches up.
+ *
+ * A readout may come in multiple blocks: the keyframe decision is taken
+ * at the first block and holds until the last one.
+ *
+ * Registers only count as published after commit(), so call it once the
+ * message went out; without it, they are published again next time (and
+ * a keyframe stays due).
+ *
+ * Usage:
+ *
+ *   ReadoutDelta<12> delta(10);
+ *   delta.begin(!partial);
+ *   for each code(value) line:
+ *       delta.add(code, codelen, value);
+ *   for (int i = 0; i < delta.get_count(); ++i)
+ *       if (delta.get_changed() & (1 << i))
+ *           publish delta.get_code(i), delta.get_value(i);
+ *   // delta.is_keyframe() tells whether this was a full publish
+ *   if (published)
+ *       delta.commit();
+ */
+template<unsigned char N> class ReadoutDelta
+{
+public:
+    enum { CODE_MAX = 8 };      /* "C.1.0", "15.8.0", ... with NUL */
+
+private:
+    typedef char n_check[N <= sizeof(unsigned) * 8 ? 1 : -1];
+
+    char _codes[N][CODE_MAX];
+    unsigned long _values[N];
+    unsigned char _count;       /* codes seen */
+    unsigned _present;          /* bitmask of published registers */
+    unsigned _changed;          /* bitmask of this block's changes */
+    unsigned char _keyframe_every;
+    unsigned char _until_keyframe;
+    bool _in_readout;           /* more blocks to come */
+    bool _keyframe;
+
+public:
+    ReadoutDelta(unsigned char keyframe_every) :
+            _count(0), _present(0), _changed(0),
+            _keyframe_every(keyframe_every), _until_keyframe(0),
+            _in_readout(false), _keyframe(false) {}
+
+    inline bool is_keyframe() const { return _keyframe; }
+    inline unsigned char get_count() const { return _count; }
+    inline unsigned get_changed() const { return _changed; }
+    inline const char *get_code(unsigned char i) const { return _codes[i]; }
+    inline unsigned long get_value(unsigned char i) const {
+        return _values[i];
+    }
+
+    /* Start a (block of a) readout */
+    void begin(bool last_block) {
+        if (!_in_readout) {
+            _keyframe = (_until_keyframe == 0);
+            if (!_keyframe) {
+                --_until_keyframe;
+            }
+        }
+        _in_readout = !last_block;
+        _changed = 0;
+    }
+
+    /* The changed registers of this block were published */
+    void commit() {
+        _present |= _changed;
+        if (_keyframe && !_in_readout) {
+            _until_keyframe = _keyframe_every - 1;
+        }
+    }
+
+    /* A register of the readout; it is marked as changed if it should be
+     * published. Returns false if the code does not fit, or there is no
+     * room for another one. */
+    bool add(const char *code, unsigned char len, unsigned long value) {
+        if (len >= CODE_MAX) {
+            return false;
+        }
+        unsigned char i;
+        for (i = 0; i < _count; ++i) {
+            if (memcmp(_codes[i], code, len) == 0 && _codes[i][len] == '\0') {
+                break;
+            }
+        }
+        if (i == _count) {
+            if (_count == N) {
+                return false;
+            }
+            memcpy(_codes[i], code, len);
+            _codes[i][len] = '\0';
+            ++_count;
+        }
+        unsigned bit = (1U << i);
+        if (_keyframe || !(_present & bit) || value != _values[i]) {
+            _changed |= bit;
+            _present &= ~bit;   /* until commit() */
+            _values[i] = value;
+        }
+        return true;
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_readoutdelta()
+{
+    static const char *const codes[] = {"C.1.0", "F.F", "1.8.0", "1.8.1"};
+    unsigned long v[4] = {28342193, 0, 32826545, 1};
+    ReadoutDelta<4> delta(4);
+
+    delta.begin(true);
+    for (int i = 0; i < 4; ++i) {
+        delta.add(codes[i], strlen(codes[i]), v[i]);
+    }
+    INT_EQ("readoutdelta(first)", delta.get_changed(), 0xf);
+    INT_EQ("readoutdelta(first-key)", delta.is_keyframe(), 1);
+    delta.commit();
+    v[2] += 3;
+    delta.begin(true);
+    for (int i = 0; i < 4; ++i) {
+        delta.add(codes[i], strlen(codes[i]), v[i]);
+    }
+    INT_EQ("readoutdelta(changed)", delta.get_changed(), 0x4);
+    INT_EQ("readoutdelta(changed-key)", delta.is_keyframe(), 0);
+    INT_EQ("readoutdelta(changed-code)", strcmp(delta.get_code(2), "1.8.0"), 0);
+    /* Not committed (the publish failed): still changed next time */
+    delta.begin(true);
+    delta.add("1.8.0", 5, v[2]);
+    INT_EQ("readoutdelta(unsent)", delta.get_changed(), 0x4);
+    delta.commit();
+    delta.begin(true);
+    delta.add("1.8.0", 5, v[2]);
+    INT_EQ("readoutdelta(same)", delta.get_changed(), 0);
+
+    /* Keyframe, in two blocks: the second one is part of it */
+    delta.begin(false);
+    delta.add("C.1.0", 5, v[0]);
+    delta.add("F.F", 3, v[1]);
+    INT_EQ("readoutdelta(key-block1)", delta.get_changed(), 0x3);
+    delta.begin(true);
+    delta.add("1.8.0", 5, v[2]);
+    delta.add("1.8.1", 5, v[3]);
+    INT_EQ("readoutdelta(key-block2)", delta.get_changed(), 0xc);
+    INT_EQ("readoutdelta(key)", delta.is_keyframe(), 1);
+    /* The keyframe was not published: it stays due */
+    delta.begin(true);
+    INT_EQ("readoutdelta(key-unsent)", delta.is_keyframe(), 1);
+    delta.commit();
+    delta.begin(true);
+    INT_EQ("readoutdelta(key-sent)", delta.is_keyframe(), 0);
+
+    /* No room, or too long: not tracked */
+    INT_EQ("readoutdelta(full)", delta.add("2.8.0", 5, 1), 0);
+    ReadoutDelta<4> other(100);
+    INT_EQ("readoutdelta(long)", other.add("1.128.0.255", 11, 1), 0);
+
+    /* A register not seen before is always published */
+    other.begin(true);
+    other.add("1.8.1", 5, 1);
+    other.commit();
+    other.begin(true);
+    other.add("1.8.1", 5, 1);
+    other.add("1.8.2", 5, 2);
+    INT_EQ("readoutdelta(late)", other.get_changed(), 0x2);
+    INT_EQ("readoutdelta(prefix)", other.add("1.8.", 4, 3), 1);
+    INT_EQ("readoutdelta(prefix-count)", other.get_count(), 3);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_READOUTDELTA_H
@@ -0,0 +1,160 @@
+#ifndef INCLUDED_REGISTERLAG_H
+#define INCLUDED_REGISTERLAG_H
+
+/**
+ * RegisterLag estimates how long the meter takes to show a Wh pulse (of
+ * the LED, seen by the OPTIONAL_LIGHT_SENSOR) in its 1.8.0/2.8.0 totals.
+ * On the ME-162 that is up to about a second (see "The issue with the odd
+ * spikes" in the README).
+ *
+ * After a pulse, we read the registers at get_read_at(): the pulse time
+ * plus the estimate. If the first read after that shows the increment,
+ * the estimate goes down by a little, if it does not, it goes up by more.
+ * This settles where about 90% of the reads show the increment right away
+ * (a running quantile; no history is kept). Reads before get_read_at()
+ * tell us nothing about the lag.
+ *
+ * The read that shows the increment gets the pulse time as its timestamp
+ * (but never earlier than a previous read), as that is when the Wh was
+ * actually completed.
+ *
+ * Usage:
+ *
+ *   RegisterLag lag;
+ *   if (light_sensor_sees_pulse && !lag.is_pending())
+ *       lag.on_pulse(millis());
+ *   if (lag.is_pending() && (long)(millis() - lag.get_read_at()) >= 0)
+ *       read_registers();
+ *   ...
+ *   unsigned long t = lag.on_read(0, millis(), wh);  // 0 = 1.8.0
+ *   gauge.set_positive_active_energy_total(t, wh);
+ */
+class RegisterLag
+{
+public:
+    static const unsigned short MIN_MS = 50;
+    static const unsigned short MAX_MS = 2000;
+    static const unsigned short STEP_UP_MS = 45;    /* 9 x STEP_DOWN_MS: */
+    static const unsigned short STEP_DOWN_MS = 5;   /* the 90% quantile */
+    static const unsigned short GIVE_UP_MS = 3000;  /* no increment at all */
+
+private:
+    unsigned long _pulse_ms;
+    unsigned long _last_ms;     /* latest timestamp handed out */
+    unsigned long _wh[2];
+    unsigned short _lag_ms;
+    unsigned short _samples;
+    bool _have_wh[2];
+    bool _pending;
+    bool _checked;              /* a read after get_read_at() was counted */
+
+public:
+    RegisterLag(unsigned short initial_ms = 1000) :
+            _last_ms(0), _lag_ms(initial_ms), _samples(0),
+            _pending(false), _checked(false) {
+        _have_wh[0] = _have_wh[1] = false;
+    }
+
+    /* The LED pulsed at time_ms */
+    inline void on_pulse(unsigned long time_ms) {
+        _pulse_ms = time_ms;
+        _pending = true;
+        _checked = false;
+    }
+
+    /* Waiting for the registers to show the last pulse? */
+    inline bool is_pending() const { return _pending; }
+
+    /* When to read the registers, after a pulse */
+    inline unsigned long get_read_at() const { return _pulse_ms + _lag_ms; }
+
+    inline unsigned short get_lag_ms() const { return _lag_ms; }
+    inline unsigned short get_samples() const { return _samples; }
+
+    /* Register idx (0 = 1.8.0, 1 = 2.8.0) read as wh at time_ms; returns
+     * the timestamp to use for it */
+    unsigned long on_read(int idx, unsigned long time_ms, unsigned long wh) {
+        bool changed = (_have_wh[idx] && wh != _wh[idx]);
+        bool single = (changed && wh - _wh[idx] == 1);
+        _wh[idx] = wh;
+        _have_wh[idx] = true;
+
+        unsigned long t = time_ms;
+        if (_pending) {
+            unsigned long elapsed = time_ms - _pulse_ms;
+            bool counts = (!_checked && elapsed >= _lag_ms);
+            if (changed) {
+                if (counts && _lag_ms > MIN_MS + STEP_DOWN_MS) {
+                    _lag_ms -= STEP_DOWN_MS;
+                }
+                if (single) {
+                    t = ((long)(_pulse_ms - _last_ms) > 0
+                         ? _pulse_ms : _last_ms);
+                }
+                _pending = false;
+                ++_samples;
+            } else if (elapsed >= GIVE_UP_MS) {
+                _pending = false; /* not a Wh pulse after all */
+            } else if (counts && idx == 1) {
+                /* Neither total showed it (1.8.0 is read first) */
+                if (_lag_ms < MAX_MS - STEP_UP_MS) {
+                    _lag_ms += STEP_UP_MS;
+                }
+                _checked = true;
+            }
+        }
+        _last_ms = t;
+        return t;
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_registerlag()
+{
+    RegisterLag lag(1000);
+    unsigned long t = 0, wh = 100;
+    lag.on_read(0, t, wh);
+    lag.on_read(1, t, 0);
+
+    /* The meter shows a pulse after 600-700ms: the estimate comes down */
+    for (int i = 0; i < 200; ++i) {
+        t += 5000;
+        lag.on_pulse(t);
+        unsigned long visible = t + 600 + (i % 3) * 50;
+        unsigned long read = lag.get_read_at();
+        unsigned long ts;
+        if (read >= visible) {
+            ts = lag.on_read(0, read, ++wh);
+            lag.on_read(1, read + 50, 0);
+        } else {
+            lag.on_read(0, read, wh);
+            lag.on_read(1, read + 50, 0);
+            ts = lag.on_read(0, visible, ++wh); /* another read, later */
+            lag.on_read(1, visible + 50, 0);
+        }
+        if (i == 199) {
+            INT_EQ("registerlag(timestamp)", ts - t, 0);
+        }
+    }
+    INT_EQ("registerlag(samples)", lag.get_samples(), 200);
+    INT_EQ("registerlag(estimate)",
+        lag.get_lag_ms() >= 600 && lag.get_lag_ms() <= 750, 1);
+
+    /* A flash without an increment is dropped after a while */
+    lag.on_pulse(t += 5000);
+    lag.on_read(0, t + 3000, wh);
+    INT_EQ("registerlag(give-up)", lag.is_pending(), 0);
+
+    /* Never hand out a timestamp earlier than the previous read */
+    lag.on_pulse(t += 5000);
+    lag.on_read(0, t + 100, wh);
+    INT_EQ("registerlag(monotonic)", lag.on_read(0, t + 800, ++wh) - t, 100);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_REGISTERLAG_H
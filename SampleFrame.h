@@ -0,0 +1,194 @@
+#ifndef INCLUDED_SAMPLEFRAME_H
+#define INCLUDED_SAMPLEFRAME_H
+
+/**
+ * SampleFrame is a compact, checksummed binary frame, for devices without
+ * a network (the Arduino Uno) to pass their samples to a host over the
+ * hardware serial port. A host bridge (tools/serial2mqtt) decodes them
+ * and publishes them to MQTT.
+ *
+ * Layout (little endian):
+ *
+ *   0xA5 0x5A TYPE LEN PAYLOAD[LEN] CRC16_LO CRC16_HI
+ *
+ * The CRC-16/ARC (as used by DSMR) covers TYPE, LEN and the PAYLOAD. The
+ * frames may be interleaved with the (ASCII) debug output: the decoder
+ * skips anything that is not a valid frame.
+ *
+ * TYPE_PUBLISH has the values of publish(): 1.8.0 [Wh], 2.8.0 [Wh], the
+ * instantaneous power [W] and the uptime [ms] as 32-bits values, followed
+ * by the pulse low and high and the register lag [ms] (16-bits) with the
+ * OPTIONAL_LIGHT_SENSOR. TYPE_PUBLISH_ALIGNED (the regular publishes with
+ * PUBLISH_ALIGN_S) has the window boundary [s since 1970] and the window
+ * average power [W] as two more 32-bits values after the uptime.
+ *
+ * Usage:
+ *
+ *   unsigned char frame[SampleFrame::MAX_FRAME];
+ *   unsigned char *p = SampleFrame::begin(frame, SampleFrame::TYPE_PUBLISH);
+ *   p = SampleFrame::put_u32(p, wh);
+ *   Serial.write(frame, SampleFrame::finish(frame, p));
+ *
+ *   SampleFrame decoder;
+ *   if (decoder.push(ch)) {
+ *       // decoder.get_type(), decoder.get_payload(), decoder.get_length()
+ *   }
+ */
+class SampleFrame
+{
+public:
+    enum {
+        SYNC0 = 0xA5,
+        SYNC1 = 0x5A,
+        HEADER = 4,             /* sync, type, length */
+        MAX_PAYLOAD = 32,
+        MAX_FRAME = HEADER + MAX_PAYLOAD + 2
+    };
+    enum Type {
+        TYPE_PUBLISH = 'P',
+        TYPE_PUBLISH_ALIGNED = 'A'
+    };
+
+private:
+    unsigned char _buf[MAX_FRAME];
+    unsigned char _pos;
+    unsigned long _frames;
+    unsigned long _errors;
+
+    /* CRC-16/ARC: polynomial 0xA001 (reversed), init 0 */
+    static unsigned short _crc16(const unsigned char *p, unsigned char len) {
+        unsigned short crc = 0;
+        while (len--) {
+            crc ^= *p++;
+            for (int i = 0; i < 8; ++i) {
+                if (crc & 1) {
+                    crc = (crc >> 1) ^ 0xA001;
+                } else {
+                    crc = (crc >> 1);
+                }
+            }
+        }
+        return crc;
+    }
+
+public:
+    SampleFrame() : _pos(0), _frames(0), _errors(0) {}
+
+    /* Start a frame in buf; returns where the payload goes */
+    static inline unsigned char *begin(unsigned char *buf, unsigned char type) {
+        buf[0] = SYNC0;
+        buf[1] = SYNC1;
+        buf[2] = type;
+        return buf + HEADER;
+    }
+
+    /* Finish the frame (payload up to end); returns the frame length */
+    static unsigned char finish(unsigned char *buf, unsigned char *end) {
+        unsigned char len = end - (buf + HEADER);
+        buf[3] = len;
+        unsigned short crc = _crc16(buf + 2, 2 + len);
+        end[0] = crc & 0xff;
+        end[1] = crc >> 8;
+        return HEADER + len + 2;
+    }
+
+    static inline unsigned char *put_u16(unsigned char *p, unsigned short v) {
+        p[0] = v & 0xff;
+        p[1] = v >> 8;
+        return p + 2;
+    }
+
+    static inline unsigned char *put_u32(unsigned char *p, unsigned long v) {
+        p = put_u16(p, v & 0xffff);
+        return put_u16(p, (v >> 16) & 0xffff);
+    }
+
+    static inline unsigned short get_u16(const unsigned char *p) {
+        return p[0] | ((unsigned short)p[1] << 8);
+    }
+
+    static inline unsigned long get_u32(const unsigned char *p) {
+        return get_u16(p) | ((unsigned long)get_u16(p + 2) << 16);
+    }
+
+    /* Feed a received byte; true if it completed a valid frame */
+    bool push(unsigned char ch) {
+        if (_pos == 0 && ch != SYNC0) {
+            return false;
+        }
+        if (_pos == 1 && ch != SYNC1) {
+            _pos = (ch == SYNC0 ? 1 : 0);
+            return false;
+        }
+        if (_pos == 3 && ch > MAX_PAYLOAD) {
+            ++_errors;
+            _pos = 0;
+            return false;
+        }
+        _buf[_pos++] = ch;
+        if (_pos < HEADER || _pos < HEADER + _buf[3] + 2) {
+            return false;
+        }
+        unsigned char len = _buf[3];
+        _pos = 0;
+        if (_crc16(_buf + 2, 2 + len) !=
+                get_u16(_buf + HEADER + len)) {
+            ++_errors;
+            return false;
+        }
+        ++_frames;
+        return true;
+    }
+
+    /* The last frame that push() completed */
+    inline unsigned char get_type() const { return _buf[2]; }
+    inline unsigned char get_length() const { return _buf[3]; }
+    inline const unsigned char *get_payload() const { return _buf + HEADER; }
+
+    inline unsigned long get_frames() const { return _frames; }
+    inline unsigned long get_errors() const { return _errors; }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_sampleframe()
+{
+    unsigned char frame[SampleFrame::MAX_FRAME];
+    unsigned char *p = SampleFrame::begin(frame, SampleFrame::TYPE_PUBLISH);
+    p = SampleFrame::put_u32(p, 33402264UL);
+    p = SampleFrame::put_u32(p, 13728UL);
+    p = SampleFrame::put_u32(p, (unsigned long)-358L);
+    unsigned char len = SampleFrame::finish(frame, p);
+    INT_EQ("sampleframe(len)", len, 4 + 12 + 2);
+
+    /* Interleaved with text, and a corrupted copy */
+    const char text[] = "pushing: \xA5 [1.8.0]\r\n";
+    SampleFrame decoder;
+    int found = 0;
+    for (unsigned i = 0; i < sizeof(text) - 1; ++i) {
+        found += decoder.push(text[i]);
+    }
+    frame[6] ^= 1;
+    for (unsigned i = 0; i < len; ++i) {
+        found += decoder.push(frame[i]);
+    }
+    frame[6] ^= 1;
+    for (unsigned i = 0; i < len; ++i) {
+        found += decoder.push(frame[i]);
+    }
+    INT_EQ("sampleframe(found)", found, 1);
+    INT_EQ("sampleframe(errors)", decoder.get_errors(), 1);
+    INT_EQ("sampleframe(type)", decoder.get_type(), 'P');
+    INT_EQ("sampleframe(length)", decoder.get_length(), 12);
+    INT_EQ("sampleframe(pos)", decoder.get_u32(decoder.get_payload()),
+        33402264);
+    INT_EQ("sampleframe(power)", (int)decoder.get_u32(
+        decoder.get_payload() + 8), -358);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_SAMPLEFRAME_H
@@ -0,0 +1,427 @@
+#ifndef INCLUDED_SAMPLESTORE_H
+#define INCLUDED_SAMPLESTORE_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+/**
+ * SampleStore is an append-only, memory mapped, columnar store for
+ * (timestamp, meter, register, value) samples, for use on a Linux host
+ * (a gateway, or the host tools). Derived values, like power, are just
+ * other registers.
+ *
+ * Samples are buffered and written as a chunk of up to CHUNK_SAMPLES
+ * samples on flush(). A chunk holds one column per field, each encoded as
+ * varints: the timestamps and values as (zigzag) deltas, the values
+ * against the previous value of the same meter/register. A sample of a
+ * meter that is read every few seconds takes about 6 bytes.
+ *
+ * The chunk headers hold the time range of the chunk, so open() only has
+ * to walk the headers to build the sparse time index (one entry per
+ * chunk). A torn chunk at the end (after a crash) is dropped. Range scans
+ * skip to the first chunk that overlaps and decode straight from the
+ * mapping, without copying.
+ *
+ * Not thread-safe. Appending (flush()) may remap the file, so don't keep
+ * pointers into it across flush() calls.
+ *
+ * Usage:
+ *
+ *   SampleStore store;
+ *   store.open("/var/lib/pe32/samples.bin");
+ *   store.append(t_ms, meter, SampleStore::obis(1, 8, 0), wh);
+ *   store.flush();  // e.g. every minute
+ *   store.scan(from_ms, to_ms, [](const SampleStore::Sample &s) { ... });
+ */
+class SampleStore
+{
+public:
+    struct Sample {
+        int64_t t_ms;
+        uint32_t meter;
+        uint32_t reg;
+        int64_t value;
+    };
+
+    static const unsigned CHUNK_SAMPLES = 8192;
+
+    /* Register id for OBIS C.D.E, e.g. 1.8.0 = 10800, 16.7.0 = 160700 */
+    static inline uint32_t obis(unsigned c, unsigned d, unsigned e) {
+        return c * 10000 + d * 100 + e;
+    }
+
+private:
+    static const uint64_t FILE_MAGIC = 0x31504d5332334550ULL; /* PE32SMP1 */
+    static const uint32_t CHUNK_MAGIC = 0x4b4e4843;           /* CHNK */
+    static const unsigned DELTA_SLOTS = 64;
+
+    struct FileHeader {
+        uint64_t magic;
+        uint64_t reserved[7];
+    };
+
+    struct ChunkHeader {
+        uint32_t magic;
+        uint32_t count;
+        int64_t t_min;
+        int64_t t_max;
+        int64_t t_first;
+        uint32_t bytes[4];          /* time, meter, reg, value columns */
+        uint32_t total;             /* header included, 8-byte aligned */
+        uint32_t checksum;          /* of the columns */
+    };
+
+    int _fd;
+    uint8_t *_map;
+    size_t _mapsize;
+    size_t _end;                    /* bytes in use */
+    std::vector<size_t> _chunks;    /* offset of every chunk */
+    std::vector<int64_t> _index_t;  /* t_min of every chunk (sparse index) */
+    std::vector<Sample> _pending;
+    uint64_t _count;
+
+    /* Per chunk: previous value of a meter/register (hashed slot) */
+    static inline unsigned _slot(uint32_t meter, uint32_t reg) {
+        return (meter * 31 + reg) % DELTA_SLOTS;
+    }
+
+    static inline uint64_t _zigzag(int64_t v) {
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+    }
+
+    static inline int64_t _unzigzag(uint64_t v) {
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+
+    static inline void _put_varint(std::vector<uint8_t> &buf, uint64_t v) {
+        while (v >= 0x80) {
+            buf.push_back((uint8_t)(v | 0x80));
+            v >>= 7;
+        }
+        buf.push_back((uint8_t)v);
+    }
+
+    static inline uint64_t _get_varint(const uint8_t *&p) {
+        uint64_t v = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t byte = *p++;
+            v |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return v;
+            }
+        }
+    }
+
+    static uint32_t _checksum(const uint8_t *p, size_t len) {
+        uint32_t h = 2166136261u; /* FNV-1a */
+        for (size_t i = 0; i < len; ++i) {
+            h = (h ^ p[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    bool _reserve(size_t size) {
+        if (size <= _mapsize) {
+            return true;
+        }
+        size_t newsize = (_mapsize ? _mapsize : 1 << 20);
+        while (newsize < size) {
+            newsize *= 2;
+        }
+        if (ftruncate(_fd, newsize) != 0) {
+            return false;
+        }
+        void *map = (_map
+            ? mremap(_map, _mapsize, newsize, MREMAP_MAYMOVE)
+            : mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0));
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        _map = (uint8_t *)map;
+        _mapsize = newsize;
+        return true;
+    }
+
+    const ChunkHeader *_chunk(size_t idx) const {
+        return (const ChunkHeader *)(_map + _chunks[idx]);
+    }
+
+    /* Walk the chunks, rebuild the index; stop at the first bad one */
+    void _load() {
+        size_t off = sizeof(FileHeader);
+        while (off + sizeof(ChunkHeader) <= _mapsize) {
+            const ChunkHeader *ch = (const ChunkHeader *)(_map + off);
+            /* The columns must fit in the chunk, before we read them */
+            uint64_t colbytes = (uint64_t)ch->bytes[0] + ch->bytes[1] +
+                ch->bytes[2] + ch->bytes[3];
+            if (ch->magic != CHUNK_MAGIC ||
+                    sizeof(ChunkHeader) + colbytes > ch->total ||
+                    off + ch->total > _mapsize ||
+                    _checksum(_map + off + sizeof(ChunkHeader), colbytes) !=
+                        ch->checksum) {
+                break;
+            }
+            _chunks.push_back(off);
+            _index_t.push_back(ch->t_min);
+            _count += ch->count;
+            off += ch->total;
+        }
+        _end = off;
+    }
+
+public:
+    SampleStore() : _fd(-1), _map(NULL), _mapsize(0), _end(0), _count(0) {}
+    ~SampleStore() { close(); }
+
+    /* Open (or create) the store at path */
+    bool open(const char *path) {
+        close();
+        _fd = ::open(path, O_RDWR | O_CREAT, 0644);
+        if (_fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(_fd, &st) != 0) {
+            close();
+            return false;
+        }
+        if (st.st_size == 0) {
+            if (!_reserve(1 << 20)) {
+                close();
+                return false;
+            }
+            FileHeader hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.magic = FILE_MAGIC;
+            memcpy(_map, &hdr, sizeof(hdr));
+            _end = sizeof(FileHeader);
+            return true;
+        }
+        if (!_reserve(st.st_size) ||
+                ((const FileHeader *)_map)->magic != FILE_MAGIC) {
+            close();
+            return false;
+        }
+        _load();
+        return true;
+    }
+
+    /* Flush and close */
+    void close() {
+        if (_fd >= 0) {
+            flush();
+        }
+        if (_map) {
+            munmap(_map, _mapsize);
+        }
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+        _fd = -1;
+        _map = NULL;
+        _mapsize = _end = 0;
+        _count = 0;
+        _chunks.clear();
+        _index_t.clear();
+        _pending.clear();
+    }
+
+    /* Buffer a sample; a full chunk is written right away */
+    inline bool append(int64_t t_ms, uint32_t meter, uint32_t reg,
+                       int64_t value) {
+        Sample s = {t_ms, meter, reg, value};
+        _pending.push_back(s);
+        return (_pending.size() < CHUNK_SAMPLES ? true : flush());
+    }
+
+    /* Write the buffered samples as a chunk */
+    bool flush() {
+        if (_pending.empty() || _fd < 0) {
+            return true;
+        }
+        std::vector<uint8_t> cols[4];
+        int64_t prev_values[DELTA_SLOTS];
+        memset(prev_values, 0, sizeof(prev_values));
+        ChunkHeader ch;
+        memset(&ch, 0, sizeof(ch));
+        ch.magic = CHUNK_MAGIC;
+        ch.count = _pending.size();
+        ch.t_first = ch.t_min = ch.t_max = _pending[0].t_ms;
+        int64_t prev_t = ch.t_first;
+        for (size_t i = 0; i < _pending.size(); ++i) {
+            const Sample &s = _pending[i];
+            _put_varint(cols[0], _zigzag(s.t_ms - prev_t));
+            _put_varint(cols[1], s.meter);
+            _put_varint(cols[2], s.reg);
+            int64_t &prev_v = prev_values[_slot(s.meter, s.reg)];
+            _put_varint(cols[3], _zigzag(s.value - prev_v));
+            prev_v = s.value;
+            prev_t = s.t_ms;
+            ch.t_min = (s.t_ms < ch.t_min ? s.t_ms : ch.t_min);
+            ch.t_max = (s.t_ms > ch.t_max ? s.t_ms : ch.t_max);
+        }
+        size_t colbytes = 0;
+        for (int i = 0; i < 4; ++i) {
+            ch.bytes[i] = cols[i].size();
+            colbytes += cols[i].size();
+        }
+        ch.total = (sizeof(ChunkHeader) + colbytes + 7) & ~(size_t)7;
+        if (!_reserve(_end + ch.total)) {
+            return false;
+        }
+        uint8_t *p = _map + _end + sizeof(ChunkHeader);
+        for (int i = 0; i < 4; ++i) {
+            memcpy(p, cols[i].data(), cols[i].size());
+            p += cols[i].size();
+        }
+        ch.checksum = _checksum(_map + _end + sizeof(ChunkHeader), colbytes);
+        memcpy(_map + _end, &ch, sizeof(ch));
+        _chunks.push_back(_end);
+        _index_t.push_back(ch.t_min);
+        _end += ch.total;
+        _count += ch.count;
+        _pending.clear();
+        msync(_map, _mapsize, MS_ASYNC);
+        return true;
+    }
+
+    /* Samples on disk (flushed) and the number of chunks */
+    inline uint64_t get_count() const { return _count; }
+    inline size_t get_chunks() const { return _chunks.size(); }
+    inline size_t get_bytes() const { return _end; }
+
+    /* Call fn(sample) for every flushed sample with from <= t < to, in
+     * append order. Returns the number of samples passed to fn. */
+    template<class F> uint64_t scan(int64_t from_ms, int64_t to_ms, F fn) const {
+        /* Chunks are mostly in time order: find the last one that starts
+         * before from_ms, then step back while earlier ones may overlap */
+        size_t lo = 0, hi = _index_t.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (_index_t[mid] <= from_ms) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        size_t first = (lo ? lo - 1 : 0);
+        while (first > 0 && _chunk(first - 1)->t_max >= from_ms) {
+            --first;
+        }
+
+        uint64_t found = 0;
+        for (size_t idx = first; idx < _chunks.size(); ++idx) {
+            const ChunkHeader *ch = _chunk(idx);
+            if (ch->t_max < from_ms) {
+                continue;
+            }
+            if (ch->t_min >= to_ms) {
+                continue; /* a later one may still be out of order */
+            }
+            const uint8_t *col[4];
+            col[0] = (const uint8_t *)(ch + 1);
+            for (int i = 1; i < 4; ++i) {
+                col[i] = col[i - 1] + ch->bytes[i - 1];
+            }
+            int64_t prev_values[DELTA_SLOTS];
+            memset(prev_values, 0, sizeof(prev_values));
+            Sample s;
+            s.t_ms = ch->t_first;
+            for (uint32_t i = 0; i < ch->count; ++i) {
+                s.t_ms += _unzigzag(_get_varint(col[0]));
+                s.meter = _get_varint(col[1]);
+                s.reg = _get_varint(col[2]);
+                int64_t &prev_v = prev_values[_slot(s.meter, s.reg)];
+                s.value = prev_v + _unzigzag(_get_varint(col[3]));
+                prev_v = s.value;
+                if (s.t_ms >= from_ms && s.t_ms < to_ms) {
+                    fn(s);
+                    ++found;
+                }
+            }
+        }
+        return found;
+    }
+};
+
+#if defined(TEST_BUILD)
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+struct _SampleStoreSum {
+    int64_t *sum;
+    void operator()(const SampleStore::Sample &s) { *sum += s.value; }
+};
+
+static void test_samplestore()
+{
+    char path[] = "/tmp/pe32_samplestore_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        INT_EQ("samplestore(mkstemp)", fd, 0);
+        return;
+    }
+    ::close(fd);
+    unlink(path);
+
+    SampleStore store;
+    INT_EQ("samplestore(open)", store.open(path), 1);
+    /* Two meters, 1.8.0 every 2s, over two chunks and a partial one */
+    for (int i = 0; i < 10000; ++i) {
+        store.append(1000000 + i * 2000LL, i % 2, SampleStore::obis(1, 8, 0),
+                     33402264 + i / 2);
+    }
+    INT_EQ("samplestore(chunks)", store.get_chunks(), 1);
+    store.close();
+    INT_EQ("samplestore(reopen)", store.open(path), 1);
+    INT_EQ("samplestore(count)", (int)store.get_count(), 10000);
+    INT_EQ("samplestore(chunks)", store.get_chunks(), 2);
+    /* Compact: the delta/varint columns take about 6 bytes per sample */
+    INT_EQ("samplestore(compact)", store.get_bytes() < 10000 * 7, 1);
+
+    int64_t sum = 0;
+    _SampleStoreSum fn = {&sum};
+    /* i from 8190 up to 8199 spans both chunks */
+    INT_EQ("samplestore(scan)", (int)store.scan(
+        1000000 + 8190 * 2000LL, 1000000 + 8200 * 2000LL, fn), 10);
+    INT_EQ("samplestore(scan-sum)", (int)(sum - 10 * 33402264LL),
+        4095 * 2 + 4096 * 2 + 4097 * 2 + 4098 * 2 + 4099 * 2);
+    INT_EQ("samplestore(scan-none)", (int)store.scan(0, 1000000, fn), 0);
+
+    /* A torn chunk at the end is dropped */
+    size_t offset = store.get_bytes();
+    store.append(99000000, 0, 1, 1);
+    store.close();
+    fd = ::open(path, O_RDWR);
+    uint8_t garbage[4] = {0xde, 0xad, 0xbe, 0xef};
+    INT_EQ("samplestore(tear)", pwrite(
+        fd, garbage, sizeof(garbage), offset) == sizeof(garbage), 1);
+    ::close(fd);
+    INT_EQ("samplestore(torn)", store.open(path), 1);
+    INT_EQ("samplestore(torn)", (int)store.get_count(), 10000);
+
+    /* A header with the right magic, but columns larger than the chunk
+     * (bytes[0] is at offset 32), is not read */
+    store.append(99000000, 0, 1, 1);
+    store.close();
+    fd = ::open(path, O_RDWR);
+    uint32_t huge = 0x7fffffff;
+    INT_EQ("samplestore(corrupt)", pwrite(
+        fd, &huge, sizeof(huge), offset + 32) == sizeof(huge), 1);
+    ::close(fd);
+    INT_EQ("samplestore(corrupt)", store.open(path), 1);
+    INT_EQ("samplestore(corrupt)", (int)store.get_count(), 10000);
+    store.close();
+    unlink(path);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_SAMPLESTORE_H
@@ -0,0 +1,335 @@
+#ifndef INCLUDED_SHADOWESTIMATORS_H
+#define INCLUDED_SHADOWESTIMATORS_H
+
+/**
+ * Shadow estimators run next to the EnergyGauge, on the same 1.8.0/2.8.0
+ * totals, without affecting what is published as e_inst_power_w. The
+ * ShadowSet compares them to the gauge once per read cycle and keeps
+ * divergence statistics (mean absolute and mean signed difference, the
+ * largest difference) until they are reported.
+ *
+ * Shadows must not disturb the IR timing, so the ShadowSet has a CPU
+ * budget per fed total: once it is used up, the remaining shadows skip
+ * that total and the skip is counted. The first skipped total (per
+ * shadow and register) is kept and fed right before the next one, so an
+ * increment still gets the time of the read that showed it (which
+ * matters to the EdgeEstimator). The order rotates so the same shadow is
+ * not always the one skipped. The shadows own no heap: their RAM is fixed and known
+ * at compile time (see SHADOW_RAM_BUDGET in the .ino).
+ *
+ * Usage:
+ *
+ *   WindowEstimator<8> window(60000);
+ *   EdgeEstimator edge;
+ *   ShadowEstimator *const list[] = {&window, &edge};
+ *   ShadowSet shadows(list, 2, 500, micros);
+ *   shadows.feed(0, millis(), positive_wh);  // and (1, ...) for negative
+ *   shadows.compare(gauge.get_instantaneous_power());  // every cycle
+ *   // report shadows.get_power(i), get_mad(i), ..., then:
+ *   shadows.reset_stats();
+ */
+class ShadowEstimator
+{
+public:
+    virtual const char *name() const = 0;
+    /* Feed total idx (0 = positive, 1 = negative) in Wh, read at time_ms */
+    virtual void feed(int idx, unsigned long time_ms, unsigned long wh) = 0;
+    /* Net power in Watt (negative when producing) */
+    virtual int get_power() const = 0;
+};
+
+/**
+ * WindowEstimator: net energy over (at least) the last window_ms. Keeps N
+ * points, spaced window_ms / N apart.
+ */
+template<unsigned char N> class WindowEstimator : public ShadowEstimator
+{
+private:
+    struct Point { unsigned long t; long net; };
+    Point _points[N];
+    unsigned long _wh[2];
+    unsigned long _window_ms;
+    unsigned char _head;        /* newest point */
+    unsigned char _len;
+    unsigned char _have;        /* bitmask of the totals seen */
+
+public:
+    WindowEstimator(unsigned long window_ms) :
+            _window_ms(window_ms), _head(0), _len(0), _have(0) {
+        _wh[0] = _wh[1] = 0;
+    }
+
+    virtual const char *name() const { return "window"; }
+
+    virtual void feed(int idx, unsigned long time_ms, unsigned long wh) {
+        _wh[idx] = wh;
+        _have |= (1 << idx);
+        if (_have != 3) {
+            return; /* no net total until both are known */
+        }
+        Point pt = {time_ms, (long)(_wh[0] - _wh[1])};
+        if (_len > 1 &&
+                time_ms - _points[(_head + N - 1) % N].t < _window_ms / N) {
+            /* Too close to the one before: move the newest point */
+            _points[_head] = pt;
+            return;
+        }
+        _head = (_len ? (_head + 1) % N : 0);
+        _points[_head] = pt;
+        if (_len < N) {
+            ++_len;
+        }
+    }
+
+    virtual int get_power() const {
+        if (_len < 2) {
+            return 0;
+        }
+        const Point &last = _points[_head];
+        const Point &first = _points[(_head + N + 1 - _len) % N];
+        unsigned long dt = last.t - first.t;
+        if (!dt) {
+            return 0;
+        }
+        return (int)((last.net - first.net) * 3600000.0f / (float)dt);
+    }
+};
+
+/**
+ * EdgeEstimator: power from the time between the last two Wh increments
+ * of the most recently changed total, decaying when no increment shows
+ * up in time (like the WattGauge does after 30s).
+ */
+class EdgeEstimator : public ShadowEstimator
+{
+private:
+    unsigned long _wh[2];
+    unsigned long _edge_ms[2];  /* time of the last increment */
+    unsigned long _last_ms;
+    long _watt[2];
+    unsigned char _seen[2];     /* 0 = none, 1 = a total, 2 = an edge */
+    unsigned char _recent;      /* most recently changed total */
+
+public:
+    EdgeEstimator() : _last_ms(0), _recent(0) {
+        _seen[0] = _seen[1] = 0;
+        _watt[0] = _watt[1] = 0;
+    }
+
+    virtual const char *name() const { return "edge"; }
+
+    virtual void feed(int idx, unsigned long time_ms, unsigned long wh) {
+        _last_ms = time_ms;
+        if (!_seen[idx]) {
+            _wh[idx] = wh;
+            _seen[idx] = 1;
+            return;
+        }
+        if (wh == _wh[idx]) {
+            return;
+        }
+        if (_seen[idx] == 2 && time_ms != _edge_ms[idx]) {
+            _watt[idx] = (long)((wh - _wh[idx]) * 3600000.0f /
+                                (float)(time_ms - _edge_ms[idx]));
+        }
+        _seen[idx] = 2;
+        _wh[idx] = wh;
+        _edge_ms[idx] = time_ms;
+        _recent = idx;
+    }
+
+    virtual int get_power() const {
+        if (_seen[_recent] != 2) {
+            return 0;
+        }
+        long watt = _watt[_recent];
+        unsigned long since = _last_ms - _edge_ms[_recent];
+        if (since > 0 && (long)(3600000UL / since) < watt) {
+            watt = 3600000UL / since; /* 1 Wh would have shown up by now */
+        }
+        return (int)(_recent ? -watt : watt);
+    }
+};
+
+class ShadowSet
+{
+public:
+    static const unsigned char MAX_SHADOWS = 4;
+
+private:
+    struct Stats {
+        unsigned short n;
+        long sum_abs;
+        long sum;
+        int max_abs;
+        unsigned short skipped;
+    };
+    struct Pending {
+        unsigned long time_ms;
+        unsigned long wh;
+        bool have;
+    };
+    ShadowEstimator *const *_list;
+    unsigned char _count;
+    unsigned char _first;       /* rotates */
+    unsigned short _budget_us;
+    unsigned short _max_us;     /* most time used by one feed() */
+    unsigned long (*_clock_us)();
+    Stats _stats[MAX_SHADOWS];
+    Pending _pending[MAX_SHADOWS][2];   /* first skipped total */
+
+public:
+    ShadowSet(ShadowEstimator *const *list, unsigned char count,
+              unsigned short budget_us, unsigned long (*clock_us)()) :
+            _list(list),
+            _count(count < MAX_SHADOWS ? count : MAX_SHADOWS),
+            _first(0), _budget_us(budget_us), _clock_us(clock_us) {
+        for (unsigned char i = 0; i < MAX_SHADOWS; ++i) {
+            _pending[i][0].have = _pending[i][1].have = false;
+        }
+        reset_stats();
+    }
+
+    inline unsigned char get_count() const { return _count; }
+    inline const char *get_name(int i) const { return _list[i]->name(); }
+    inline int get_power(int i) const { return _list[i]->get_power(); }
+    inline int get_mad(int i) const {
+        return _stats[i].n ? (int)(_stats[i].sum_abs / _stats[i].n) : 0;
+    }
+    inline int get_bias(int i) const {
+        return _stats[i].n ? (int)(_stats[i].sum / _stats[i].n) : 0;
+    }
+    inline int get_max(int i) const { return _stats[i].max_abs; }
+    inline unsigned short get_skipped(int i) const { return _stats[i].skipped; }
+    inline unsigned short get_max_us() const { return _max_us; }
+
+    /* Feed a total to the shadows, within the CPU budget */
+    void feed(int idx, unsigned long time_ms, unsigned long wh) {
+        unsigned long start = _clock_us();
+        unsigned long used = 0;
+        for (unsigned char k = 0; k < _count; ++k) {
+            unsigned char i = (_first + k) % _count;
+            Pending &pending = _pending[i][idx];
+            if (used >= _budget_us) {
+                if (!pending.have) {
+                    pending.time_ms = time_ms;
+                    pending.wh = wh;
+                    pending.have = true;
+                }
+                ++_stats[i].skipped;
+                continue;
+            }
+            if (pending.have) {
+                _list[i]->feed(idx, pending.time_ms, pending.wh);
+                pending.have = false;
+            }
+            _list[i]->feed(idx, time_ms, wh);
+            used = _clock_us() - start;
+        }
+        if (used > _max_us) {
+            _max_us = (used < 0xffff ? used : 0xffff);
+        }
+        _first = (_first + 1) % _count;
+    }
+
+    /* Compare the shadows to the primary estimate; once per cycle */
+    void compare(int primary_watt) {
+        for (unsigned char i = 0; i < _count; ++i) {
+            int diff = _list[i]->get_power() - primary_watt;
+            int abs_diff = (diff < 0 ? -diff : diff);
+            Stats &st = _stats[i];
+            if (st.n == 0xffff) {
+                continue;
+            }
+            ++st.n;
+            st.sum += diff;
+            st.sum_abs += abs_diff;
+            if (abs_diff > st.max_abs) {
+                st.max_abs = abs_diff;
+            }
+        }
+    }
+
+    void reset_stats() {
+        for (unsigned char i = 0; i < MAX_SHADOWS; ++i) {
+            _stats[i].n = 0;
+            _stats[i].sum_abs = _stats[i].sum = 0;
+            _stats[i].max_abs = 0;
+            _stats[i].skipped = 0;
+        }
+        _max_us = 0;
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static unsigned long _test_shadow_us;
+static unsigned long _test_shadow_clock() { return (_test_shadow_us += 300); }
+
+static void test_shadowestimators()
+{
+    WindowEstimator<8> window(60000);
+    EdgeEstimator edge;
+    ShadowEstimator *const list[] = {&window, &edge};
+    ShadowSet shadows(list, 2, 1000, _test_shadow_clock);
+
+    /* 1800 W: a Wh every 2s, read every second */
+    unsigned long wh = 1000;
+    for (unsigned long t = 0; t <= 120000; t += 1000) {
+        if (t % 2000 == 0) {
+            ++wh;
+        }
+        shadows.feed(0, t, wh);
+        shadows.feed(1, t + 300, 50);
+        shadows.compare(1700);
+    }
+    /* The window sees whole Wh only: 28 Wh in 54.75s */
+    INT_EQ("shadow(window)", window.get_power(), 1841);
+    INT_EQ("shadow(edge)", edge.get_power(), 1800);
+    INT_EQ("shadow(bias)", shadows.get_bias(1) > 0, 1);
+    INT_EQ("shadow(max)", shadows.get_max(1), 1700);
+
+    /* Over budget: 300us per shadow, 200us budget, second one skipped */
+    ShadowSet tight(list, 2, 200, _test_shadow_clock);
+    tight.feed(0, 121000, wh);
+    tight.feed(0, 122000, wh);
+    INT_EQ("shadow(skipped)", tight.get_skipped(0) + tight.get_skipped(1), 2);
+    INT_EQ("shadow(rotated)", tight.get_skipped(0), 1);
+
+    /* Skipped increments keep their time: Wh at 1s and 4s is 1200 W,
+     * even though the edge shadow only gets every other call */
+    EdgeEstimator edge2;
+    WindowEstimator<8> window2(60000);
+    ShadowEstimator *const list2[] = {&edge2, &window2};
+    ShadowSet skippy(list2, 2, 200, _test_shadow_clock);
+    const unsigned long skippy_wh[] = {1, 2, 2, 2, 3};
+    for (int k = 0; k < 5; ++k) {
+        skippy.feed(0, k * 1000UL, skippy_wh[k]);
+    }
+    INT_EQ("shadow(skipped-edge)", edge2.get_power(), 1200);
+
+    /* Real totals: no points before 2.8.0 is known, or the first cycle
+     * would be a (huge) negative step of the 2.8.0 total */
+    WindowEstimator<8> window3(60000);
+    for (unsigned long t = 0; t <= 60000; t += 1000) {
+        window3.feed(0, t, 33402264 + t / 2000);
+        window3.feed(1, t + 300, 13465);
+    }
+    INT_EQ("shadow(window-first)", window3.get_power(), 1800);
+
+    /* Producing: negative, decaying when nothing changes */
+    EdgeEstimator solar;
+    solar.feed(1, 0, 10);
+    solar.feed(1, 1000, 11);
+    solar.feed(1, 4000, 12);
+    INT_EQ("shadow(edge-neg)", solar.get_power(), -1200);
+    solar.feed(1, 16000, 12);
+    INT_EQ("shadow(edge-decay)", solar.get_power(), -300);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_SHADOWESTIMATORS_H
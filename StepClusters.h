@@ -0,0 +1,312 @@
+#ifndef INCLUDED_STEPCLUSTERS_H
+#define INCLUDED_STEPCLUSTERS_H
+
+/**
+ * StepClusters detects load steps in the power signal (of the EnergyGauge)
+ * and clusters them online into a fixed table of N signatures: a step
+ * size and a typical duration, like "fridge: +110 W for 20 minutes" or
+ * "kettle: +2000 W for 3 minutes". Per period it counts how often every
+ * signature ran and how much energy it used, so the backend gets a few
+ * integers per device instead of a series to disaggregate.
+ *
+ * Steps: the power has to settle at a new level (at least min_step_w
+ * away, for SETTLE samples) to count. A step up opens an event; a step
+ * down of about the same size (within TOLERANCE_PCT) closes the most
+ * recent matching one. The event (its size and duration) then goes to
+ * the nearest signature of similar size and duration, whose averages it
+ * updates. If none is close, it starts a new signature; if the table is
+ * full, that replaces the one that has been idle the longest (the least
+ * used of those), but never one that ran in the current period: its
+ * counts are not published yet. If all of them did, the event is left
+ * out.
+ *
+ * Usage:
+ *
+ *   StepClusters<8> steps(3600000, 60);  // per hour, 60 W steps and up
+ *   steps.feed(millis(), gauge.get_instantaneous_power());  // every cycle
+ *   if (steps.is_due(millis())) {
+ *       for (int i = 0; i < steps.get_count(); ++i)
+ *           // steps.get_watt(i), get_duration_s(i), get_events(i), ...
+ *       steps.next_period(millis());
+ *   }
+ */
+template<unsigned char N> class StepClusters
+{
+public:
+    static const unsigned char SETTLE = 3;          /* samples at a level */
+    static const unsigned char TOLERANCE_PCT = 20;  /* same size step */
+    static const unsigned char MAX_OPEN = 4;        /* events in progress */
+    static const unsigned long MAX_EVENT_MS = 6UL * 3600000UL;
+    static const unsigned short MAX_WEIGHT = 32;    /* averaging memory */
+
+private:
+    struct Signature {
+        int watt;               /* step size [W] */
+        unsigned long dur_s;    /* typical duration [s] */
+        unsigned short weight;  /* events seen (capped at MAX_WEIGHT) */
+        unsigned short events;  /* this period */
+        unsigned long joule;    /* this period [Ws] */
+        unsigned char idle;     /* periods since it last ran (capped) */
+    };
+    struct Event {
+        unsigned long t;        /* start */
+        int watt;
+    };
+    Signature _sigs[N];
+    Event _open[MAX_OPEN];
+    unsigned long _period_ms;
+    unsigned long _period_t0;
+    unsigned long _cand_t;      /* candidate level since */
+    int _min_step_w;
+    int _level;                 /* settled power level [W] */
+    int _cand;                  /* candidate new level [W] */
+    unsigned char _cand_n;      /* samples at the candidate level */
+    unsigned char _count;       /* signatures in use */
+    unsigned char _open_n;
+    bool _started;
+
+    inline int _tolerance(int watt) const {
+        int tol = (watt < 0 ? -watt : watt) * TOLERANCE_PCT / 100;
+        return (tol < _min_step_w / 2 ? _min_step_w / 2 : tol);
+    }
+
+    static inline int _abs(int v) { return (v < 0 ? -v : v); }
+
+    void _on_step(unsigned long time_ms, int step) {
+        /* Drop events that never ended (or whose end we missed) */
+        for (unsigned char i = 0; i < _open_n; ) {
+            if (time_ms - _open[i].t > MAX_EVENT_MS) {
+                _open[i] = _open[--_open_n];
+            } else {
+                ++i;
+            }
+        }
+        if (step > 0) {
+            if (_open_n == MAX_OPEN) {
+                /* Forget the oldest */
+                unsigned char oldest = 0;
+                for (unsigned char i = 1; i < _open_n; ++i) {
+                    if ((long)(_open[i].t - _open[oldest].t) < 0) {
+                        oldest = i;
+                    }
+                }
+                _open[oldest] = _open[--_open_n];
+            }
+            _open[_open_n].t = time_ms;
+            _open[_open_n].watt = step;
+            ++_open_n;
+            return;
+        }
+        /* Step down: close the most recent event of about this size */
+        int best = -1;
+        for (unsigned char i = 0; i < _open_n; ++i) {
+            if (_abs(_open[i].watt + step) <= _tolerance(_open[i].watt) &&
+                    (best < 0 || (long)(_open[i].t - _open[best].t) > 0)) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            return;
+        }
+        Event ev = _open[best];
+        _open[best] = _open[--_open_n];
+        _add_event((ev.watt - step) / 2, time_ms - ev.t);
+    }
+
+    void _add_event(int watt, unsigned long dur_ms) {
+        unsigned long dur_s = (dur_ms + 500) / 1000;
+        int best = -1;
+        long best_dist = 0;
+        for (unsigned char i = 0; i < _count; ++i) {
+            const Signature &sig = _sigs[i];
+            int dw = _abs(watt - sig.watt);
+            /* Similar size, and a duration within a factor 3 */
+            if (dw > _tolerance(sig.watt) ||
+                    dur_s * 3 < sig.dur_s || dur_s > sig.dur_s * 3) {
+                continue;
+            }
+            long dist = (long)dw * 100 / sig.watt;
+            if (best < 0 || dist < best_dist) {
+                best = i;
+                best_dist = dist;
+            }
+        }
+        if (best < 0) {
+            if (_count < N) {
+                best = _count++;
+            } else {
+                /* Replace the longest idle signature (the least used of
+                 * those), if there is one without unpublished counts */
+                for (unsigned char i = 0; i < N; ++i) {
+                    const Signature &sig = _sigs[i];
+                    if (sig.events == 0 && (best < 0 ||
+                            sig.idle > _sigs[best].idle ||
+                            (sig.idle == _sigs[best].idle &&
+                             sig.weight < _sigs[best].weight))) {
+                        best = i;
+                    }
+                }
+                if (best < 0) {
+                    return;
+                }
+            }
+            _sigs[best].watt = watt;
+            _sigs[best].dur_s = dur_s;
+            _sigs[best].weight = 0;
+            _sigs[best].events = 0;
+            _sigs[best].joule = 0;
+        }
+        Signature &sig = _sigs[best];
+        if (sig.weight < MAX_WEIGHT) {
+            ++sig.weight;
+        }
+        sig.watt += (watt - sig.watt) / (int)sig.weight;
+        sig.dur_s = (long)sig.dur_s + ((long)dur_s - (long)sig.dur_s) /
+            (long)sig.weight;
+        ++sig.events;
+        sig.joule += (unsigned long)watt * (dur_ms / 1000);
+        sig.idle = 0;
+    }
+
+public:
+    StepClusters(unsigned long period_ms, int min_step_w) :
+            _period_ms(period_ms), _min_step_w(min_step_w), _level(0),
+            _cand_n(0), _count(0), _open_n(0), _started(false) {}
+
+    /* The power at time_ms; once per read cycle */
+    void feed(unsigned long time_ms, int watt) {
+        if (!_started) {
+            _period_t0 = time_ms;
+            _level = watt;
+            _started = true;
+            return;
+        }
+        if (_abs(watt - _level) < _min_step_w) {
+            _cand_n = 0;
+            _level += (watt - _level) / 8; /* follow slow drift */
+            return;
+        }
+        if (_cand_n && _abs(watt - _cand) < _min_step_w) {
+            ++_cand_n;
+            _cand += (watt - _cand) / 2;
+        } else {
+            _cand = watt;
+            _cand_t = time_ms;
+            _cand_n = 1;
+        }
+        if (_cand_n >= SETTLE) {
+            int step = _cand - _level;
+            _level = _cand;
+            _cand_n = 0;
+            _on_step(_cand_t, step);
+        }
+    }
+
+    inline bool is_due(unsigned long time_ms) const {
+        return _started && time_ms - _period_t0 >= _period_ms;
+    }
+
+    /* Start a new period: clear the counts, keep the signatures */
+    void next_period(unsigned long time_ms) {
+        for (unsigned char i = 0; i < _count; ++i) {
+            if (_sigs[i].events == 0 && _sigs[i].idle < 255) {
+                ++_sigs[i].idle;
+            }
+            _sigs[i].events = 0;
+            _sigs[i].joule = 0;
+        }
+        _period_t0 = time_ms;
+    }
+
+    inline unsigned long get_period_start() const { return _period_t0; }
+    inline unsigned char get_count() const { return _count; }
+    inline int get_watt(int i) const { return _sigs[i].watt; }
+    inline unsigned long get_duration_s(int i) const { return _sigs[i].dur_s; }
+    inline unsigned short get_events(int i) const { return _sigs[i].events; }
+    inline unsigned long get_energy_wh(int i) const {
+        return (_sigs[i].joule + 1800) / 3600;
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+/* watt on top of a 250 W base for dur_ms, then a minute of base */
+template<unsigned char N> static unsigned long test_stepclusters_run(
+        StepClusters<N> &steps, unsigned long t, int watt,
+        unsigned long dur_ms)
+{
+    for (unsigned long end = t + dur_ms; t < end; t += 1200) {
+        steps.feed(t, 250 + watt);
+    }
+    for (unsigned long end = t + 60000; t < end; t += 1200) {
+        steps.feed(t, 250);
+    }
+    return t;
+}
+
+static void test_stepclusters()
+{
+    StepClusters<4> steps(3600000, 60);
+    int base = 250;
+    unsigned long t = 0;
+    int early = 0;
+
+    /* An hour: a fridge (+110 W, 10 min) three times, a kettle (+2000 W,
+     * 3 min) once, partly on top of the fridge; 1.2s per cycle */
+    for (; t < 3600000; t += 1200) {
+        int watt = base + (int)(t / 1200 % 5) * 4;  /* some noise */
+        unsigned long in20 = t % 1200000;
+        if (in20 >= 60000 && in20 < 660000) {
+            watt += 110;
+        }
+        if (t >= 600000 && t < 780000) {
+            watt += 2000;
+        }
+        steps.feed(t, watt);
+        early += steps.is_due(t);
+    }
+    INT_EQ("stepclusters(early)", early, 0);
+    steps.feed(t, base);
+    INT_EQ("stepclusters(due)", steps.is_due(t), 1);
+    INT_EQ("stepclusters(count)", steps.get_count(), 2);
+    INT_EQ("stepclusters(fridge)", steps.get_watt(0) / 10, 11);
+    INT_EQ("stepclusters(fridge-s)", steps.get_duration_s(0) / 10, 60);
+    INT_EQ("stepclusters(fridge-n)", steps.get_events(0), 3);
+    INT_EQ("stepclusters(fridge-wh)", steps.get_energy_wh(0) / 10, 5);
+    INT_EQ("stepclusters(kettle)", steps.get_watt(1) / 100, 20);
+    INT_EQ("stepclusters(kettle-s)", steps.get_duration_s(1), 180);
+    INT_EQ("stepclusters(kettle-wh)", steps.get_energy_wh(1), 100);
+
+    /* The next period starts empty, but knows the signatures */
+    steps.next_period(t);
+    INT_EQ("stepclusters(next)", steps.get_events(0), 0);
+    INT_EQ("stepclusters(next-count)", steps.get_count(), 2);
+
+    /* A full table, all at MAX_WEIGHT: a new signature replaces the idle
+     * kettle, not the fridge that ran (unpublished) in this period */
+    StepClusters<2> full(3600000, 60);
+    t = test_stepclusters_run(full, 0, 0, 60000);
+    for (int i = 0; i < 40; ++i) {
+        t = test_stepclusters_run(full, t, 110, 600000);
+        t = test_stepclusters_run(full, t, 2000, 180000);
+    }
+    full.next_period(t);
+    t = test_stepclusters_run(full, t, 110, 600000);
+    t = test_stepclusters_run(full, t, 1000, 300000);  /* heater */
+    INT_EQ("stepclusters(evict-fridge)", full.get_watt(0) / 10, 11);
+    INT_EQ("stepclusters(evict-fridge-n)", full.get_events(0), 1);
+    INT_EQ("stepclusters(evict-heater)", full.get_watt(1) / 100, 10);
+    INT_EQ("stepclusters(evict-heater-n)", full.get_events(1), 1);
+    /* Both ran in this period: no room, the toaster is left out */
+    t = test_stepclusters_run(full, t, 500, 120000);
+    INT_EQ("stepclusters(evict-none)", full.get_watt(1) / 100, 10);
+    INT_EQ("stepclusters(evict-none-n)", full.get_events(0) +
+           full.get_events(1), 2);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_STEPCLUSTERS_H
@@ -0,0 +1,433 @@
+#ifndef INCLUDED_TELEGRAMPARSER_H
+#define INCLUDED_TELEGRAMPARSER_H
+
+/**
+ * TelegramParser consumes pushed (unsolicited) meter telegrams one
+ * character at a time and extracts the few registers we care about.
+ *
+ * Supported framings:
+ *
+ *   IEC 62056-21 mode D (2400 baud, 7E1), block check character:
+ *
+ *     /ISK5ME162-0033\r\n
+ *     \STX 1.8.0(0032826.545*kWh)\r\n ... !\r\n \ETX $BCC
+ *
+ *   DSMR P1 v4/v5 (115200 baud, 8N1), CRC16 over '/' up to and
+ *   including '!':
+ *
+ *     /ISk5\2MT382-1000\r\n
+ *     \r\n
+ *     1-0:1.8.1(000123.456*kWh)\r\n ... !6381\r\n
+ *
+ *   Older DSMR (v2/v3) telegrams without any checksum are accepted as
+ *   well, but is_checked() will return false for those.
+ *
+ * The parser keeps no more than a single line in memory, so the work per
+ * character is constant and small. That is needed to keep up with a meter
+ * that pushes a full telegram every second at 115200 baud.
+ *
+ * Values are only committed after the checksum has been validated. DSMR
+ * meters do not provide 1.8.0/2.8.0 totals, only the per tariff values;
+ * those are summed instead.
+ *
+ * Usage:
+ *
+ *   TelegramParser telegram;
+ *   while (serial.available()) {
+ *       if (telegram.feed(serial.read()) == TelegramParser::DONE) {
+ *           use(telegram.get(TelegramParser::REG_1_8_0));
+ *       }
+ *   }
+ */
+class TelegramParser
+{
+public:
+    enum Result {
+        BUSY = 0,   /* need more data */
+        DONE,       /* a complete and valid telegram was committed */
+        BAD         /* a complete telegram was discarded (checksum) */
+    };
+
+    enum Register {
+        REG_1_8_0 = 0,  /* Positive active energy (A+) total [Wh] */
+        REG_2_8_0,      /* Negative active energy (A-) total [Wh] */
+        REG_1_7_0,      /* Positive active instantaneous power (A+) [W] */
+        REG_2_7_0,      /* Negative active instantaneous power (A-) [W] */
+        REG_LAST
+    };
+
+private:
+    enum State {
+        ST_WAIT_START = 0,  /* waiting for '/' (or STX) */
+        ST_HEADER,          /* identification line */
+        ST_DATA,            /* data lines, up to '!' */
+        ST_TRAILER,         /* CRC digits or "\r\n" up to ETX */
+        ST_BCC              /* waiting for the BCC after ETX */
+    };
+
+    static const unsigned char LINE_SIZE = 48; /* longer lines are skipped */
+
+    State _state;
+    bool _use_bcc;              /* STX seen, we expect ETX + BCC */
+    bool _checked;              /* last committed telegram was checksummed */
+    unsigned char _linelen;     /* 0xff if the line overflowed */
+    unsigned char _crcdigits;
+    unsigned short _crc;        /* running CRC16 */
+    unsigned short _crcgot;     /* CRC16 as sent by the meter */
+    char _bcc;                  /* running BCC */
+    char _line[LINE_SIZE + 1];
+    char _ident[24];
+    char _pending_ts[14];       /* 0-0:1.0.0 "YYMMDDhhmmssX" */
+    char _timestamp[14];
+
+    /* Pending values, filled while the telegram is being received */
+    unsigned long _pending[REG_LAST];
+    unsigned long _tariffs[2];  /* sum of 1.8.x and 2.8.x */
+    unsigned char _pending_mask;
+    unsigned char _tariff_mask;
+
+    /* Committed values */
+    unsigned long _values[REG_LAST];
+    unsigned char _mask;
+
+    /* CRC-16/ARC as used by DSMR: polynomial 0xA001 (reversed), init 0 */
+    static inline unsigned short _crc16(unsigned short crc, char ch) {
+        crc ^= (unsigned char)ch;
+        for (int i = 0; i < 8; ++i) {
+            if (crc & 1) {
+                crc = (crc >> 1) ^ 0xA001;
+            } else {
+                crc = (crc >> 1);
+            }
+        }
+        return crc;
+    }
+
+    static inline int _hexval(char ch) {
+        if (ch >= '0' && ch <= '9')
+            return ch - '0';
+        if (ch >= 'A' && ch <= 'F')
+            return ch - 'A' + 10;
+        if (ch >= 'a' && ch <= 'f')
+            return ch - 'a' + 10;
+        return -1;
+    }
+
+    void _start(bool use_bcc) {
+        _state = (use_bcc ? ST_DATA : ST_HEADER);
+        _use_bcc = use_bcc;
+        _linelen = 0;
+        _crcdigits = 0;
+        _crc = 0;
+        _crcgot = 0;
+        _bcc = 0;
+        _ident[0] = '\0';
+        _pending_ts[0] = '\0';
+        _pending_mask = 0;
+        _tariff_mask = 0;
+        _tariffs[0] = _tariffs[1] = 0;
+    }
+
+    Result _commit(bool checked) {
+        _state = ST_WAIT_START;
+        for (int i = 0; i < REG_LAST; ++i) {
+            if (_pending_mask & (1 << i)) {
+                _values[i] = _pending[i];
+            }
+        }
+        /* Tariff sums only stand in for missing totals */
+        for (int i = 0; i < 2; ++i) {
+            if ((_tariff_mask & (1 << i)) && !(_pending_mask & (1 << i))) {
+                _values[i] = _tariffs[i];
+                _pending_mask |= (1 << i);
+            }
+        }
+        _mask = _pending_mask;
+        _checked = checked;
+        memcpy(_timestamp, _pending_ts, sizeof(_timestamp));
+        return DONE;
+    }
+
+    /* Parse "0032826.545*kWh" and "01.193*kW" into Wh and W */
+    static unsigned long _parse_value(const char *p) {
+        unsigned long val = 0;
+        int decimals = -1;
+        for (; *p != '\0' && *p != '*' && *p != ')'; ++p) {
+            if (*p == '.') {
+                decimals = 0;
+            } else if (*p >= '0' && *p <= '9') {
+                if (decimals < 3) {
+                    val = val * 10 + (*p - '0');
+                    if (decimals >= 0) {
+                        ++decimals;
+                    }
+                }
+            }
+        }
+        /* Scale to thousandths... */
+        for (decimals = (decimals < 0 ? 0 : decimals); decimals < 3;
+                ++decimals) {
+            val *= 10;
+        }
+        /* ... which is exactly Wh or W for kWh and kW */
+        if (*p == '*' && p[1] == 'k') {
+            return val;
+        }
+        return val / 1000;
+    }
+
+    void _on_line() {
+        /* Drop the optional "A-B:" medium/channel prefix */
+        const char *key = _line;
+        const char *p = _line;
+        while (*p != '\0' && *p != '(') {
+            if (*p++ == ':') {
+                key = p;
+            }
+        }
+        if (*p != '(' || (p - key) != 5 || key[1] != '.' || key[3] != '.') {
+            return;
+        }
+        /* 1.0.0 (DSMR time), 1.8.x, 2.8.x, 1.7.0, 2.7.0 */
+        if (memcmp(key, "1.0.0", 5) == 0) {
+            int i = 0;
+            for (++p; *p != '\0' && *p != ')' && i < 13; ++p) {
+                _pending_ts[i++] = *p;
+            }
+            _pending_ts[i] = '\0';
+            return;
+        }
+        int idx = key[0] - '1';
+        if (idx != 0 && idx != 1) {
+            return;
+        }
+        unsigned long val = _parse_value(p + 1);
+        if (key[2] == '8' && key[4] == '0') {
+            _pending[REG_1_8_0 + idx] = val;
+            _pending_mask |= (1 << (REG_1_8_0 + idx));
+        } else if (key[2] == '8' && key[4] >= '1' && key[4] <= '9') {
+            _tariffs[idx] += val;
+            _tariff_mask |= (1 << idx);
+        } else if (key[2] == '7' && key[4] == '0') {
+            _pending[REG_1_7_0 + idx] = val;
+            _pending_mask |= (1 << (REG_1_7_0 + idx));
+        }
+    }
+
+public:
+    TelegramParser() : _state(ST_WAIT_START), _checked(false), _mask(0) {
+        _ident[0] = '\0';
+        _timestamp[0] = '\0';
+    }
+
+    /* Forget any partially received telegram */
+    inline void reset() {
+        _state = ST_WAIT_START;
+    }
+
+    /* Do we have a committed value for this register? */
+    inline bool has(Register reg) {
+        return (_mask & (1 << reg));
+    }
+
+    /* Get the committed value (Wh or W) */
+    inline unsigned long get(Register reg) {
+        return _values[reg];
+    }
+
+    /* Was the last committed telegram protected by a BCC or CRC? */
+    inline bool is_checked() {
+        return _checked;
+    }
+
+    /* Identification line of the current telegram (without '/') */
+    inline const char *get_identification() {
+        return _ident;
+    }
+
+    /* Time of the last committed telegram ("YYMMDDhhmmssX"), if any */
+    inline const char *get_timestamp() {
+        return _timestamp;
+    }
+
+    /* Feed a single received character */
+    Result feed(char ch) {
+        if (_state == ST_BCC) {
+            /* The BCC may be any value, '/' included */
+            _state = ST_WAIT_START;
+            return (ch == _bcc) ? _commit(true) : BAD;
+        }
+        if (ch == '/' && _state != ST_WAIT_START && _state != ST_HEADER) {
+            /* Start of a new telegram while we were still busy with the
+             * previous one: we must have lost data. Resync. */
+            _start(false);
+            _crc = _crc16(_crc, ch);
+            return BAD;
+        }
+
+        switch (_state) {
+        case ST_WAIT_START:
+            if (ch == '/') {
+                _start(false);
+                _crc = _crc16(_crc, ch);
+            } else if (ch == '\x02') {
+                _start(true);
+            }
+            break;
+
+        case ST_HEADER:
+            _crc = _crc16(_crc, ch);
+            if (ch == '\n') {
+                _state = ST_DATA;
+            } else if (ch != '\r' && _linelen < sizeof(_ident) - 1) {
+                _ident[_linelen++] = ch;
+                _ident[_linelen] = '\0';
+            }
+            if (_state == ST_DATA) {
+                _linelen = 0;
+            }
+            break;
+
+        case ST_DATA:
+            _crc = _crc16(_crc, ch);
+            if (ch == '\x02') {
+                /* Mode D: the BCC covers everything after the STX */
+                _use_bcc = true;
+                _bcc = 0;
+                break;
+            }
+            if (_use_bcc) {
+                _bcc ^= ch;
+            }
+            if (ch == '!' && _linelen == 0) {
+                _state = ST_TRAILER;
+            } else if (ch == '\n') {
+                if (_linelen != 0xff) {
+                    _line[_linelen] = '\0';
+                    _on_line();
+                }
+                _linelen = 0;
+            } else if (ch == '\r') {
+                ;
+            } else if (_linelen < LINE_SIZE) {
+                _line[_linelen++] = ch;
+            } else {
+                _linelen = 0xff; /* overflow, skip this line */
+            }
+            break;
+
+        case ST_TRAILER:
+            if (_use_bcc) {
+                _bcc ^= ch;
+                if (ch == '\x03') {
+                    _state = ST_BCC;
+                }
+            } else if (_hexval(ch) >= 0 && _crcdigits < 4) {
+                _crcgot = (_crcgot << 4) | _hexval(ch);
+                ++_crcdigits;
+            } else if (ch == '\n') {
+                _state = ST_WAIT_START;
+                if (_crcdigits == 4) {
+                    return (_crcgot == _crc) ? _commit(true) : BAD;
+                }
+                /* DSMR v2/v3: no CRC at all */
+                return (_crcdigits == 0) ? _commit(false) : BAD;
+            } else if (ch != '\r') {
+                _state = ST_WAIT_START;
+                return BAD;
+            }
+            break;
+
+        case ST_BCC:
+            break; /* handled above */
+        }
+        return BUSY;
+    }
+};
+
+#ifdef TEST_BUILD
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static int _feed_telegram(TelegramParser &parser, const char *p)
+{
+    int done = 0;
+    for (; *p != '\0'; ++p) {
+        TelegramParser::Result res = parser.feed(*p);
+        if (res != TelegramParser::BUSY) {
+            done = (res == TelegramParser::DONE ? 1 : -1);
+        }
+    }
+    return done;
+}
+
+static void test_telegramparser()
+{
+    const char *dsmr = (
+        "/ISk5\\2MT382-1000\r\n"
+        "\r\n"
+        "1-3:0.2.8(50)\r\n"
+        "0-0:1.0.0(101209113020W)\r\n"
+        "1-0:1.8.1(000123.456*kWh)\r\n"
+        "1-0:1.8.2(000654.321*kWh)\r\n"
+        "1-0:2.8.1(000000.012*kWh)\r\n"
+        "1-0:2.8.2(000001.000*kWh)\r\n"
+        "1-0:1.7.0(01.193*kW)\r\n"
+        "1-0:2.7.0(00.000*kW)\r\n"
+        "!6381\r\n");
+    TelegramParser parser;
+    INT_EQ("telegramparser(dsmr)", _feed_telegram(parser, dsmr), 1);
+    INT_EQ("telegramparser(dsmr-checked)", parser.is_checked(), 1);
+    INT_EQ("telegramparser(dsmr-1.8.0)",
+        parser.get(TelegramParser::REG_1_8_0), 777777);
+    INT_EQ("telegramparser(dsmr-2.8.0)",
+        parser.get(TelegramParser::REG_2_8_0), 1012);
+    INT_EQ("telegramparser(dsmr-1.7.0)",
+        parser.get(TelegramParser::REG_1_7_0), 1193);
+    INT_EQ("telegramparser(dsmr-2.7.0)",
+        parser.has(TelegramParser::REG_2_7_0), 1);
+    INT_EQ("telegramparser(dsmr-time)",
+        memcmp(parser.get_timestamp(), "101209113020W", 14), 0);
+
+    /* A single flipped bit must not be committed */
+    INT_EQ("telegramparser(dsmr-badcrc)", _feed_telegram(parser, (
+        "/ISk5\\2MT382-1000\r\n\r\n"
+        "1-0:1.8.1(000123.457*kWh)\r\n!6381\r\n")), -1);
+    INT_EQ("telegramparser(dsmr-unchanged)",
+        parser.get(TelegramParser::REG_1_8_0), 777777);
+
+    /* Mode D with BCC; no power registers here */
+    TelegramParser moded;
+    INT_EQ("telegramparser(mode-d)", _feed_telegram(moded, (
+        "/ISK5ME162-0033\r\n"
+        "\x02" "C.1.0(28342193)\r\n"
+        "1.8.0(0032826.545*kWh)\r\n"
+        "2.8.0(0000000.001*kWh)\r\n"
+        "!\r\n\x03" "n")), 1);
+    INT_EQ("telegramparser(mode-d-1.8.0)",
+        moded.get(TelegramParser::REG_1_8_0), 32826545);
+    INT_EQ("telegramparser(mode-d-2.8.0)",
+        moded.get(TelegramParser::REG_2_8_0), 1);
+    INT_EQ("telegramparser(mode-d-1.7.0)",
+        moded.has(TelegramParser::REG_1_7_0), 0);
+    INT_EQ("telegramparser(mode-d-badbcc)", _feed_telegram(moded, (
+        "/ISK5ME162-0033\r\n"
+        "\x02" "1.8.0(0032826.546*kWh)\r\n!\r\n\x03" "n")), -1);
+    INT_EQ("telegramparser(mode-d-bcc-slash)", _feed_telegram(moded, (
+        "/ISK5ME162-0033\r\n"
+        "\x02" "C.1.0(28342197)\r\n"
+        "F.F(00)\r\n"
+        "1.8.0(0032826.545*kWh)\r\n"
+        "!\r\n\x03" "/")), 1);
+
+    /* Lost characters: the next '/' resyncs */
+    TelegramParser lossy;
+    INT_EQ("telegramparser(resync)", _feed_telegram(lossy, (
+        "/ISk5\\2MT382-1000\r\n\r\n1-0:1.8.1(0001")), 0);
+    INT_EQ("telegramparser(resync)", _feed_telegram(lossy, dsmr), 1);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_TELEGRAMPARSER_H
@@ -0,0 +1,156 @@
+#ifndef INCLUDED_WALLCLOCK_H
+#define INCLUDED_WALLCLOCK_H
+
+/**
+ * WallClock maps millis() to wall clock time, using the time (0.9.1) and
+ * date (0.9.2) registers of the meter as reference.
+ *
+ * The meter clock has a resolution of one second and runs in local time,
+ * so the resulting timestamps are "seconds since 1970 in meter time". We
+ * don't need anything more precise than that: it is used to align
+ * publishes and to request load profiles from the meter itself.
+ *
+ * Usage:
+ *
+ *   WallClock clock;
+ *   clock.set_time_of_day(millis(), 22, 35, 4);  // from 0.9.1
+ *   clock.set_date(millis(), 21, 3, 14);         // from 0.9.2
+ *   if (clock.is_valid())
+ *       unsigned long now = clock.now(millis());
+ */
+class WallClock
+{
+private:
+    unsigned long _base_s;  /* wall clock seconds at... */
+    unsigned long _base_ms; /* ... this millis() value */
+    unsigned long _tod_s;   /* time of day, waiting for the date */
+    unsigned long _tod_ms;
+    bool _have_tod;
+    bool _valid;
+
+public:
+    WallClock() : _have_tod(false), _valid(false) {}
+
+    /* Convert civil date/time to seconds since 1970-01-01 00:00:00 */
+    static unsigned long from_civil(
+            int year, int month, int day, int hh, int mm, int ss) {
+        /* Howard Hinnant's days_from_civil, for years >= 1970 */
+        year -= (month <= 2);
+        unsigned long era = year / 400;
+        unsigned long yoe = year - era * 400;
+        unsigned long doy = (
+            (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1);
+        unsigned long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        unsigned long days = era * 146097 + doe - 719468;
+        return days * 86400UL + hh * 3600UL + mm * 60UL + ss;
+    }
+
+    /* Convert seconds since 1970 to "YYMMDDhhmm" (needs 11 bytes) */
+    static void format_yymmddhhmm(char *buf, unsigned long t) {
+        unsigned long z = t / 86400UL + 719468;
+        unsigned long era = z / 146097;
+        unsigned long doe = z - era * 146097;
+        unsigned long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        unsigned long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        unsigned long mp = (5 * doy + 2) / 153;
+        unsigned day = doy - (153 * mp + 2) / 5 + 1;
+        unsigned month = (mp < 10 ? mp + 3 : mp - 9);
+        unsigned year = yoe + era * 400 + (month <= 2);
+        unsigned tod = t % 86400UL;
+        unsigned vals[5] = {
+            year % 100, month, day, tod / 3600, (tod / 60) % 60};
+        for (int i = 0; i < 5; ++i) {
+            buf[i * 2] = '0' + vals[i] / 10;
+            buf[i * 2 + 1] = '0' + vals[i] % 10;
+        }
+        buf[10] = '\0';
+    }
+
+    /* Feed the time of day (0.9.1), read at time_ms */
+    inline void set_time_of_day(unsigned long time_ms, int hh, int mm, int ss) {
+        _tod_s = hh * 3600UL + mm * 60UL + ss;
+        _tod_ms = time_ms;
+        _have_tod = true;
+    }
+
+    /* Feed the date (0.9.2), read at time_ms; needs the time of day first */
+    void set_date(unsigned long time_ms, int yy, int month, int day) {
+        if (!_have_tod || (time_ms - _tod_ms) > 5000) {
+            return;
+        }
+        /* Don't try to guess on which day the time was read */
+        if (_tod_s + (time_ms - _tod_ms + 999) / 1000 >= 86400UL) {
+            return;
+        }
+        _base_s = from_civil(2000 + yy, month, day, 0, 0, 0) + _tod_s;
+        _base_ms = _tod_ms;
+        _have_tod = false;
+        _valid = true;
+    }
+
+    /* Do we know what time it is? */
+    inline bool is_valid() {
+        return _valid;
+    }
+
+    /* Is it time to re-read the meter clock? (Once an hour.) */
+    inline bool needs_sync(unsigned long time_ms) {
+        return (!_valid || (time_ms - _base_ms) > 3600000UL);
+    }
+
+    /* Get wall clock seconds at time_ms, or 0 if unknown */
+    inline unsigned long now(unsigned long time_ms) {
+        if (!_valid) {
+            return 0;
+        }
+        long delta = (long)(time_ms - _base_ms);
+        if (delta < 0) {
+            /* Before the last sync: round down, not towards zero */
+            return _base_s - (unsigned long)(999 - delta) / 1000;
+        }
+        return _base_s + delta / 1000;
+    }
+
+    /* Get the millis() value at which it is wall clock second t */
+    inline unsigned long millis_at(unsigned long t) {
+        return _base_ms + (t - _base_s) * 1000;
+    }
+};
+
+#ifdef TEST_BUILD
+static int STR_EQ(const char *func, const char *got, const char *expected);
+static int INT_EQ(const char *func, int got, int expected);
+extern "C" int printf(const char *, ...);
+
+static void test_wallclock()
+{
+    char buf[11];
+    INT_EQ("wallclock(from_civil)",
+        WallClock::from_civil(1970, 1, 1, 0, 0, 0), 0);
+    INT_EQ("wallclock(from_civil)",
+        WallClock::from_civil(2021, 3, 14, 22, 35, 4), 1615761304);
+    INT_EQ("wallclock(from_civil)",
+        WallClock::from_civil(2024, 2, 29, 23, 59, 59), 1709251199);
+    WallClock::format_yymmddhhmm(buf, 1709251199);
+    STR_EQ("wallclock(format)", buf, "2402292359");
+    WallClock::format_yymmddhhmm(buf, 1709251200);
+    STR_EQ("wallclock(format)", buf, "2403010000");
+
+    WallClock clock;
+    INT_EQ("wallclock(invalid)", clock.now(1000), 0);
+    clock.set_date(1000, 21, 3, 14); /* date without time: ignored */
+    INT_EQ("wallclock(invalid)", clock.is_valid(), 0);
+    clock.set_time_of_day(1000, 22, 35, 4);
+    clock.set_date(1300, 21, 3, 14);
+    INT_EQ("wallclock(now)", clock.now(1000), 1615761304);
+    INT_EQ("wallclock(now)", clock.now(61999), 1615761364);
+    INT_EQ("wallclock(now)", clock.now(999), 1615761303);
+    INT_EQ("wallclock(millis_at)", clock.millis_at(1615761364), 61000);
+    INT_EQ("wallclock(needs_sync)", clock.needs_sync(61999), 0);
+    INT_EQ("wallclock(needs_sync)", clock.needs_sync(3601001), 1);
+    printf("\n");
+}
+#endif
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_WALLCLOCK_H
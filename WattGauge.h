@@ -170,9 +170,11 @@ private:
     WattGauge _positive;
     WattGauge _negative;
     int _wprev;
+    int _wdirect;       /* power as reported by the meter itself */
+    bool _has_wdirect;  /* if set, _wdirect is used instead of the estimate */
 
 public:
-    EnergyGauge() : _wprev(0) {};
+    EnergyGauge() : _wprev(0), _wdirect(0), _has_wdirect(false) {};
     inline unsigned long get_positive_active_energy_total() {
         return _positive.get_active_energy_total();
     }
@@ -180,6 +182,9 @@ public:
         return _negative.get_active_energy_total();
     }
     inline int get_instantaneous_power() {
+        if (_has_wdirect) {
+            return _wdirect;
+        }
         if (_positive.interval_since_last_change() <
                 _negative.interval_since_last_change()) {
             return _positive.get_instantaneous_power();
@@ -210,11 +215,22 @@ public:
             unsigned long time_ms, unsigned long current_wh) {
         _negative.set_active_energy_total(time_ms, current_wh);
     }
+    /* Meters that push 1.7.0/2.7.0 (like DSMR P1) need no estimate: feed
+     * the net power (1.7.0 - 2.7.0) here and it will be used instead. */
+    inline void set_instantaneous_power(int watt) {
+        _wdirect = watt;
+        _has_wdirect = true;
+    }
     inline void reset() {
         _wprev = get_instantaneous_power();
         _positive.reset();
         _negative.reset();
     }
+    /* Only take the current power as the reference for the next
+     * has_significant_change(), without starting a new interval */
+    inline void reset_significance() {
+        _wprev = get_instantaneous_power();
+    }
 };
 
 #ifdef TEST_BUILD
@@ -12,8 +12,10 @@
 # include <CustomSoftwareSerial.h>
 # define SoftwareSerial CustomSoftwareSerial
 # define SWSERIAL_7E1 CSERIAL_7E1
+# define SWSERIAL_8N1 CSERIAL_8N1
 #elif defined(TEST_BUILD)
 # include <SoftwareSerial.h>
+# define HAVE_MQTT /* without HAVE_WIFI: uses the FakeMqttClient */
 #else
 # error Unsupported platform
 #endif
@@ -24,15 +26,42 @@
 # ifdef HAVE_MQTT
 #  include <ArduinoMqttClient.h>
 # endif
+#elif defined(TEST_BUILD)
+# include "FakeMqttClient.h"
 #endif
 
 /* Helper for PROGMEM/flash strings. */
 #include "progmem.h"  // possibly used in config.h
 
 #include "WattGauge.h"
+#include "TelegramParser.h"
+#include "WallClock.h"
+#include "LoadProfile.h"
+#include "PowerGrid.h"
+#include "Baseload.h"
+#include "BrokerList.h"
+#include "PayloadFields.h"
+#include "PublishPolicy.h"
+#include "SampleFrame.h"
+#include "MeterProfile.h"
+#include "RegisterLag.h"
+#include "ShadowEstimators.h"
+#include "ReadoutDelta.h"
+#include "ExportLane.h"
+#include "StepClusters.h"
+#ifdef TEST_BUILD
+# include "PayloadDecoder.h" /* host side only; included for its tests */
+# ifdef __linux__
+#  include "SampleStore.h"
+# endif
+#endif
 
 #include "config.h"
 
+#ifndef METER_PROFILE
+# define METER_PROFILE MeterProfileIskraME162
+#endif
+
 #include "arduino_secrets.h"
 
 #endif //INCLUDED_PE32ME162IR_PUB_H
@@ -35,6 +35,11 @@
  * > The optical port wavelength is 660 nm and luminous
  * > intensity is min. 1 mW/sr for the ON state.
  *
+ * Push mode (optional, see PUSH_MODE_D and PUSH_MODE_P1 in config.h):
+ * - some meters push telegrams by themselves, without a request: IEC
+ *   62056-21 mode D (2400 baud, 7E1) or the DSMR P1 port (115200 baud, 8N1);
+ * - in that case we only listen, validate the BCC/CRC16 and publish.
+ *
  * IEC 62056-21 mode C:
  * - is a bidirectional ASCII protocol;
  * - that starts in 300 baud with 1 start bit, 7 data bits, 1 (even)
@@ -68,7 +73,6 @@ static const int PIN_IR_TX = 10; // digital pin 10
 
 DECLARE_PGM_CHAR_P(wifi_ssid, SECRET_WIFI_SSID);
 DECLARE_PGM_CHAR_P(wifi_password, SECRET_WIFI_PASS);
-DECLARE_PGM_CHAR_P(mqtt_broker, SECRET_MQTT_BROKER);
 static const int mqtt_port = SECRET_MQTT_PORT;
 DECLARE_PGM_CHAR_P(mqtt_topic, SECRET_MQTT_TOPIC);
 
@@ -78,6 +82,22 @@ static const int PULSE_THRESHOLD = 100;  // analog value between 0 and 1023
 
 static const int STATE_CHANGE_TIMEOUT = 15; // reset state after 15s of no change
 
+#if defined(PUSH_MODE_D) && defined(PUSH_MODE_P1)
+# error PUSH_MODE_D and PUSH_MODE_P1 are mutually exclusive
+#elif defined(PUSH_MODE_P1)
+# define PUSH_MODE
+static const long PUSH_BAUD = 115200;
+# define PUSH_SERIAL_MODE SWSERIAL_8N1
+static const bool IR_INVERTED = true; // P1 is an inverted open collector
+#elif defined(PUSH_MODE_D)
+# define PUSH_MODE
+static const long PUSH_BAUD = 2400;
+# define PUSH_SERIAL_MODE SWSERIAL_7E1
+static const bool IR_INVERTED = false;
+#else
+static const bool IR_INVERTED = false;
+#endif
+
 enum State {
   STATE_WR_LOGIN = 0,
   STATE_RD_IDENTIFICATION,
@@ -94,7 +114,12 @@ enum State {
   STATE_RD_RESP_OBIS,
 
   STATE_MAYBE_PUBLISH,
-  STATE_SLEEP
+  STATE_SLEEP,
+
+  STATE_RD_PUSH_TELEGRAM, /* listen-only (push) mode */
+
+  STATE_WR_REQ_PROFILE,   /* load profile (P.01) backfill */
+  STATE_RD_RESP_PROFILE
 };
 
 /* Subset of OBIS (or EDIS) codes from IEC 62056 provided by the ISKRA ME-162.
@@ -142,6 +167,7 @@ const obis_pgm_t Obis_[] PROGMEM = {
 
 struct obis_values_t {
   unsigned long values[OBIS_LAST];
+  unsigned present; /* bitmask of (1 << Obis) values found */
 };
 
 /* C-escape, for improved serial monitor readability */
@@ -159,16 +185,26 @@ static inline enum Obis str2Obis(const char *key, int keylen);
 inline const pgm_char *Obis2str(Obis obis) {
   return to_pgm_char_p(Obis_[obis].pgm_str);
 }
+/* Split the next code(value) line off a data readout buffer */
+static bool readout_next_line(
+    const char **src, const char **key, int *keylen,
+    const char **value, int *valuelen);
 /* Parse data readout buffer and populate obis_values_t */
 static void parse_data_readout(struct obis_values_t *dst, const char *src);
 
-#ifdef HAVE_MQTT /* and HAVE_WIFI */
+#ifdef HAVE_WIFI
 static void ensure_wifi();
-static void ensure_mqtt();
 #else
 static inline void ensure_wifi() {} /* noop */
+#endif
+#ifdef HAVE_MQTT
+static void ensure_mqtt();
+#else
 static inline void ensure_mqtt() {} /* noop */
 #endif
+#if defined(CLOUD_LANE_S) && defined(HAVE_MQTT)
+static void ensure_cloud_mqtt();
+#endif
 
 /* Helpers */
 template<class T> static inline void iskra_tx(const T *p);
@@ -186,12 +222,40 @@ template<class T> inline Print &operator << (Print &obj, T arg) {
 };
 
 /* Events */
-static State on_data_block_or_data_set(char *data, size_t pos, State st);
+static State on_data_block_or_data_set(
+    char *data, size_t pos, State st, bool partial);
 static State on_hello(const char *data, size_t end, State st);
-static void on_data_readout(const char *data, size_t end);
+static void on_data_readout(const char *data, size_t end, bool partial);
 static void on_response(const char *data, size_t end, Obis obis);
+static void on_energy_total(Obis obis, unsigned long t, unsigned long wh);
+#ifdef LOAD_PROFILE_BACKFILL
+static void on_profile_block(const char *data, bool partial);
+static void on_publish_result(bool ok);
+#endif
+#ifdef PUSH_MODE
+static void on_push_telegram();
+#endif
 
-static void publish();
+static bool maybe_publish(unsigned long now);
+static void publish(unsigned long align_t = 0, int align_w = 0);
+#ifdef POWER_GRID_S
+static void publish_grid();
+#endif
+#ifdef BASELOAD_WINDOW_S
+static void publish_baseload();
+#endif
+#ifdef LOAD_PROFILE_BACKFILL
+static void publish_profile_batch();
+#endif
+#ifdef SHADOW_ESTIMATORS
+static void publish_shadows();
+#endif
+#ifdef CLOUD_LANE_S
+static void maybe_publish_cloud(unsigned long now);
+#endif
+#ifdef STEP_CLUSTERS_S
+static void publish_steps();
+#endif
 
 /* ASCII control codes */
 const char C_SOH = '\x01';
@@ -200,6 +264,8 @@ const char C_STX = '\x02';
 #define    S_STX   "\x02"
 const char C_ETX = '\x03';
 #define    S_ETX   "\x03"
+const char C_EOT = '\x04';
+#define    S_EOT   "\x04"
 const char C_ACK = '\x06';
 #define    S_ACK   "\x06"
 const char C_NAK = '\x15';
@@ -222,10 +288,65 @@ WiFiClient wifiClient;
 # ifdef HAVE_MQTT
 MqttClient mqttClient(wifiClient);
 # endif
+#elif defined(HAVE_MQTT)
+MqttClient mqttClient; /* FakeMqttClient */
 #endif
 
+#ifdef HAVE_MQTT
+# ifndef SECRET_MQTT_BROKERS
+#  define SECRET_MQTT_BROKERS { SECRET_MQTT_BROKER }
+# endif
+# ifndef MQTT_FAILBACK_S
+#  define MQTT_FAILBACK_S 600
+# endif
+/* Brokers in order of preference. We fail over to the next one when a
+ * connect fails (or takes longer than MQTT_CONNECT_TIMEOUT_MS), and we go
+ * back to a preferred one after MQTT_FAILBACK_S seconds on a fallback. */
+static const char *const mqtt_brokers[] = SECRET_MQTT_BROKERS;
+static const unsigned MQTT_CONNECT_TIMEOUT_MS = 1500;
+BrokerSelector<sizeof(mqtt_brokers) / sizeof(mqtt_brokers[0])> brokers(
+    MQTT_FAILBACK_S * 1000UL, MQTT_CONNECT_TIMEOUT_MS / 2);
+#endif
+
+#ifdef CLOUD_LANE_S
+/* The second (upstream) export lane: its own brokers and topic, and only
+ * an aggregate every CLOUD_LANE_S seconds, over the last CLOUD_WINDOW_S
+ * (a multiple of CLOUD_LANE_S, rounded up). */
+# ifndef CLOUD_WINDOW_S
+#  define CLOUD_WINDOW_S CLOUD_LANE_S
+# endif
+# define CLOUD_WINDOW_SLICES \
+  ((CLOUD_WINDOW_S + CLOUD_LANE_S - 1) / CLOUD_LANE_S)
+typedef char cloud_window_check[
+  CLOUD_WINDOW_S >= CLOUD_LANE_S && CLOUD_WINDOW_SLICES <= 32 ? 1 : -1];
+# ifdef HAVE_WIFI
+#  ifdef MQTT_TLS
+WiFiClientSecure cloudWifiClient;
+#  else
+WiFiClient cloudWifiClient;
+#  endif
+MqttClient cloudMqttClient(cloudWifiClient);
+# elif defined(HAVE_MQTT)
+MqttClient cloudMqttClient; /* FakeMqttClient */
+# endif
+# ifdef HAVE_MQTT
+static const char *const cloud_mqtt_brokers[] = SECRET_CLOUD_MQTT_BROKERS;
+static const int cloud_mqtt_port = SECRET_CLOUD_MQTT_PORT;
+DECLARE_PGM_CHAR_P(cloud_mqtt_topic, SECRET_CLOUD_MQTT_TOPIC);
+BrokerSelector<sizeof(cloud_mqtt_brokers) / sizeof(cloud_mqtt_brokers[0])>
+    cloud_brokers(MQTT_FAILBACK_S * 1000UL, MQTT_CONNECT_TIMEOUT_MS / 2);
+/* A cloud (re)connect is left to the STATE_SLEEP that follows */
+bool cloud_connect_due = false;
+# endif
+RollingLane<CLOUD_WINDOW_SLICES> cloud_lane(CLOUD_LANE_S * 1000UL);
+#endif //CLOUD_LANE_S
+
 #ifdef MQTT_TLS
 static const uint8_t mqtt_fingerprint[20] PROGMEM = SECRET_MQTT_FINGERPRINT;
+# ifdef CLOUD_LANE_S
+static const uint8_t cloud_mqtt_fingerprint[20] PROGMEM =
+  SECRET_CLOUD_MQTT_FINGERPRINT;
+# endif
 #endif
 
 #ifdef MQTT_AUTH
@@ -234,6 +355,10 @@ static const uint8_t mqtt_fingerprint[20] PROGMEM = SECRET_MQTT_FINGERPRINT;
 # else
 DECLARE_PGM_CHAR_P(mqtt_user, SECRET_MQTT_USER);
 DECLARE_PGM_CHAR_P(mqtt_pass, SECRET_MQTT_PASS);
+#  ifdef CLOUD_LANE_S
+DECLARE_PGM_CHAR_P(cloud_mqtt_user, SECRET_CLOUD_MQTT_USER);
+DECLARE_PGM_CHAR_P(cloud_mqtt_pass, SECRET_CLOUD_MQTT_PASS);
+#  endif
 # endif
 #endif
 
@@ -249,8 +374,9 @@ DECLARE_PGM_CHAR_P(mqtt_pass, SECRET_MQTT_PASS);
  *   SoftwareSerial already includes different modes);
  * - we require SERIAL_7E1 (7bit, even parity, 1 stop bit).
  * Supply RX pin, TX pin, inverted=false. Our IR-device uses:
- * HIGH == no TX light == (serial) idle */
-SoftwareSerial iskra(PIN_IR_RX, PIN_IR_TX, false);
+ * HIGH == no TX light == (serial) idle
+ * (The DSMR P1 port is inverted, so there we use inverted=true.) */
+SoftwareSerial iskra(PIN_IR_RX, PIN_IR_TX, IR_INVERTED);
 
 /* Current state, scheduled state, current "write" state for retries */
 State state, next_state, write_state;
@@ -267,17 +393,113 @@ char buffer_data[buffer_size + 1];
  * 3chars + 1char-baud + (optional) + 16char-ident */
 char identification[32];
 
+#ifdef HAVE_MQTT
+/* Last published data readout registers (up to READOUT_REGISTERS codes);
+ * every READOUT_KEYFRAME readouts, all of them are published again. */
+#ifndef READOUT_KEYFRAME
+#define READOUT_KEYFRAME 10
+#endif
+#ifndef READOUT_REGISTERS
+#define READOUT_REGISTERS 12
+#endif
+ReadoutDelta<READOUT_REGISTERS> readout_delta(READOUT_KEYFRAME);
+#endif
+
 #ifdef OPTIONAL_LIGHT_SENSOR
 /* Record low and high pulse values so we can debug/monitor the light
  * sensor values from the MQTT data. */
 short pulse_low = 1023;
 short pulse_high = 0;
+/* Time between a pulse and its Wh showing up in the totals. */
+RegisterLag register_lag;
 #endif //OPTIONAL_LIGHT_SENSOR
 
+#ifdef PUSH_MODE
+/* Streaming parser for pushed telegrams; holds only a single line. */
+TelegramParser telegram;
+#endif
+
 Obis next_obis;
-EnergyGauge gauge; /* feed it 1.8.0 and 2.8.0, get 1.7.0 and 2.7.0 */
+typedef METER_PROFILE Meter; /* see MeterProfile.h */
+WallClock wallclock; /* fed by 0.9.1 and 0.9.2 */
+EnergyGauge gauge;
+PublishPolicy publish_policy;
+
+#ifdef POWER_GRID_S
+/* Average power per POWER_GRID_S slot, aligned to the wall clock, is
+ * published in batches of POWER_GRID_BATCH consecutive slots. */
+static const int POWER_GRID_BATCH = 12;
+PowerGrid grid(POWER_GRID_S * 1000UL);
+unsigned long grid_batch_t0;
+int grid_batch_len;
+int grid_batch[POWER_GRID_BATCH];
+#endif /* feed it 1.8.0 and 2.8.0, get 1.7.0 and 2.7.0 */
+
+#ifdef BASELOAD_WINDOW_S
+/* Sliding minimum over the window averages of the last 24 hours. */
+BaseloadTracker<86400UL / BASELOAD_WINDOW_S> baseload(
+    BASELOAD_WINDOW_S * 1000UL);
+#endif
 unsigned long last_publish;
 
+#ifdef STEP_CLUSTERS_S
+/* Load steps (appliances switching) clustered into signatures, with
+ * their counts and energy published every STEP_CLUSTERS_S seconds. */
+# ifndef STEP_CLUSTERS_MIN_W
+#  define STEP_CLUSTERS_MIN_W 60
+# endif
+typedef StepClusters<8> Steps;
+Steps steps(STEP_CLUSTERS_S * 1000UL, STEP_CLUSTERS_MIN_W);
+#endif
+
+#ifdef SHADOW_ESTIMATORS
+/* Alternative estimators on the same totals, compared to the gauge and
+ * reported on the debug topic, but never published as e_inst_power_w.
+ * Feeding them may take SHADOW_BUDGET_US per total, so they cannot
+ * disturb the IR timing; their RAM is checked against SHADOW_RAM_BUDGET
+ * at compile time. */
+# ifndef SHADOW_BUDGET_US
+#  define SHADOW_BUDGET_US 500
+# endif
+# ifndef SHADOW_RAM_BUDGET
+#  define SHADOW_RAM_BUDGET 256
+# endif
+WindowEstimator<8> shadow_window(60000);
+EdgeEstimator shadow_edge;
+ShadowEstimator *const shadow_list[] = {&shadow_window, &shadow_edge};
+ShadowSet shadows(shadow_list, 2, SHADOW_BUDGET_US, micros);
+typedef char shadow_ram_budget_exceeded[
+  sizeof(shadow_window) + sizeof(shadow_edge) <= SHADOW_RAM_BUDGET ? 1 : -1];
+#endif
+
+#ifdef PUBLISH_ALIGN_S
+/* Wall clock boundary (s) of the current aligned window; 0 if none yet */
+unsigned long publish_align_t;
+/* Did we see that window from its start? Not the one in which the clock
+ * became known: that one is not published. */
+bool publish_align_whole;
+/* The totals since that boundary, for the exact window average */
+LaneAggregate publish_align_window(PUBLISH_ALIGN_S * 1000UL);
+#endif
+
+#ifdef LOAD_PROFILE_BACKFILL
+/* Gap bookkeeping (wall clock seconds). If backfill_from is set, we have
+ * missed publishes since then. Once we can publish again, backfill_due is
+ * set and the meter's own load profile is used to fill the gap. */
+unsigned long last_publish_wallclock;
+unsigned long backfill_from;
+bool backfill_due;
+int backfill_tries; /* give up if the meter does not answer at all */
+LoadProfileParser profile;
+
+/* Historical samples are published in batches of consecutive records. */
+static const int PROFILE_BATCH_SIZE = 8;
+unsigned long profile_batch_t0;
+unsigned short profile_batch_period;
+int profile_batch_len;
+long profile_batch[PROFILE_BATCH_SIZE][LoadProfileParser::MAX_CHANNELS];
+#endif
+
 
 void setup()
 {
@@ -290,9 +512,24 @@ void setup()
   strncpy(guid + 6, WiFi.macAddress().c_str(), sizeof(guid) - (6 + 1));
 # ifdef MQTT_TLS
   wifiClient.setFingerprint(mqtt_fingerprint);
+#  ifdef CLOUD_LANE_S
+  cloudWifiClient.setFingerprint(cloud_mqtt_fingerprint);
+#  endif
 # endif
 # ifdef MQTT_AUTH
   mqttClient.setUsernamePassword(mqtt_user, mqtt_pass);
+#  ifdef CLOUD_LANE_S
+  cloudMqttClient.setUsernamePassword(cloud_mqtt_user, cloud_mqtt_pass);
+#  endif
+# endif
+# ifdef HAVE_MQTT
+  /* Limit the time a connect attempt may block the IR loop */
+  wifiClient.setTimeout(MQTT_CONNECT_TIMEOUT_MS);
+  mqttClient.setConnectionTimeout(MQTT_CONNECT_TIMEOUT_MS);
+#  ifdef CLOUD_LANE_S
+  cloudWifiClient.setTimeout(MQTT_CONNECT_TIMEOUT_MS);
+  cloudMqttClient.setConnectionTimeout(MQTT_CONNECT_TIMEOUT_MS);
+#  endif
 # endif
 #endif
 
@@ -307,13 +544,19 @@ void setup()
   ensure_wifi();
   ensure_mqtt();
 
+#ifdef PUSH_MODE
+  // The meter talks, we listen. Nothing to send.
+  iskra.begin(PUSH_BAUD, PUSH_SERIAL_MODE);
+  state = next_state = STATE_RD_PUSH_TELEGRAM;
+#else
   // Send termination command, in case we were already connected and
   // in 9600 baud previously.
   iskra.begin(9600, SWSERIAL_7E1);
   iskra_tx(F(S_SOH "B0" S_ETX "q"));
+  state = next_state = STATE_WR_LOGIN;
+#endif
 
   // Initial values
-  state = next_state = STATE_WR_LOGIN;
   last_statechange = last_publish = millis();
 }
 
@@ -339,13 +582,10 @@ void loop()
     if (iskra.available()) {
       while (iskra.available() && buffer_pos < buffer_size) {
         char ch = iskra.read();
-        if (0) {
-#if defined(ARDUINO_ARCH_AVR)
+        if (Meter::SKIPS_DEL && buffer_pos == 0 && ch == 0x7f) {
           /* On the Arduino Uno, we tend to three of these after sending
            * STATE_WR_LOGIN (at 300 baud), before reception. */
-        } else if (buffer_pos == 0 && ch == 0x7f) {
           Serial << F("<< (skipping 0x7f)" S_ENDL); // only observed on Arduino
-#endif
         } else if (ch == '\0') {
           Serial << F("<< (unexpected NUL, ignoring)" S_ENDL);
         } else {
@@ -394,16 +634,14 @@ void loop()
   case STATE_RD_DATA_READOUT_SLOW:
   case STATE_RD_PROG_MODE_ACK:      /* \SOH P0\STX ()\ETX $BCC */
   case STATE_RD_RESP_OBIS:          /* \STX (0032835.698*kWh)\ETX $BCC */
+  case STATE_RD_RESP_PROFILE:       /* \STX P.01(...)...\EOT $BCC */
     if (iskra.available()) {
       while (iskra.available() && buffer_pos < buffer_size) {
         char ch = iskra.read();
-        if (0) {
-#if defined(ARDUINO_ARCH_AVR)
+        if (Meter::SKIPS_DEL && buffer_pos == 0 && ch == 0x7f) {
           /* On the Arduino Uno, we tend to six of these after sending
            * STATE_WR_REQ_OBIS (at 9600 baud), before reception. */
-        } else if (buffer_pos == 0 && ch == 0x7f) {
           Serial << F("<< (skipping 0x7f)" S_ENDL); // only observed on Arduino
-#endif
         } else if (ch == '\0') {
           Serial << F("<< (unexpected NUL, ignoring)" S_ENDL);
         } else {
@@ -417,26 +655,39 @@ void loop()
           buffer_pos = 0;
           break;
         }
-        if (buffer_pos >= 2 && buffer_data[buffer_pos - 2] == C_ETX) {
-          /* If the last non-BCC token is EOT, we should send an ACK
-           * to get the rest. But seeing that message ends with ETX, we
-           * should not ACK. */
+        if (buffer_pos >= 2 && (buffer_data[buffer_pos - 2] == C_ETX ||
+              buffer_data[buffer_pos - 2] == C_EOT)) {
+          /* If the last non-BCC token is EOT, this is a partial block:
+           * we handle it and send an ACK to get the rest. The last block
+           * ends with ETX, which we should not ACK. */
+          bool partial = (buffer_data[buffer_pos - 2] == C_EOT);
+#ifndef SERIAL_FRAMES
           Serial << F("<< ");
           serial_print_cescape(buffer_data);
+#endif
 
           /* We're looking at a BCC now. Validate. */
           int res = din_66219_bcc(buffer_data);
           if (res < 0) {
             Serial << F("bcc fail: ") << res << C_ENDL;
-            /* Hope for a restransmit. Reset buffer. */
+            /* Hope for a restransmit. Reset buffer. For partial blocks,
+             * the meter is waiting for us, so ask for it explicitly. */
+            if (partial) {
+              iskra_tx(F(S_NAK));
+            }
             buffer_pos = 0;
             break;
           }
 
           /* Valid BCC. Call appropriate handlers and switch state. */
           next_state = on_data_block_or_data_set(
-            buffer_data, buffer_pos, state);
+            buffer_data, buffer_pos, state, partial);
           buffer_pos = 0;
+          if (partial && next_state == state) {
+            /* Blocks may keep coming for a while; don't time out. */
+            iskra_tx(F(S_ACK));
+            last_statechange = millis();
+          }
           break;
         }
       }
@@ -476,6 +727,40 @@ void loop()
     }
     break;
 
+  /* Backfill: send "\SOH R5\STX P.01(0YYMMDDhhmm;0YYMMDDhhmm)\ETX " */
+  case STATE_WR_REQ_PROFILE:
+    write_state = state;
+#ifdef LOAD_PROFILE_BACKFILL
+    if (++backfill_tries > 3) {
+      Serial << F("backfill: no response, giving up" S_ENDL);
+      backfill_from = 0;
+      backfill_due = false;
+      next_state = STATE_SLEEP;
+      break;
+    }
+    {
+      char buf[48];
+      char from[11], to[11];
+      WallClock::format_yymmddhhmm(from, backfill_from);
+      WallClock::format_yymmddhhmm(to, wallclock.now(millis()));
+#if !defined(TEST_BUILD)
+      snprintf_P(buf, 47, PSTR(S_SOH "R5" S_STX "P.01(0%s;0%s)" S_ETX),
+          from, to);
+#else
+      snprintf(buf, 47, (S_SOH "R5" S_STX "P.01(0%s;0%s)" S_ETX), from, to);
+#endif
+      char bcc = din_66219_bcc(buf);
+      int pos = strlen(buf);
+      buf[pos] = bcc;
+      buf[pos + 1] = '\0';
+      iskra_tx(buf);
+      profile.reset();
+      profile_batch_len = 0;
+      next_state = STATE_RD_RESP_PROFILE;
+    }
+#endif
+    break;
+
   /* Continuous: maybe publish data to remote */
   case STATE_MAYBE_PUBLISH:
 #ifdef HAVE_MQTT
@@ -483,37 +768,53 @@ void loop()
      * the MQTT connection alive. poll() is safe to call often. */
     mqttClient.poll();
 #endif
-    {
-      int tdelta_s = (millis() - last_publish) / 1000;
-      int power = gauge.get_instantaneous_power();
-
-      /* DEBUG */
-      Serial << F("time to publish? ") << power <<
-          F(" Watt, ") << tdelta_s << F(" seconds");
-      if (gauge.has_significant_change())
-        Serial << F(", has significant change");
-      Serial << C_ENDL;
-
-      /* Only push every 120s or more often when there are significant
-       * changes. */
-      if (tdelta_s >= 120 ||
-            /* power is higher than 400: then we have more detail */
-            (tdelta_s >= 60 && !(-400 < power && power < 400)) ||
-            (tdelta_s >= 25 && gauge.has_significant_change())) {
-        publish();
-        gauge.reset();
-#ifdef OPTIONAL_LIGHT_SENSOR
-        pulse_low = 1023;
-        pulse_high = 0;
+#ifdef POWER_GRID_S
+    publish_grid();
 #endif
-        last_publish = millis();
-      }
-    }
+#ifdef BASELOAD_WINDOW_S
+    publish_baseload();
+#endif
+    /* DEBUG (not with SERIAL_FRAMES: no per-cycle text formatting) */
+#ifndef SERIAL_FRAMES
+    Serial << F("time to publish? ") << gauge.get_instantaneous_power() <<
+        F(" Watt, ") << ((millis() - last_publish) / 1000) << F(" seconds");
+    if (gauge.has_significant_change())
+      Serial << F(", has significant change");
+    Serial << C_ENDL;
+#endif
+
+#ifdef SHADOW_ESTIMATORS
+    shadows.compare(gauge.get_instantaneous_power());
+#endif
+#ifdef STEP_CLUSTERS_S
+    steps.feed(millis(), gauge.get_instantaneous_power());
+    publish_steps();
+#endif
+#ifdef CLOUD_LANE_S
+    /* After the local lane, so the cloud cannot hold it up */
+    maybe_publish(millis());
+    maybe_publish_cloud(millis());
+#else
+    maybe_publish(millis());
+#endif
+#if defined(PUSH_MODE)
+    next_state = STATE_RD_PUSH_TELEGRAM;
+#elif defined(LOAD_PROFILE_BACKFILL)
+    next_state = (backfill_due ? STATE_WR_REQ_PROFILE : STATE_SLEEP);
+#else
     next_state = STATE_SLEEP;
+#endif
     break;
 
   /* Continuous: just sleep a slight bit */
   case STATE_SLEEP:
+#if defined(CLOUD_LANE_S) && defined(HAVE_MQTT) && !defined(PUSH_MODE)
+    /* Connect the cloud lane while we wait for the next read anyway */
+    if (cloud_connect_due) {
+      cloud_connect_due = false;
+      ensure_cloud_mqtt();
+    }
+#endif
 #ifdef OPTIONAL_LIGHT_SENSOR
     /* This is a mashup between simply doing the poll-for-new-totals
      * every second, and only-a-poll-after-pulse:
@@ -525,35 +826,63 @@ void loop()
      * (But, while it is available, it might increase the accuracy of
      * the averages. Needs confirmation!) */
     {
+      unsigned long now = millis();
       /* Pulse or not, after one second it's time. */
-      bool have_waited_a_second = (millis() - last_statechange) >= 1200;
+      bool have_waited_a_second = (now - last_statechange) >= 1200;
       short val = analogRead(A0);
       /* Debug information, sent over MQTT. */
       pulse_low = min(pulse_low, val);
       pulse_high = max(pulse_high, val);
-      if (val >= PULSE_THRESHOLD || have_waited_a_second) {
-        if (!have_waited_a_second) {
-          /* Sleep cut short, for better average calculations. */
-          Serial << F("pulse: Got value ") << val << C_ENDL;
-          /* Add delay. It appears that after a Wh pulse, the meter takes at
-           * most 1000ms to update the Wh counter. Without this delay, we'd
-           * usually get the Wh count of the previous second, except
-           * sometimes. That effect caused seemingly random high and then
-           * low spikes in the Watt averages. */
-          delay(1000);
-        }
-        next_obis = OBIS_1_8_0;
+      if (val >= PULSE_THRESHOLD && !register_lag.is_pending()) {
+        /* Sleep cut short, for better average calculations. */
+#ifndef SERIAL_FRAMES
+        Serial << F("pulse: Got value ") << val << F(", reading in ") <<
+          register_lag.get_lag_ms() << F(" ms") << C_ENDL;
+#endif
+        register_lag.on_pulse(now);
+      }
+      /* It appears that after a Wh pulse, the meter takes up to a second
+       * to update the Wh counter. Reading it too early caused seemingly
+       * random high and then low spikes in the Watt averages. Instead of
+       * a fixed delay(1000), the register_lag learns how long to wait. */
+      if (register_lag.is_pending()
+          ? (long)(now - register_lag.get_read_at()) >= 0
+          : have_waited_a_second) {
+        /* Re-read the meter clock once in a while */
+        next_obis = (Meter::HAS_CLOCK && wallclock.needs_sync(millis())
+          ? OBIS_0_9_1 : OBIS_1_8_0);
         next_state = STATE_WR_REQ_OBIS;
       }
     }
 #else //!OPTIONAL_LIGHT_SENSOR
     /* Wait 1.2s and then schedule a new request. */
     if ((millis() - last_statechange) >= 1200) {
-      next_obis = OBIS_1_8_0;
+      /* Re-read the meter clock once in a while */
+      next_obis = (Meter::HAS_CLOCK && wallclock.needs_sync(millis())
+        ? OBIS_0_9_1 : OBIS_1_8_0);
       next_state = STATE_WR_REQ_OBIS;
     }
 #endif //!OPTIONAL_LIGHT_SENSOR
     break;
+
+  /* Push mode: the meter sends a telegram every second or so */
+  case STATE_RD_PUSH_TELEGRAM:
+#ifdef PUSH_MODE
+    /* Drain everything that is available. At 115200 baud we get more than
+     * 11 octets per millisecond, so no per-character tracing here: the
+     * parser does constant work per octet and keeps only a line. */
+    while (iskra.available()) {
+      TelegramParser::Result res = telegram.feed(iskra.read());
+      if (res == TelegramParser::DONE) {
+        on_push_telegram();
+        next_state = STATE_MAYBE_PUBLISH;
+        break;
+      } else if (res == TelegramParser::BAD) {
+        Serial << F("<< (telegram checksum fail, dropped)" S_ENDL);
+      }
+    }
+#endif //PUSH_MODE
+    break;
   }
 
   /* Always check for state change timeout */
@@ -567,12 +896,20 @@ void loop()
      * before a new connection can be established. So we may end up here
      * a few times before reconnecting for real. */
     Serial << F("timeout: State change took to long, resetting..." S_ENDL);
+#ifdef PUSH_MODE
+    /* There is no login: just keep listening. */
+    telegram.reset();
+    last_statechange = millis();
+#else
     next_state = STATE_WR_LOGIN;
+#endif
   }
 
   /* Handle state change */
   if (state != next_state) {
+#ifndef SERIAL_FRAMES
     Serial << F("state: ") << state << F(" -> ") << next_state << C_ENDL;
+#endif
     state = next_state;
     buffer_pos = 0;
     last_statechange = millis();
@@ -592,7 +929,7 @@ State on_hello(const char *data, size_t end, State st)
   strncpy(identification, data, sizeof(identification) - 1);
 
   /* Check if we can upgrade the speed */
-  if (end >= 3 && data[3] == '5') {
+  if (Meter::BAUD_CHAR && end >= 3 && data[3] == Meter::BAUD_CHAR) {
     // Send ACK, and change speed.
     if (st == STATE_RD_IDENTIFICATION) {
       return STATE_WR_REQ_DATA_MODE;
@@ -600,27 +937,41 @@ State on_hello(const char *data, size_t end, State st)
       return STATE_WR_PROG_MODE;
     }
   }
-  /* If it was not a '5', we cannot upgrade to 9600 baud, and we cannot
-   * enter programming mode to get values ourselves. */
+  /* If it was not a '5' (or the profile forbids it), we cannot upgrade to
+   * 9600 baud, and we cannot enter programming mode to get values
+   * ourselves. */
   return STATE_RD_DATA_READOUT_SLOW;
 }
 
-State on_data_block_or_data_set(char *data, size_t pos, State st)
+State on_data_block_or_data_set(
+    char *data, size_t pos, State st, bool partial)
 {
-  data[pos - 2] = '\0'; /* drop ETX */
+  data[pos - 2] = '\0'; /* drop ETX (or EOT) */
 
   switch (st) {
   case STATE_RD_DATA_READOUT:
-    on_data_readout(data + 1, pos - 3);
-    return STATE_WR_RESTART;
+    /* Our data readout parser works on whole lines; the blocks of a
+     * multi-block readout end at line boundaries. */
+    on_data_readout(data + 1, pos - 3, partial);
+    return (partial ? st : STATE_WR_RESTART);
 
   case STATE_RD_PROG_MODE_ACK:
     if (pos >= 6 && memcmp_P(data, F(S_SOH "P0" S_STX "()"), 6) == 0) {
-      next_obis = OBIS_1_8_0;
+      /* Start with the meter clock: 0.9.1, 0.9.2, 1.8.0, 2.8.0 */
+      next_obis = (Meter::HAS_CLOCK ? OBIS_0_9_1 : OBIS_1_8_0);
       return STATE_WR_REQ_OBIS;
     }
     return STATE_WR_PROG_MODE;
 
+#ifdef LOAD_PROFILE_BACKFILL
+  case STATE_RD_RESP_PROFILE:
+    on_profile_block(data + 1, partial);
+    if (partial && backfill_due) {
+      return st;
+    }
+    return STATE_SLEEP;
+#endif
+
   case STATE_RD_RESP_OBIS:
     on_response(data + 1, pos - 3, next_obis);
     next_obis = (Obis)((int)next_obis + 1);
@@ -637,7 +988,19 @@ State on_data_block_or_data_set(char *data, size_t pos, State st)
   return st;
 }
 
-void on_data_readout(const char *data, size_t /*end*/)
+/**
+ * Publish the registers of a data readout (or of a block of a multi-block
+ * one) that changed since the previous readout, or all of them for a
+ * keyframe. Every code(value) line with a number is a register; values
+ * in kWh are published in Wh. The meter clock (0.9.1, 0.9.2) is left
+ * out: it changes every time and does not fit a number.
+ *
+ * Map:
+ * - id = the identification (keyframes only)
+ * - readout = "key" for a keyframe, "delta" for changes only
+ * - reg_<code> = the value of register <code> (e.g. reg_1.8.0)
+ */
+void on_data_readout(const char *data, size_t /*end*/, bool partial)
 {
   struct obis_values_t vals;
   unsigned long t = millis();
@@ -655,57 +1018,333 @@ void on_data_readout(const char *data, size_t /*end*/)
    * > !                      // end-of-data
    * (With "\r\n" everywhere.) */
   parse_data_readout(&vals, data);
-  /* Ooh. The first samples are in! */
-  gauge.set_positive_active_energy_total(t, vals.values[OBIS_1_8_0]);
-  gauge.set_negative_active_energy_total(t, vals.values[OBIS_2_8_0]);
+  /* Ooh. The first samples are in! (With multi-block readouts, they may
+   * be in a later block.) */
+  if (vals.present & (1 << OBIS_1_8_0)) {
+    on_energy_total(OBIS_1_8_0, t, vals.values[OBIS_1_8_0]);
+  }
+  if (vals.present & (1 << OBIS_2_8_0)) {
+    on_energy_total(OBIS_2_8_0, t, vals.values[OBIS_2_8_0]);
+  }
 
   /* Keep this for debugging mostly. Bonus points if we also add current
    * time 0.9.x */
+#ifndef SERIAL_FRAMES
   Serial << F("on_data_readout: [") << identification << F("]: ") <<
     data << C_ENDL;
+#endif
 
+#ifdef HAVE_MQTT
+  const char *src = data, *key, *value;
+  int keylen, valuelen;
+  readout_delta.begin(!partial);
+  while (readout_next_line(&src, &key, &keylen, &value, &valuelen)) {
+    Obis obis = str2Obis(key, keylen);
+    unsigned long wh;
+    if (obis == OBIS_0_9_1 || obis == OBIS_0_9_2) {
+      continue;
+    } else if (meter_parse_energy<Meter>(value - 1, valuelen + 2, &wh)) {
+      readout_delta.add(key, keylen, wh);
+    } else if (valuelen > 0 && (int)strspn(value, "0123456789") == valuelen) {
+      readout_delta.add(key, keylen, strtoul(value, NULL, 10));
+    }
+  }
+  unsigned mask = readout_delta.get_changed();
+  if (!mask) {
+    return;
+  }
+
+  /* Not connected: the changes stay unpublished, for the next readout */
   ensure_wifi();
   ensure_mqtt();
-#ifdef HAVE_MQTT
-  // Use simple application/x-www-form-urlencoded format, except for
-  // the DATA bit (FIXME).
-  // FIXME: NOTE: This is limited to 256 chars in MqttClient.cpp
-  // (TX_PAYLOAD_BUFFER_SIZE).
+  if (!mqttClient.connected()) {
+    return;
+  }
+  // Use simple application/x-www-form-urlencoded format. A keyframe of
+  // the nine ME-162 registers is about 200 chars, within the 256 chars
+  // (TX_PAYLOAD_BUFFER_SIZE) of MqttClient.cpp.
   // NOTE: We use String(mqtt_topic).c_str()) so you can use either
   // PROGMEM or SRAM strings.
   mqttClient.beginMessage(String(mqtt_topic).c_str());
-  mqttClient.print(F("device_id="));
+  mqttClient.print(F(PF_KEY_DEVICE_ID "="));
   mqttClient.print(guid);
-  // FIXME: move identification to another message; the one where we
-  // also add 0.9.1 and 0.9.2
-  mqttClient.print(F("&id="));
-  mqttClient.print(identification);
-  mqttClient.print(F("&DATA="));
-  // FIXME: replace CRLF in data with ", ". replace "&" with ";"
-  mqttClient.print(data); // FIXME: unformatted data..
-  mqttClient.endMessage();
+  if (readout_delta.is_keyframe()) {
+    mqttClient.print(F("&" PF_KEY_ID "="));
+    mqttClient.print(identification);
+    mqttClient.print(F("&" PF_KEY_READOUT "=key"));
+  } else {
+    mqttClient.print(F("&" PF_KEY_READOUT "=delta"));
+  }
+  for (unsigned char i = 0; i < readout_delta.get_count(); ++i) {
+    if (mask & (1U << i)) {
+      mqttClient.print(F("&" PF_KEY_REG_PREFIX));
+      mqttClient.print(readout_delta.get_code(i));
+      mqttClient.print('=');
+      mqttClient.print(readout_delta.get_value(i));
+    }
+  }
+  if (mqttClient.endMessage()) {
+    readout_delta.commit();
+  }
 #endif //HAVE_MQTT
 }
 
 static void on_response(const char *data, size_t end, Obis obis)
 {
   /* (0032835.698*kWh) */
+#ifndef SERIAL_FRAMES
   Serial << F("on_response[") << Obis2str(obis) << F("]: ") <<
     data << C_ENDL;
+#endif
 
-  if ((obis == OBIS_1_8_0 || obis == OBIS_2_8_0) && (
-        end == 17 && data[0] == '(' && data[8] == '.' &&
-        memcmp_P(data + 12, F("*kWh)"), 5) == 0)) {
+  if ((obis == OBIS_0_9_1 || obis == OBIS_0_9_2) && (
+        end == 10 && data[0] == '(' && data[9] == ')')) {
+    /* (hh:mm:ss) or (YY.MM.DD) */
     unsigned long t = millis();
-    long watthour = atol(data + 1) * 1000 + atol(data + 9);
+    int a = atoi(data + 1), b = atoi(data + 4), c = atoi(data + 7);
+    if (obis == OBIS_0_9_1) {
+      wallclock.set_time_of_day(t, a, b, c);
+    } else {
+      wallclock.set_date(t, a, b, c);
+#ifdef POWER_GRID_S
+      if (wallclock.is_valid()) {
+        unsigned long now = wallclock.now(t);
+        grid.set_alignment(wallclock.millis_at(now - now % POWER_GRID_S));
+      }
+#endif
+#ifdef LOAD_PROFILE_BACKFILL
+      /* After a (re)boot, we don't know what we missed: backfill a
+       * fixed period. */
+      if (!last_publish_wallclock && !backfill_from && wallclock.is_valid()) {
+        backfill_from = wallclock.now(t) - LOAD_PROFILE_BACKFILL;
+      }
+#endif
+    }
+  } else if (obis == OBIS_1_8_0 || obis == OBIS_2_8_0) {
+    unsigned long watthour;
+    if (meter_parse_energy<Meter>(data, end, &watthour)) {
+      unsigned long t = millis();
+#ifdef OPTIONAL_LIGHT_SENSOR
+      /* Back to the time of the pulse, if this shows its increment */
+      t = register_lag.on_read((obis == OBIS_1_8_0 ? 0 : 1), t, watthour);
+#endif
+      on_energy_total(obis, t, watthour);
+    }
+  }
+}
+
+/**
+ * Feed a new 1.8.0 or 2.8.0 total to everything that wants it
+ */
+static void on_energy_total(Obis obis, unsigned long t, unsigned long wh)
+{
+  if (obis == OBIS_1_8_0) {
+    gauge.set_positive_active_energy_total(t, wh);
+  } else if (obis == OBIS_2_8_0) {
+    gauge.set_negative_active_energy_total(t, wh);
+  } else {
+    return;
+  }
+#ifdef POWER_GRID_S
+  grid.set_energy_total((obis == OBIS_1_8_0 ? 0 : 1), t, wh);
+#endif
+#ifdef SHADOW_ESTIMATORS
+  shadows.feed((obis == OBIS_1_8_0 ? 0 : 1), t, wh);
+#endif
+#ifdef BASELOAD_WINDOW_S
+  baseload.set_energy_totals(
+    t, gauge.get_positive_active_energy_total(),
+    gauge.get_negative_active_energy_total(),
+    (wallclock.is_valid() ? (int)(wallclock.now(t) % 86400UL / 3600) : -1));
+#endif
+}
+
+#ifdef PUSH_MODE
+/**
+ * Handle a pushed telegram that passed the BCC/CRC16 check
+ *
+ * DSMR meters also supply the instantaneous power (1.7.0/2.7.0). If they
+ * do, we use those instead of the WattGauge estimate.
+ */
+static void on_push_telegram()
+{
+  unsigned long t = millis();
+
+#ifndef SERIAL_FRAMES
+  Serial << F("on_push_telegram[") << telegram.get_identification() <<
+    F("]: [1.8.0] ") << telegram.get(TelegramParser::REG_1_8_0) <<
+    F(" Wh, [2.8.0] ") << telegram.get(TelegramParser::REG_2_8_0) <<
+    (telegram.is_checked() ? F(" Wh" S_ENDL) : F(" Wh (unchecked)" S_ENDL));
+#endif
+
+  /* DSMR telegrams carry the time as YYMMDDhhmmss[WS] */
+  const char *ts = telegram.get_timestamp();
+  if (strlen(ts) >= 12) {
+    int v[6];
+    for (int i = 0; i < 6; ++i) {
+      v[i] = (ts[i * 2] - '0') * 10 + (ts[i * 2 + 1] - '0');
+    }
+    wallclock.set_time_of_day(t, v[3], v[4], v[5]);
+    wallclock.set_date(t, v[0], v[1], v[2]);
+#ifdef POWER_GRID_S
+    unsigned long now = wallclock.now(t);
+    grid.set_alignment(wallclock.millis_at(now - now % POWER_GRID_S));
+#endif
+  }
 
-    if (obis == OBIS_1_8_0) {
-      gauge.set_positive_active_energy_total(t, watthour);
-    } else if (obis == OBIS_2_8_0) {
-      gauge.set_negative_active_energy_total(t, watthour);
+  if (telegram.has(TelegramParser::REG_1_8_0)) {
+    on_energy_total(OBIS_1_8_0, t, telegram.get(TelegramParser::REG_1_8_0));
+  }
+  if (telegram.has(TelegramParser::REG_2_8_0)) {
+    on_energy_total(OBIS_2_8_0, t, telegram.get(TelegramParser::REG_2_8_0));
+  }
+  if (telegram.has(TelegramParser::REG_1_7_0) &&
+      telegram.has(TelegramParser::REG_2_7_0)) {
+    gauge.set_instantaneous_power(
+      (long)telegram.get(TelegramParser::REG_1_7_0) -
+      (long)telegram.get(TelegramParser::REG_2_7_0));
+  }
+}
+#endif //PUSH_MODE
+
+#ifdef LOAD_PROFILE_BACKFILL
+/**
+ * Handle a (partial) block of the load profile response
+ *
+ * The records are parsed as they come in, and published in batches of
+ * consecutive records. The ACK for the next block is sent after this.
+ */
+static void on_profile_block(const char *data, bool partial)
+{
+  for (const char *p = data; *p != '\0'; ++p) {
+    LoadProfileParser::Result res = profile.feed(*p);
+    if (res == LoadProfileParser::FAILED) {
+      Serial << F("on_profile_block: no load profile, giving up" S_ENDL);
+      backfill_from = 0;
+      backfill_due = false;
+      return;
+    } else if (res == LoadProfileParser::RECORD) {
+      unsigned long t = profile.get_time();
+      if (t < backfill_from) {
+        continue;
+      }
+      /* Flush if full or not consecutive */
+      if (profile_batch_len && (
+            profile_batch_len == PROFILE_BATCH_SIZE ||
+            profile_batch_period != profile.get_period() ||
+            t != profile_batch_t0 + profile_batch_len * profile_batch_period)) {
+        publish_profile_batch();
+      }
+      if (!profile_batch_len) {
+        profile_batch_t0 = t;
+        profile_batch_period = profile.get_period();
+      }
+      for (int i = 0; i < profile.get_channels(); ++i) {
+        profile_batch[profile_batch_len][i] = profile.get_value(i);
+      }
+      ++profile_batch_len;
+    }
+  }
+  if (!partial) {
+    if (profile_batch_len) {
+      publish_profile_batch();
+    }
+    Serial << F("on_profile_block: backfill complete" S_ENDL);
+    backfill_from = 0;
+    backfill_due = false;
+    backfill_tries = 0;
+  }
+}
+
+/**
+ * Keep track of publish failures, so we know which gap to backfill
+ */
+static void on_publish_result(bool ok)
+{
+  unsigned long now = wallclock.now(millis());
+  if (!now) {
+    return;
+  }
+  if (!ok) {
+    if (!backfill_from) {
+      backfill_from = (last_publish_wallclock ? last_publish_wallclock : now);
+      backfill_tries = 0;
+    }
+  } else {
+    last_publish_wallclock = now;
+    if (backfill_from) {
+      backfill_due = true;
     }
   }
 }
+#endif //LOAD_PROFILE_BACKFILL
+
+/**
+ * Publish (and reset the gauge) if the publish_policy says it is time.
+ *
+ * With PUBLISH_ALIGN_S, and once the wall clock is known, the regular
+ * publishes happen on the first call after every wall clock boundary
+ * instead. Those carry the average power over exactly that window (from
+ * the totals at the first reads after both boundaries), as e_avg_power_w.
+ * The window in which the clock became known is not published.
+ * The e_inst_power_w next to it is the gauge estimate, as always: it may
+ * reach back before the boundary. Significant changes are still
+ * published in between, but those leave the gauge (and the window) alone.
+ */
+static bool maybe_publish(unsigned long now)
+{
+#ifdef PUBLISH_ALIGN_S
+  publish_align_window.add(
+    now, gauge.get_positive_active_energy_total(),
+    gauge.get_negative_active_energy_total(),
+    gauge.get_instantaneous_power());
+  if (wallclock.is_valid()) {
+    unsigned long wall = wallclock.now(now);
+    unsigned long boundary = wall - wall % PUBLISH_ALIGN_S;
+    if (boundary != publish_align_t) {
+      bool whole = publish_align_whole;
+      publish_align_whole = (publish_align_t != 0);
+      publish_align_t = boundary;
+      int align_w = publish_align_window.get_power();
+      publish_align_window.restart();
+      if (whole) {
+        publish(boundary, align_w);
+        gauge.reset();
+# ifdef OPTIONAL_LIGHT_SENSOR
+        pulse_low = 1023;
+        pulse_high = 0;
+# endif
+        last_publish = now;
+        return true;
+      }
+      gauge.reset(); /* start the (next) window */
+    }
+    if (!publish_policy.should_publish_change(
+          (now - last_publish) / 1000, gauge.has_significant_change())) {
+      return false;
+    }
+    publish();
+    gauge.reset_significance();
+    last_publish = now;
+    return true;
+  }
+#endif //PUBLISH_ALIGN_S
+  /* Only push every 120s or more often when there are significant
+   * changes. */
+  if (!publish_policy.should_publish(
+        (now - last_publish) / 1000, gauge.get_instantaneous_power(),
+        gauge.has_significant_change())) {
+    return false;
+  }
+  publish();
+  gauge.reset();
+#ifdef OPTIONAL_LIGHT_SENSOR
+  pulse_low = 1023;
+  pulse_high = 0;
+#endif
+  last_publish = now;
+  return true;
+}
 
 /**
  * Publish the latest data.
@@ -715,43 +1354,407 @@ static void on_response(const char *data, size_t end, Obis obis)
  * - 2.8.0 = e_neg_act_energy_wh = Negative active energy [Wh]
  * - 1.7.0 = e_pos_inst_power_w = Positive active instantaneous power [Watt]
  * - 2.7.0 = e_neg_inst_power_w = Negative active instantaneous power [Watt]
+ * - align_t = end of the aligned window [s since 1970, meter time], only
+ *   for the regular PUBLISH_ALIGN_S publishes
+ * - e_avg_power_w = average net power over that window [Watt], ditto
  */
-void publish()
+void publish(unsigned long align_t, int align_w)
 {
   ensure_wifi();
   ensure_mqtt();
+#ifdef LOAD_PROFILE_BACKFILL
+# ifdef HAVE_MQTT
+  on_publish_result(mqttClient.connected());
+# else
+  on_publish_result(true); /* nothing to lose without a network */
+# endif
+#endif
 
+#ifdef SERIAL_FRAMES
+  /* Binary for the host bridge, instead of the (costly) text */
+  unsigned char frame[SampleFrame::MAX_FRAME];
+  unsigned char *p = SampleFrame::begin(frame, (align_t
+    ? SampleFrame::TYPE_PUBLISH_ALIGNED : SampleFrame::TYPE_PUBLISH));
+  p = SampleFrame::put_u32(p, gauge.get_positive_active_energy_total());
+  p = SampleFrame::put_u32(p, gauge.get_negative_active_energy_total());
+  p = SampleFrame::put_u32(p, (long)gauge.get_instantaneous_power());
+  p = SampleFrame::put_u32(p, millis());
+  if (align_t) {
+    p = SampleFrame::put_u32(p, align_t);
+    p = SampleFrame::put_u32(p, (long)align_w);
+  }
+# ifdef OPTIONAL_LIGHT_SENSOR
+  p = SampleFrame::put_u16(p, pulse_low);
+  p = SampleFrame::put_u16(p, pulse_high);
+  p = SampleFrame::put_u16(p, register_lag.get_lag_ms());
+# endif
+  Serial.write(frame, SampleFrame::finish(frame, p));
+#else
   Serial <<
     F("pushing: [1.8.0] ") << gauge.get_positive_active_energy_total() <<
     F(" Wh, [2.8.0] ") << gauge.get_negative_active_energy_total() <<
     F(" Wh, [16.7.0] ") << gauge.get_instantaneous_power() <<
     F(" Watt" S_ENDL);
+#endif
 
 #ifdef HAVE_MQTT
   // Use simple application/x-www-form-urlencoded format.
   // NOTE: We use String(mqtt_topic).c_str()) so you can use either
   // PROGMEM or SRAM strings.
   mqttClient.beginMessage(String(mqtt_topic).c_str());
-  mqttClient.print(F("device_id="));
+  mqttClient.print(F(PF_KEY_DEVICE_ID "="));
   mqttClient.print(guid);
-  mqttClient.print(F("&e_pos_act_energy_wh="));
+  mqttClient.print(F("&" PF_KEY_E_POS_ACT_ENERGY_WH "="));
   mqttClient.print(gauge.get_positive_active_energy_total());
-  mqttClient.print(F("&e_neg_act_energy_wh="));
+  mqttClient.print(F("&" PF_KEY_E_NEG_ACT_ENERGY_WH "="));
   mqttClient.print(gauge.get_negative_active_energy_total());
-  mqttClient.print(F("&e_inst_power_w="));
+  mqttClient.print(F("&" PF_KEY_E_INST_POWER_W "="));
   mqttClient.print(gauge.get_instantaneous_power());
-  mqttClient.print(F("&dbg_uptime="));
+  mqttClient.print(F("&" PF_KEY_DBG_UPTIME "="));
   mqttClient.print(millis());
+  if (align_t) {
+    mqttClient.print(F("&" PF_KEY_ALIGN_T "="));
+    mqttClient.print(align_t);
+    mqttClient.print(F("&" PF_KEY_E_AVG_POWER_W "="));
+    mqttClient.print(align_w);
+  }
 #ifdef OPTIONAL_LIGHT_SENSOR
-  mqttClient.print(F("&dbg_pulse="));
+  mqttClient.print(F("&" PF_KEY_DBG_PULSE "="));
   mqttClient.print(pulse_low);
   mqttClient.print(F(".."));
   mqttClient.print(pulse_high);
+  mqttClient.print(F("&" PF_KEY_DBG_LAG_MS "="));
+  mqttClient.print(register_lag.get_lag_ms());
 #endif //OPTIONAL_LIGHT_SENSOR
   mqttClient.endMessage();
 #endif //HAVE_MQTT
+#ifdef SHADOW_ESTIMATORS
+  publish_shadows();
+#endif
 }
 
+#ifdef HAVE_MQTT
+/* Print key followed by the comma separated get(i) of all items in obj */
+template<class T, class R> static void mqtt_print_list(
+    const __FlashStringHelper *key, const T &obj, R (T::*get)(int) const)
+{
+  mqttClient.print(key);
+  for (int i = 0; i < obj.get_count(); ++i) {
+    if (i) {
+      mqttClient.print(',');
+    }
+    mqttClient.print((obj.*get)(i));
+  }
+}
+#endif //HAVE_MQTT
+
+#ifdef SHADOW_ESTIMATORS
+/**
+ * Publish the shadow estimators and how they compare to the gauge on the
+ * debug topic (<topic>/debug), and start over with the statistics.
+ *
+ * Map:
+ * - shadow_names = comma separated names of the estimators
+ * - shadow_power_w = their current estimate [Watt]
+ * - shadow_mad_w = mean absolute difference with e_inst_power_w [Watt]
+ * - shadow_bias_w = mean difference with e_inst_power_w [Watt]
+ * - shadow_max_w = largest absolute difference [Watt]
+ * - shadow_skipped = totals they skipped because of the CPU budget
+ * - shadow_max_us = most time spent feeding a total to them [us]
+ */
+void publish_shadows()
+{
+  Serial << F("shadows:");
+  for (int i = 0; i < shadows.get_count(); ++i) {
+    Serial << ' ' << shadows.get_name(i) << F(" ") <<
+      shadows.get_power(i) << F(" Watt (mad ") << shadows.get_mad(i) <<
+      F(")");
+  }
+  Serial << C_ENDL;
+
+#ifdef HAVE_MQTT
+  String topic(mqtt_topic);
+  topic += "/debug";
+  mqttClient.beginMessage(topic.c_str());
+  mqttClient.print(F(PF_KEY_DEVICE_ID "="));
+  mqttClient.print(guid);
+  mqtt_print_list(
+    F("&" PF_KEY_SHADOW_NAMES "="), shadows, &ShadowSet::get_name);
+  mqtt_print_list(
+    F("&" PF_KEY_SHADOW_POWER_W "="), shadows, &ShadowSet::get_power);
+  mqtt_print_list(F("&" PF_KEY_SHADOW_MAD_W "="), shadows, &ShadowSet::get_mad);
+  mqtt_print_list(
+    F("&" PF_KEY_SHADOW_BIAS_W "="), shadows, &ShadowSet::get_bias);
+  mqtt_print_list(F("&" PF_KEY_SHADOW_MAX_W "="), shadows, &ShadowSet::get_max);
+  mqtt_print_list(
+    F("&" PF_KEY_SHADOW_SKIPPED "="), shadows, &ShadowSet::get_skipped);
+  mqttClient.print(F("&" PF_KEY_SHADOW_MAX_US "="));
+  mqttClient.print(shadows.get_max_us());
+  mqttClient.endMessage();
+#endif //HAVE_MQTT
+  shadows.reset_stats();
+}
+#endif //SHADOW_ESTIMATORS
+
+#ifdef CLOUD_LANE_S
+/**
+ * Publish the aggregate of the last CLOUD_WINDOW_S seconds to the cloud
+ * lane, every CLOUD_LANE_S seconds. A cloud that is down (or backing off)
+ * does not lose anything: the current slice of the window grows until a
+ * publish succeeds.
+ *
+ * A connect blocks the IR loop (for up to MQTT_CONNECT_TIMEOUT_MS), so
+ * we only try one while a cloud broker is not backing off, and in the
+ * STATE_SLEEP after this: it overlaps the 1.2s wait for the next read,
+ * which it delays by at most 0.3s. (In PUSH_MODE there is no such wait:
+ * it is done right away, after the telegram.) The window is published in
+ * the cycle after the connect.
+ *
+ * Map:
+ * - e_pos_act_energy_wh, e_neg_act_energy_wh = totals at the window end
+ * - e_avg_power_w = average net power over the window [Watt]
+ * - e_min_power_w, e_max_power_w = lowest/highest e_inst_power_w seen
+ * - window_s = the window length [s]
+ */
+static void maybe_publish_cloud(unsigned long now)
+{
+  cloud_lane.add(
+    now, gauge.get_positive_active_energy_total(),
+    gauge.get_negative_active_energy_total(),
+    gauge.get_instantaneous_power());
+#ifdef HAVE_MQTT
+  /* Keep the connection alive in between */
+  cloudMqttClient.poll();
+#endif
+  if (!cloud_lane.is_due(now)) {
+    return;
+  }
+#ifdef HAVE_MQTT
+# ifdef PUSH_MODE
+  if (cloudMqttClient.connected() || cloud_brokers.pick(now) >= 0) {
+    ensure_cloud_mqtt();
+  }
+# else
+  /* (Re)connects and failbacks are left to the STATE_SLEEP */
+  cloud_connect_due = (cloudMqttClient.connected()
+    ? cloud_brokers.should_failback(now)
+    : cloud_brokers.pick(now) >= 0);
+# endif
+  if (!cloudMqttClient.connected()) {
+    return;
+  }
+#endif
+
+  Serial << F("cloud: ") << cloud_lane.get_power() << F(" Watt over ") <<
+    (cloud_lane.get_duration_ms() / 1000) << F(" seconds") << C_ENDL;
+
+#ifdef HAVE_MQTT
+  cloudMqttClient.beginMessage(String(cloud_mqtt_topic).c_str());
+  cloudMqttClient.print(F(PF_KEY_DEVICE_ID "="));
+  cloudMqttClient.print(guid);
+  cloudMqttClient.print(F("&" PF_KEY_E_POS_ACT_ENERGY_WH "="));
+  cloudMqttClient.print(cloud_lane.get_positive_active_energy_total());
+  cloudMqttClient.print(F("&" PF_KEY_E_NEG_ACT_ENERGY_WH "="));
+  cloudMqttClient.print(cloud_lane.get_negative_active_energy_total());
+  cloudMqttClient.print(F("&" PF_KEY_E_AVG_POWER_W "="));
+  cloudMqttClient.print(cloud_lane.get_power());
+  cloudMqttClient.print(F("&" PF_KEY_E_MIN_POWER_W "="));
+  cloudMqttClient.print(cloud_lane.get_min_power());
+  cloudMqttClient.print(F("&" PF_KEY_E_MAX_POWER_W "="));
+  cloudMqttClient.print(cloud_lane.get_max_power());
+  cloudMqttClient.print(F("&" PF_KEY_WINDOW_S "="));
+  cloudMqttClient.print(cloud_lane.get_duration_ms() / 1000);
+  if (!cloudMqttClient.endMessage()) {
+    return;
+  }
+#endif //HAVE_MQTT
+  cloud_lane.restart();
+}
+#endif //CLOUD_LANE_S
+
+#ifdef POWER_GRID_S
+/**
+ * Collect completed grid slots and publish them once we have a batch.
+ *
+ * Map:
+ * - grid_t0 = start of the first slot [s since 1970, meter time]
+ * - grid_step_s = slot length [s]
+ * - grid_power_w = comma separated average net power per slot [Watt]
+ */
+void publish_grid()
+{
+  int watt;
+  unsigned long start_ms;
+
+  grid.tick(millis());
+  while (grid.pop(&watt, &start_ms)) {
+    /* Round, as the wall clock resolution is a second */
+    unsigned long t = wallclock.now(start_ms + grid.get_slot_ms() / 2);
+    t -= t % POWER_GRID_S;
+    if (grid_batch_len &&
+        t != grid_batch_t0 + grid_batch_len * POWER_GRID_S) {
+      grid_batch_len = 0; /* grid was restarted; drop the incomplete batch */
+    }
+    if (!grid_batch_len) {
+      grid_batch_t0 = t;
+    }
+    grid_batch[grid_batch_len++] = watt;
+    if (grid_batch_len < POWER_GRID_BATCH) {
+      continue;
+    }
+
+    Serial << F("pushing: ") << grid_batch_len << F(" grid slots at ") <<
+      grid_batch_t0 << C_ENDL;
+#ifdef HAVE_MQTT
+    ensure_wifi();
+    ensure_mqtt();
+    mqttClient.beginMessage(String(mqtt_topic).c_str());
+    mqttClient.print(F(PF_KEY_DEVICE_ID "="));
+    mqttClient.print(guid);
+    mqttClient.print(F("&" PF_KEY_GRID_T0 "="));
+    mqttClient.print(grid_batch_t0);
+    mqttClient.print(F("&" PF_KEY_GRID_STEP_S "="));
+    mqttClient.print(POWER_GRID_S);
+    mqttClient.print(F("&" PF_KEY_GRID_POWER_W "="));
+    for (int i = 0; i < grid_batch_len; ++i) {
+      if (i) {
+        mqttClient.print(',');
+      }
+      mqttClient.print(grid_batch[i]);
+    }
+    mqttClient.endMessage();
+#endif //HAVE_MQTT
+    grid_batch_len = 0;
+  }
+}
+#endif //POWER_GRID_S
+
+#ifdef BASELOAD_WINDOW_S
+/**
+ * Publish the baseload once a day, after the night is over.
+ *
+ * Map:
+ * - baseload_w = lowest window average of the last 24 hours [Watt]
+ * - baseload_night_w = lowest window average of last night [Watt]
+ *   (left out if we had no wall clock during the night)
+ */
+void publish_baseload()
+{
+  int current, overnight;
+
+  if (!baseload.take_daily(&current, &overnight)) {
+    return;
+  }
+  Serial << F("pushing: baseload ") << current << F(" Watt, overnight ") <<
+    overnight << F(" Watt" S_ENDL);
+#ifdef HAVE_MQTT
+  ensure_wifi();
+  ensure_mqtt();
+  mqttClient.beginMessage(String(mqtt_topic).c_str());
+  mqttClient.print(F(PF_KEY_DEVICE_ID "="));
+  mqttClient.print(guid);
+  mqttClient.print(F("&" PF_KEY_BASELOAD_W "="));
+  mqttClient.print(current);
+  if (overnight != baseload.UNKNOWN) {
+    mqttClient.print(F("&" PF_KEY_BASELOAD_NIGHT_W "="));
+    mqttClient.print(overnight);
+  }
+  mqttClient.endMessage();
+#endif //HAVE_MQTT
+}
+#endif //BASELOAD_WINDOW_S
+
+#ifdef STEP_CLUSTERS_S
+/**
+ * Publish the load step signatures, once every STEP_CLUSTERS_S. If the
+ * publish fails, the period (and its counts) goes on until one succeeds.
+ *
+ * Map:
+ * - steps_t0 = start of the period [s since 1970, meter time], if known
+ * - steps_period_s = length of the period [s]
+ * - step_w = comma separated step size per signature [Watt]
+ * - step_s = typical duration per signature [s]
+ * - step_n = times it ran (ended) in the period
+ * - step_wh = energy it used in the period [Wh]
+ */
+void publish_steps()
+{
+  unsigned long now = millis();
+  if (!steps.is_due(now)) {
+    return;
+  }
+#ifdef HAVE_MQTT
+  /* Not connected: keep the period, and try again next cycle */
+  ensure_wifi();
+  ensure_mqtt();
+  if (!mqttClient.connected()) {
+    return;
+  }
+#endif
+  Serial << F("pushing: ") << steps.get_count() << F(" step signatures" S_ENDL);
+#ifdef HAVE_MQTT
+  mqttClient.beginMessage(String(mqtt_topic).c_str());
+  mqttClient.print(F(PF_KEY_DEVICE_ID "="));
+  mqttClient.print(guid);
+  if (wallclock.is_valid()) {
+    mqttClient.print(F("&" PF_KEY_STEPS_T0 "="));
+    mqttClient.print(wallclock.now(steps.get_period_start()));
+  }
+  mqttClient.print(F("&" PF_KEY_STEPS_PERIOD_S "="));
+  mqttClient.print((now - steps.get_period_start()) / 1000);
+  mqtt_print_list(F("&" PF_KEY_STEP_W "="), steps, &Steps::get_watt);
+  mqtt_print_list(F("&" PF_KEY_STEP_S "="), steps, &Steps::get_duration_s);
+  mqtt_print_list(F("&" PF_KEY_STEP_N "="), steps, &Steps::get_events);
+  mqtt_print_list(F("&" PF_KEY_STEP_WH "="), steps, &Steps::get_energy_wh);
+  if (!mqttClient.endMessage()) {
+    return;
+  }
+#endif //HAVE_MQTT
+  steps.next_period(now);
+}
+#endif //STEP_CLUSTERS_S
+
+#ifdef LOAD_PROFILE_BACKFILL
+/**
+ * Publish a batch of consecutive historical (load profile) records.
+ *
+ * Map:
+ * - hist_t0 = time of the first record [s since 1970, meter time]
+ * - hist_period_s = time between records [s]
+ * - hist_<code>_<unit> = comma separated values, e.g. hist_1.5_W=512,498
+ */
+void publish_profile_batch()
+{
+  Serial << F("pushing: ") << profile_batch_len << F(" historical records at ")
+    << profile_batch_t0 << C_ENDL;
+
+#ifdef HAVE_MQTT
+  mqttClient.beginMessage(String(mqtt_topic).c_str());
+  mqttClient.print(F(PF_KEY_DEVICE_ID "="));
+  mqttClient.print(guid);
+  mqttClient.print(F("&" PF_KEY_HIST_T0 "="));
+  mqttClient.print(profile_batch_t0);
+  mqttClient.print(F("&" PF_KEY_HIST_PERIOD_S "="));
+  mqttClient.print(profile_batch_period);
+  for (int ch = 0; ch < profile.get_channels(); ++ch) {
+    mqttClient.print(F("&" PF_KEY_HIST_PREFIX));
+    mqttClient.print(profile.get_code(ch));
+    mqttClient.print('_');
+    mqttClient.print(profile.get_unit(ch));
+    mqttClient.print('=');
+    for (int i = 0; i < profile_batch_len; ++i) {
+      if (i) {
+        mqttClient.print(',');
+      }
+      mqttClient.print(profile_batch[i][ch]);
+    }
+  }
+  mqttClient.endMessage();
+#endif //HAVE_MQTT
+  profile_batch_len = 0;
+}
+#endif //LOAD_PROFILE_BACKFILL
+
 template<class T> static inline void serial_print_cescape(const T *p)
 {
   char buf[200]; /* watch out, large local variable! */
@@ -769,19 +1772,22 @@ template<class T> static inline void iskra_tx(const T *p)
    * and the transmission of an answer is: between 200ms (or 20ms) and
    * 1500ms. So adding an appropriate delay(200) before send should be
    * sufficient. */
-  delay(20); /* on my local ME-162, delay(20) is sufficient */
+  delay(Meter::REACTION_MS); /* on my local ME-162, delay(20) is sufficient */
 
   /* Delay before debug print; makes more sense in monitor logs. */
+#ifndef SERIAL_FRAMES
   Serial << F(">> ");
   serial_print_cescape(p);
+#endif
 
   iskra.print(p);
 }
 
 static inline void trace_rx_buffer()
 {
-#if defined(ARDUINO_ARCH_ESP8266)
-  /* On the ESP8266, the SoftwareSerial.available() never returns true
+#if defined(ARDUINO_ARCH_ESP8266) || defined(SERIAL_FRAMES)
+  /* With SERIAL_FRAMES, the port is for the frames: no tracing.
+   * On the ESP8266, the SoftwareSerial.available() never returns true
    * consecutive times: that means that we'd end up doing the trace()
    * for _every_ received character.
    * And when we have (slow) 9600 baud on the debug-Serial, this messes
@@ -803,7 +1809,7 @@ static inline void trace_rx_buffer()
 #endif
 }
 
-#ifdef HAVE_MQTT /* and HAVE_WIFI */
+#ifdef HAVE_WIFI
 /**
  * Check that Wifi is up, or connect when not connected.
  */
@@ -825,24 +1831,62 @@ static void ensure_wifi()
     }
   }
 }
+#endif //HAVE_WIFI
 
+#ifdef HAVE_MQTT
 /**
- * Check that the MQTT connection is up or connect if it isn't.
+ * Check that the MQTT connection of a lane is up or connect if it isn't.
+ *
+ * At most one (time limited) connect attempt is made per call, and none
+ * at all while every broker is backing off after failures.
  */
-static void ensure_mqtt()
+template<class B> static void ensure_mqtt_lane(
+    MqttClient &client, B &selector, const char *const *hosts, int port)
 {
-  mqttClient.poll();
-  if (!mqttClient.connected()) {
-    // NOTE: We use String(mqtt_broker).c_str()) so you can use either
-    // PROGMEM or SRAM strings.
-    if (mqttClient.connect(String(mqtt_broker).c_str(), mqtt_port)) {
-      Serial << F("MQTT connected: ") << mqtt_broker << C_ENDL;
-    } else {
-      Serial << F("MQTT connection to ") << mqtt_broker <<
-        F(" failed! Error code = ") << mqttClient.connectError() << C_ENDL;
+  client.poll();
+  if (client.connected()) {
+    if (!selector.should_failback(millis())) {
+      return;
     }
+    Serial << F("MQTT failing back from ") <<
+      hosts[selector.get_current()] << C_ENDL;
+    client.stop();
+    selector.on_disconnect(millis(), false);
+  } else if (selector.get_current() >= 0) {
+    Serial << F("MQTT connection to ") <<
+      hosts[selector.get_current()] << F(" lost" S_ENDL);
+    selector.on_disconnect(millis(), true);
+  }
+
+  int idx = selector.pick(millis());
+  if (idx < 0) {
+    return;
   }
+  unsigned long t0 = millis();
+  bool ok = client.connect(hosts[idx], port);
+  selector.on_connect(idx, millis(), millis() - t0, ok);
+  if (ok) {
+    Serial << F("MQTT connected: ") << hosts[idx] << F(" in ") <<
+      (millis() - t0) << F(" ms" S_ENDL);
+  } else {
+    Serial << F("MQTT connection to ") << hosts[idx] <<
+      F(" failed! Error code = ") << client.connectError() <<
+      F(", failures = ") << selector.get_failures(idx) << C_ENDL;
+  }
+}
+
+static void ensure_mqtt()
+{
+  ensure_mqtt_lane(mqttClient, brokers, mqtt_brokers, mqtt_port);
 }
+
+# ifdef CLOUD_LANE_S
+static void ensure_cloud_mqtt()
+{
+  ensure_mqtt_lane(
+    cloudMqttClient, cloud_brokers, cloud_mqtt_brokers, cloud_mqtt_port);
+}
+# endif
 #endif //HAVE_MQTT
 
 /**
@@ -915,7 +1959,7 @@ static const char *cescape(
  * Return values:
  *  >=0  Calculated value
  *   -1  No checkable data
- *   -2  No ETX found
+ *   -2  No ETX (or EOT) found
  *   -3  Bad BCC value
  */
 static int din_66219_bcc(const char *s)
@@ -926,7 +1970,7 @@ static int din_66219_bcc(const char *s)
     ++p;
   if (*p == '\0')
     return -1; /* no checkable data */
-  while (*++p != '\0' && *p != C_ETX)
+  while (*++p != '\0' && *p != C_ETX && *p != C_EOT)
     bcc ^= *p;
   if (*p == '\0')
     return -2; /* no end of transmission?? */
@@ -951,42 +1995,59 @@ static inline Obis str2Obis(const char *key, int keylen)
   return OBIS_LAST;
 }
 
+/**
+ * Split the next code(value) line off a data readout buffer: key and
+ * value point into the buffer, without the parentheses. Returns false
+ * at the end; *src is advanced to the next line.
+ */
+static bool readout_next_line(
+    const char **src, const char **key, int *keylen,
+    const char **value, int *valuelen)
+{
+  const char *p = *src;
+  if (p == NULL)
+    return false;
+  *key = p;
+  while (*p != '\0' && *p != '(')
+    ++p;
+  if (*p == '\0')
+    return false;
+  *keylen = (p++ - *key);
+
+  *value = p;
+  while (*p != '\0' && *p != ')')
+    ++p;
+  if (*p == '\0')
+    return false;
+  *valuelen = (p++ - *value);
+
+  while (*p != '\0' && *p++ != '\r')
+    ;
+  *src = (*p == '\n' ? p + 1 : NULL);
+  return true;
+}
+
 /**
  * Parse data readout buffer and populate obis_values_t
  */
 static void parse_data_readout(struct obis_values_t *dst, const char *src)
 {
-  memset(dst, 0, sizeof(*dst));
-  while (*src != '\0') {
-    int len = 0;
-    const char *key = src;
-    while (*src != '\0' && *src != '(')
-      ++src;
-    if (*src == '\0')
-      break;
-    len = (src++ - key);
+  const char *key, *value;
+  int keylen, valuelen;
 
-    int i = str2Obis(key, len);
+  memset(dst, 0, sizeof(*dst));
+  while (readout_next_line(&src, &key, &keylen, &value, &valuelen)) {
+    int i = str2Obis(key, keylen);
     if (i < OBIS_LAST) {
-      const char *value = src;
-      while (*src != '\0' && *src != ')')
-        ++src;
-      if (*src == '\0')
-        break;
-      len = (src++ - value);
-
       long lval = atol(value);
-      /* "0032826.545*kWh" */
-      if (len == 15 && value[7] == '.' &&
-          memcmp_P(value + 11, F("*kWh"), 4) == 0) {
-        lval = lval * 1000 + atol(value + 8);
+      /* "0032826.545*kWh", with the parentheses around it */
+      unsigned long wh;
+      if (meter_parse_energy<Meter>(value - 1, valuelen + 2, &wh)) {
+        lval = wh;
       }
       dst->values[i] = lval;
+      dst->present |= (1 << i);
     }
-    while (*src != '\0' && *src++ != '\r')
-      ;
-    if (*src++ != '\n')
-      break;
   }
 }
 
@@ -1065,6 +2126,8 @@ static void test_din_66219_bcc()
     S_ETX
     "L"), 'L');
   INT_EQ("din_66219_bcc", din_66219_bcc(S_SOH "B0" S_ETX "q"), 'q');
+  /* Partial block, ending in EOT instead of ETX */
+  INT_EQ("din_66219_bcc", din_66219_bcc(S_STX "!" S_EOT "%"), '%');
   printf("\n");
 }
 
@@ -1106,13 +2169,338 @@ static void test_data_readout_to_obis()
   printf("\n");
 }
 
-int main()
+#ifdef HAVE_MQTT
+/**
+ * Every register of the readout is published (kWh in Wh), not only the
+ * ones in the Obis enum, and then only the ones that changed. The meter
+ * clock is left out.
+ */
+static void test_data_readout_publish()
+{
+  static const char readout[] = (
+    "C.1.0(28342193)\r\n"
+    "0.0.0(28342193)\r\n"
+    "0.9.1(12:34:56)\r\n"
+    "1.8.0(0032826.545*kWh)\r\n"
+    "1.8.1(0000000.000*kWh)\r\n"
+    "1.8.2(0032826.545*kWh)\r\n"
+    "2.8.0(0000000.001*kWh)\r\n"
+    "2.8.1(0000000.000*kWh)\r\n"
+    "2.8.2(0000000.001*kWh)\r\n"
+    "F.F(0000000)\r\n!\r\n");
+  static const char readout2[] = (
+    "1.8.0(0032826.546*kWh)\r\n"
+    "1.8.2(0032826.546*kWh)\r\n"
+    "2.8.0(0000000.001*kWh)\r\n");
+  strncpy(guid, "EUI48:11:22:33:44:55:66", sizeof(guid));
+  strncpy(identification, "ISK5ME162-0033", sizeof(identification));
+  readout_delta = ReadoutDelta<READOUT_REGISTERS>(READOUT_KEYFRAME);
+
+  on_data_readout(readout, sizeof(readout) - 1, false);
+  STR_EQ("on_data_readout(key)", mqttClient.get_payload(),
+    "device_id=EUI48:11:22:33:44:55:66&id=ISK5ME162-0033&readout=key&"
+    "reg_C.1.0=28342193&reg_0.0.0=28342193&reg_1.8.0=32826545&"
+    "reg_1.8.1=0&reg_1.8.2=32826545&reg_2.8.0=1&reg_2.8.1=0&"
+    "reg_2.8.2=1&reg_F.F=0");
+  on_data_readout(readout2, sizeof(readout2) - 1, false);
+  STR_EQ("on_data_readout(delta)", mqttClient.get_payload(),
+    "device_id=EUI48:11:22:33:44:55:66&readout=delta&"
+    "reg_1.8.0=32826546&reg_1.8.2=32826546");
+
+  gauge = EnergyGauge();
+  printf("\n");
+}
+#endif
+
+#ifdef PUBLISH_ALIGN_S
+/**
+ * Drive the aligned schedule with a known clock (12:00:10 at t=0): 3600 W
+ * and then 7200 W, read every 2s. The window in which the clock became
+ * known is skipped, the others are published at their boundary, with the
+ * exact window average; the step is published out-of-band.
+ */
+static void test_publish_align()
 {
+  static const unsigned long A = PUBLISH_ALIGN_S;
+  wallclock = WallClock();
+  wallclock.set_time_of_day(0, 12, 0, 10);
+  wallclock.set_date(0, 21, 3, 14);
+  const unsigned long wall0 = wallclock.now(0);
+  gauge = EnergyGauge();
+  publish_policy = PublishPolicy();
+  publish_align_t = 0;
+  publish_align_whole = false;
+  publish_align_window = LaneAggregate(A * 1000UL);
+  last_publish = 0;
+
+  unsigned long wh = 33402264;
+  int aligned = 0, step_changes = 0, bad_t = 0;
+  long long first_t = 0, prev_t = 0, first_w = 0, last_w = 0;
+  for (unsigned long t = 0; t <= 6 * A * 1000UL; t += 2000) {
+    bool step = (t >= 3 * A * 1000UL);
+    on_energy_total(OBIS_1_8_0, t, wh);
+    on_energy_total(OBIS_2_8_0, t, 13465);
+    wh += (step ? 4 : 2); /* 7200 or 3600 W */
+    if (!maybe_publish(t)) {
+      continue;
+    }
+    PayloadMessage msg;
+    const char *payload = mqttClient.get_payload();
+    PayloadDecoder::decode(payload, strlen(payload), &msg);
+    if (!msg.has(PayloadMessage::ALIGN_T)) {
+      step_changes += step;
+      continue;
+    }
+    long long at = msg.get_int(PayloadMessage::ALIGN_T);
+    bad_t += (at % A != 0 || (aligned && at != prev_t + (long long)A));
+    if (!aligned++) {
+      first_t = at;
+      first_w = msg.get_int(PayloadMessage::E_AVG_POWER_W);
+    }
+    prev_t = at;
+    last_w = msg.get_int(PayloadMessage::E_AVG_POWER_W);
+  }
+  INT_EQ("publish_align(skip-first)", first_t - wall0, 2 * A - wall0 % A);
+  INT_EQ("publish_align(count)", aligned, 5);
+  INT_EQ("publish_align(boundaries)", bad_t, 0);
+  INT_EQ("publish_align(avg)", first_w, 3600);
+  INT_EQ("publish_align(avg-step)", last_w, 7200);
+  INT_EQ("publish_align(change)", step_changes > 0, 1);
+  printf("\n");
+}
+#endif
+
+/**
+ * Publish policy benchmark: drive the gauge and maybe_publish() with a
+ * simulated day of meter readings (every 1.83s, like the IR readout), and
+ * count what ends up at the (fake) MQTT client. The power curve, as the
+ * backend sees it, is reconstructed from the decoded payloads in two ways:
+ * by holding every e_inst_power_w over the interval before it, and from
+ * the energy delta between publishes. Both are compared to the simulated
+ * power, second by second (mean absolute error).
+ */
+#include <math.h> /* fabs, sin */
+
+static const unsigned long BENCH_DAY_S = 86400UL;
+static int bench_watt[BENCH_DAY_S];
+static double bench_pos_wh[BENCH_DAY_S + 1]; /* totals at every second */
+static double bench_neg_wh[BENCH_DAY_S + 1];
+
+static void bench_simulate_day()
+{
+  /* Appliances: start, duration [s], Watt */
+  static const struct { unsigned long start, duration; int watt; } events[] = {
+    {7 * 3600UL + 600, 180, 2200},      /* kettle */
+    {8 * 3600UL + 1800, 180, 2200},
+    {10 * 3600UL, 3600, 500},           /* washing machine */
+    {10 * 3600UL + 300, 900, 2000},     /* ... heating */
+    {12 * 3600UL + 900, 120, 1200},     /* microwave */
+    {16 * 3600UL, 180, 2200},
+    {17 * 3600UL, 6 * 3600UL, 60},      /* lights */
+    {19 * 3600UL, 4 * 3600UL, 120},     /* television */
+    {19 * 3600UL + 2700, 180, 2200},
+    {22 * 3600UL, 180, 2200},
+  };
+  bench_pos_wh[0] = 33402264.0;
+  bench_neg_wh[0] = 13465.0;
+  for (unsigned long s = 0; s < BENCH_DAY_S; ++s) {
+    double watt = 150;
+    if (s % 2400 < 900) {
+      watt += 90; /* fridge */
+    }
+    for (unsigned i = 0; i < sizeof(events) / sizeof(events[0]); ++i) {
+      if (s >= events[i].start && s < events[i].start + events[i].duration) {
+        watt += events[i].watt;
+      }
+    }
+    if (s >= 18 * 3600UL && s < 18 * 3600UL + 2700 && (s / 120) % 2 == 0) {
+      watt += 2000; /* oven, thermostat */
+    }
+    double hour = s / 3600.0;
+    if (hour > 7 && hour < 19) {
+      /* solar panels, with some clouds */
+      watt -= 2500 * sin(3.14159265 * (hour - 7) / 12) * (
+        (s / 600) % 3 == 0 ? 0.5 : 1.0);
+    }
+    bench_watt[s] = (int)watt;
+    bench_pos_wh[s + 1] = bench_pos_wh[s] + (watt > 0 ? watt / 3600 : 0);
+    bench_neg_wh[s + 1] = bench_neg_wh[s] + (watt < 0 ? -watt / 3600 : 0);
+  }
+}
+
+static void bench_publish_policies()
+{
+  static const struct { const char *name; PublishPolicy policy; } runs[] = {
+    {"current", PublishPolicy(120, 60, 25, 400)},
+    {"every 30s", PublishPolicy(30, 30, 30, 400)},
+    {"every 60s", PublishPolicy(60, 60, 60, 400)},
+    {"every 120s", PublishPolicy(120, 120, 120, 400)},
+    {"changes, 300s", PublishPolicy(300, 300, 25, 400)},
+    {"eager", PublishPolicy(60, 30, 10, 400)},
+  };
+  const int nruns = sizeof(runs) / sizeof(runs[0]);
+  unsigned long msgs[nruns];
+  unsigned long long bytes[nruns];
+  double mae_inst[nruns], mae_energy[nruns];
+
+  bench_simulate_day();
+  strncpy(guid, "EUI48:11:22:33:44:55:66", sizeof(guid));
+  /* Only the energy messages: /debug (SHADOW_ESTIMATORS) is not the
+   * backend view */
+  mqttClient.set_topic_filter(String(mqtt_topic).c_str());
+  for (int run = 0; run < nruns; ++run) {
+    publish_policy = runs[run].policy;
+    gauge = EnergyGauge();
+    last_publish = 0;
+    mqttClient.reset_counters();
+
+    unsigned long prev_s = 0;
+    long long prev_net = (long long)bench_pos_wh[0] - (long long)bench_neg_wh[0];
+    double err_inst = 0, err_energy = 0;
+    for (unsigned long t = 0; t + 300 < BENCH_DAY_S * 1000; t += 1830) {
+      unsigned long s = t / 1000;
+      double frac = (t % 1000) / 1000.0;
+      on_energy_total(OBIS_1_8_0, t, (unsigned long)(
+        bench_pos_wh[s] + frac * (bench_pos_wh[s + 1] - bench_pos_wh[s])));
+      on_energy_total(OBIS_2_8_0, t + 300, (unsigned long)(
+        bench_neg_wh[s] + frac * (bench_neg_wh[s + 1] - bench_neg_wh[s])));
+      if (!maybe_publish(t + 300)) {
+        continue;
+      }
+
+      /* The backend view */
+      PayloadMessage msg;
+      const char *payload = mqttClient.get_payload();
+      if (!PayloadDecoder::decode(payload, strlen(payload), &msg)) {
+        printf("FAIL (bench): undecodable %s\n", payload);
+        mqttClient.set_topic_filter(NULL);
+        return;
+      }
+      long long watt = msg.get_int(PayloadMessage::E_INST_POWER_W);
+      long long net = (msg.get_int(PayloadMessage::E_POS_ACT_ENERGY_WH) -
+                       msg.get_int(PayloadMessage::E_NEG_ACT_ENERGY_WH));
+      unsigned long now_s = (t + 300) / 1000;
+      double energy_watt = (net - prev_net) * 3600.0 / (now_s - prev_s);
+      for (unsigned long i = prev_s; i < now_s; ++i) {
+        err_inst += fabs(bench_watt[i] - (double)watt);
+        err_energy += fabs(bench_watt[i] - energy_watt);
+      }
+      prev_s = now_s;
+      prev_net = net;
+    }
+    msgs[run] = mqttClient.messages;
+    bytes[run] = mqttClient.wire_bytes;
+    mae_inst[run] = err_inst / prev_s;
+    mae_energy[run] = err_energy / prev_s;
+  }
+  mqttClient.set_topic_filter(NULL);
+
+  printf("bench: publish policies, one simulated day\n");
+  printf("%-14s %16s %9s %10s %12s %12s\n", "policy", "max,high,change",
+    "msgs/day", "bytes/day", "err_inst_w", "err_energy_w");
+  for (int run = 0; run < nruns; ++run) {
+    char params[24];
+    snprintf(params, sizeof(params), "%u,%u,%u",
+      runs[run].policy.max_interval_s, runs[run].policy.high_power_interval_s,
+      runs[run].policy.change_interval_s);
+    printf("%-14s %16s %9lu %10llu %12.1f %12.1f\n", runs[run].name, params,
+      msgs[run], bytes[run], mae_inst[run], mae_energy[run]);
+  }
+}
+
+/**
+ * Meter profile benchmark: the cost of parsing an energy value with the
+ * layout of each profile, against the atol() parsing it replaced.
+ */
+#include <time.h> /* clock */
+
+template<class P> static double bench_parse_ns(const char *const *values)
+{
+  static const long N = 2000000;
+  volatile unsigned long sink = 0;
+  clock_t t0 = clock();
+  for (long i = 0; i < N; ++i) {
+    unsigned long wh;
+    if (meter_parse_energy<P>(values[i & 3], 17, &wh)) {
+      sink += wh;
+    }
+  }
+  return (clock() - t0) * 1e9 / CLOCKS_PER_SEC / N;
+}
+
+static void bench_meter_profiles()
+{
+  static const char *const values[4] = {
+    "(0032835.698*kWh)", "(0000013.465*kWh)",
+    "(0032835.699*kWh)", "(0000013.466*kWh)"};
+  static const long N = 2000000;
+  volatile unsigned long sink = 0;
+  clock_t t0 = clock();
+  for (long i = 0; i < N; ++i) {
+    const char *data = values[i & 3];
+    if (data[0] == '(' && data[8] == '.' &&
+        memcmp(data + 12, "*kWh)", 5) == 0) {
+      sink += atol(data + 1) * 1000 + atol(data + 9);
+    }
+  }
+  double atol_ns = (clock() - t0) * 1e9 / CLOCKS_PER_SEC / N;
+
+  printf("\nbench: meter profiles, energy value parsing\n");
+  printf("%-24s %8s\n", "profile", "ns/value");
+  printf("%-24s %8.1f\n", "(atol)", atol_ns);
+  printf("%-24s %8.1f\n", "MeterProfileIskraME162",
+    bench_parse_ns<MeterProfileIskraME162>(values));
+  printf("%-24s %8.1f\n", "MeterProfileGeneric",
+    bench_parse_ns<MeterProfileGeneric>(values));
+}
+
+int main(int argc, char **argv)
+{
+#ifdef SIZE_REPORT
+  /* make size-report: only the firmware itself, so that the linker
+   * (--gc-sections) drops the tests and benchmarks */
+  (void)argc;
+  (void)argv;
+  setup();
+  for (;;) {
+    loop();
+  }
+#endif
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    bench_publish_policies();
+    bench_meter_profiles();
+    return 0;
+  }
+
   test_cescape();
   test_din_66219_bcc();
   test_obis();
   test_data_readout_to_obis();
+#ifdef HAVE_MQTT
+  test_data_readout_publish();
+#endif
+#ifdef PUBLISH_ALIGN_S
+  test_publish_align();
+#endif
   test_wattgauge();
+  test_telegramparser();
+  test_wallclock();
+  test_loadprofile();
+  test_powergrid();
+  test_baseload();
+  test_brokerlist();
+  test_payloaddecoder();
+  test_publishpolicy();
+  test_sampleframe();
+  test_meterprofile();
+  test_registerlag();
+  test_shadowestimators();
+  test_readoutdelta();
+  test_exportlane();
+  test_stepclusters();
+#ifdef __linux__
+  test_samplestore();
+#endif
 
   on_hello("ISK5ME162-0033", 14, STATE_RD_IDENTIFICATION);
 //  on_response("(0032826.545*kWh)", 17, OBIS_1_8_0);
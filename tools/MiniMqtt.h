@@ -0,0 +1,186 @@
+#ifndef INCLUDED_MINIMQTT_H
+#define INCLUDED_MINIMQTT_H
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+/**
+ * MiniMqtt is just enough of an MQTT 3.1.1 client for the host tools:
+ * CONNECT (clean session, no auth), PUBLISH with QoS 0, PINGREQ and
+ * DISCONNECT, over a plain blocking TCP socket. Incoming packets (other
+ * than the CONNACK) are read and discarded.
+ *
+ * Usage:
+ *
+ *   MiniMqtt mqtt;
+ *   if (mqtt.connect("localhost", 1883, "client-id", 60)) {
+ *       mqtt.publish("some/topic", payload, len);
+ *       mqtt.poll(now_s);  // keepalive
+ *   }
+ */
+class MiniMqtt
+{
+private:
+    int _fd;
+    unsigned short _keepalive_s;
+    unsigned long _last_tx_s;
+
+    static void _put_u16(std::string &buf, unsigned short v) {
+        buf += (char)(v >> 8);
+        buf += (char)(v & 0xff);
+    }
+
+    static void _put_str(std::string &buf, const char *s, size_t len) {
+        _put_u16(buf, len);
+        buf.append(s, len);
+    }
+
+    /* Fixed header: type/flags and the variable length remaining length */
+    static void _put_header(std::string &buf, unsigned char type,
+                            size_t remaining) {
+        buf += (char)type;
+        do {
+            unsigned char byte = remaining % 128;
+            remaining /= 128;
+            buf += (char)(remaining ? byte | 0x80 : byte);
+        } while (remaining);
+    }
+
+    bool _send(const std::string &buf) {
+        const char *p = buf.data();
+        size_t left = buf.size();
+        while (left) {
+            ssize_t n = send(_fd, p, left, MSG_NOSIGNAL);
+            if (n <= 0) {
+                close();
+                return false;
+            }
+            p += n;
+            left -= n;
+        }
+        bytes_sent += buf.size();
+        return true;
+    }
+
+public:
+    unsigned long long bytes_sent;  /* on the wire, headers included */
+
+    MiniMqtt() : _fd(-1), _keepalive_s(0), _last_tx_s(0), bytes_sent(0) {}
+    ~MiniMqtt() { close(); }
+
+    inline bool connected() const { return _fd >= 0; }
+
+    bool connect(const char *host, int port, const char *client_id,
+                 unsigned short keepalive_s) {
+        close();
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        char portstr[8];
+        snprintf(portstr, sizeof(portstr), "%d", port);
+        if (getaddrinfo(host, portstr, &hints, &res) != 0) {
+            return false;
+        }
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+            _fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (_fd < 0) {
+                continue;
+            }
+            if (::connect(_fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+            ::close(_fd);
+            _fd = -1;
+        }
+        freeaddrinfo(res);
+        if (_fd < 0) {
+            return false;
+        }
+        int one = 1;
+        setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::string body;
+        _put_str(body, "MQTT", 4);
+        body += (char)4;        /* protocol level 3.1.1 */
+        body += (char)0x02;     /* clean session */
+        _put_u16(body, keepalive_s);
+        _put_str(body, client_id, strlen(client_id));
+        std::string pkt;
+        _put_header(pkt, 0x10, body.size());
+        pkt += body;
+        if (!_send(pkt)) {
+            return false;
+        }
+
+        unsigned char connack[4];
+        size_t got = 0;
+        while (got < sizeof(connack)) {
+            ssize_t n = recv(_fd, connack + got, sizeof(connack) - got, 0);
+            if (n <= 0) {
+                close();
+                return false;
+            }
+            got += n;
+        }
+        if (connack[0] != 0x20 || connack[3] != 0) {
+            close();
+            return false;
+        }
+        _keepalive_s = keepalive_s;
+        return true;
+    }
+
+    bool publish(const char *topic, const char *payload, size_t len) {
+        if (_fd < 0) {
+            return false;
+        }
+        std::string pkt;
+        size_t topiclen = strlen(topic);
+        _put_header(pkt, 0x30, 2 + topiclen + len);
+        _put_str(pkt, topic, topiclen);
+        pkt.append(payload, len);
+        return _send(pkt);
+    }
+
+    /* Call regularly: sends a PINGREQ when needed, drops incoming data */
+    void poll(unsigned long now_s) {
+        if (_fd < 0) {
+            return;
+        }
+        char buf[256];
+        while (recv(_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+            ;
+        if (_keepalive_s && now_s - _last_tx_s >= _keepalive_s / 2u) {
+            std::string pkt;
+            _put_header(pkt, 0xC0, 0);
+            _send(pkt);
+            _last_tx_s = now_s;
+        }
+    }
+
+    void disconnect() {
+        if (_fd >= 0) {
+            std::string pkt;
+            _put_header(pkt, 0xE0, 0);
+            _send(pkt);
+        }
+        close();
+    }
+
+    void close() {
+        if (_fd >= 0) {
+            ::close(_fd);
+            _fd = -1;
+        }
+    }
+};
+
+// vim: set ts=8 sw=4 sts=4 et ai:
+#endif //INCLUDED_MINIMQTT_H
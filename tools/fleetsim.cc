@@ -0,0 +1,295 @@
+/**
+ * fleetsim: simulate a fleet of devices publishing to an MQTT broker
+ *
+ * Every simulated device has its own EnergyGauge, fed with the 1.8.0 and
+ * 2.8.0 totals of a synthetic household (baseload, a fridge, appliances
+ * switching on at random and, for some, solar panels) at the pace of the
+ * real IR readout. The PublishPolicy of STATE_MAYBE_PUBLISH decides when
+ * to publish; the payload has the same keys as publish().
+ *
+ * Without -b, nothing is sent (dry run) and the wire size is computed.
+ *
+ * Usage:
+ *
+ *   fleetsim [-n DEVICES] [-d HOURS] [-s START_HOUR] [-x SPEED]
+ *            [-b BROKER[:PORT]] [-t TOPIC] [-p MAX,HIGH,CHANGE,HIGH_W]
+ *
+ * -x  time acceleration: 1 is real time, 60 is a minute per second,
+ *     0 (default) is as fast as possible
+ * -p  publish policy (default 120,60,25,400; see PublishPolicy.h)
+ */
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../WattGauge.h"
+#include "../PayloadFields.h"
+#include "../PublishPolicy.h"
+#include "MiniMqtt.h"
+
+static const unsigned long READ_INTERVAL_MS = 1830; /* as in example.log */
+static const unsigned long TICK_MS = 100;
+static const int HIST_BUCKET_S = 10;
+static const int HIST_BUCKETS = 16;
+
+/* A synthetic household; power() gives the net power in Watt */
+class Household
+{
+    struct Appliance { double watt; double minutes; double per_hour; };
+    static const Appliance APPLIANCES[4];
+
+    double _base_w;
+    double _fridge_phase_s;
+    double _solar_peak_w;
+    double _busy_until_s[4];
+    std::mt19937 &_rng;
+
+public:
+    Household(std::mt19937 &rng) : _rng(rng) {
+        std::uniform_real_distribution<double> u(0.0, 1.0);
+        _base_w = 60 + 190 * u(_rng);
+        _fridge_phase_s = 2400 * u(_rng);
+        _solar_peak_w = (u(_rng) < 0.3 ? 2000 + 2000 * u(_rng) : 0);
+        for (int i = 0; i < 4; ++i) {
+            _busy_until_s[i] = 0;
+        }
+    }
+
+    /* Net power at time t (s since midnight), switching appliances on at
+     * random (dt_s is the time since the previous call) */
+    double power(double t_s, double dt_s) {
+        std::uniform_real_distribution<double> u(0.0, 1.0);
+        double hour = fmod(t_s / 3600.0, 24.0);
+        double watt = _base_w;
+        if (fmod(t_s + _fridge_phase_s, 2400.0) < 900.0) {
+            watt += 90;
+        }
+        /* Appliances are mostly used from 07:00 to 23:00 */
+        double activity = (hour >= 7 && hour < 23 ? 1.0 : 0.1);
+        for (int i = 0; i < 4; ++i) {
+            const Appliance &a = APPLIANCES[i];
+            if (t_s < _busy_until_s[i]) {
+                watt += a.watt;
+            } else if (u(_rng) < a.per_hour * activity * dt_s / 3600.0) {
+                _busy_until_s[i] = t_s + a.minutes * 60;
+            }
+        }
+        if (_solar_peak_w && hour > 7 && hour < 19) {
+            watt -= _solar_peak_w * sin(M_PI * (hour - 7) / 12);
+        }
+        return watt;
+    }
+};
+
+const Household::Appliance Household::APPLIANCES[4] = {
+    {2200, 3, 0.5},     /* kettle */
+    {2000, 30, 0.1},    /* oven */
+    {500, 60, 0.06},    /* washing machine */
+    {1200, 2, 0.8},     /* microwave, coffee, ... */
+};
+
+struct Device {
+    Household *house;
+    EnergyGauge gauge;
+    double pos_wh;
+    double neg_wh;
+    unsigned long boot_ms;          /* sim time at boot */
+    unsigned long next_read_ms;
+    unsigned long last_power_ms;
+    unsigned long last_publish_ms;
+    char guid[24];
+    MiniMqtt mqtt;
+};
+
+struct Report {
+    unsigned long long messages;
+    unsigned long long bytes;
+    unsigned long long hist[HIST_BUCKETS];
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: fleetsim [-n DEVICES] [-d HOURS] [-s START_HOUR] [-x SPEED] "
+        "[-b BROKER[:PORT]] [-t TOPIC] [-p MAX,HIGH,CHANGE,HIGH_W]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int ndevices = 100;
+    double hours = 24;
+    double start_hour = 0;
+    double speed = 0;
+    const char *broker = NULL;
+    int port = 1883;
+    const char *topic = "pe32/fleetsim";
+    PublishPolicy policy;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:s:x:b:t:p:")) != -1) {
+        switch (opt) {
+        case 'n': ndevices = atoi(optarg); break;
+        case 'd': hours = atof(optarg); break;
+        case 's': start_hour = atof(optarg); break;
+        case 'x': speed = atof(optarg); break;
+        case 'b': broker = optarg; break;
+        case 't': topic = optarg; break;
+        case 'p': {
+            unsigned a, b, c;
+            int w;
+            if (sscanf(optarg, "%u,%u,%u,%d", &a, &b, &c, &w) != 4) {
+                usage();
+            }
+            policy = PublishPolicy(a, b, c, w);
+            break;
+        }
+        default: usage();
+        }
+    }
+    if (ndevices <= 0 || hours <= 0) {
+        usage();
+    }
+    std::string host;
+    if (broker) {
+        const char *colon = strrchr(broker, ':');
+        host.assign(broker, colon ? colon - broker : strlen(broker));
+        if (colon) {
+            port = atoi(colon + 1);
+        }
+    }
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<unsigned long> jitter(0, READ_INTERVAL_MS);
+    std::vector<Household> houses;
+    houses.reserve(ndevices);
+    std::vector<Device> devices(ndevices);
+    for (int i = 0; i < ndevices; ++i) {
+        houses.push_back(Household(rng));
+        Device &dev = devices[i];
+        dev.house = &houses[i];
+        dev.pos_wh = 1000000.0 * (1 + i % 50);
+        dev.neg_wh = 10000.0 * (i % 7);
+        dev.boot_ms = jitter(rng);  /* spread the devices */
+        dev.next_read_ms = dev.boot_ms;
+        dev.last_power_ms = 0;
+        dev.last_publish_ms = dev.boot_ms;
+        snprintf(dev.guid, sizeof(dev.guid), "EUI48:02:00:00:%02X:%02X:%02X",
+            (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+        if (broker && !dev.mqtt.connect(host.c_str(), port, dev.guid, 60)) {
+            fprintf(stderr, "fleetsim: device %d: cannot connect to %s:%d\n",
+                i, host.c_str(), port);
+            return 1;
+        }
+    }
+
+    typedef std::chrono::steady_clock clock;
+    clock::time_point wall0 = clock::now();
+    Report rep;
+    memset(&rep, 0, sizeof(rep));
+    const unsigned long end_ms = (unsigned long)(hours * 3600000.0);
+    const double start_s = start_hour * 3600.0;
+    char payload[256];
+
+    for (unsigned long t = 0; t < end_ms; t += TICK_MS) {
+        for (int i = 0; i < ndevices; ++i) {
+            Device &dev = devices[i];
+            if (t < dev.next_read_ms) {
+                continue;
+            }
+            /* Integrate the household power since the previous read */
+            double dt_s = (t - dev.last_power_ms) / 1000.0;
+            double watt = dev.house->power(start_s + t / 1000.0, dt_s);
+            dev.last_power_ms = t;
+            if (watt > 0) {
+                dev.pos_wh += watt * dt_s / 3600.0;
+            } else {
+                dev.neg_wh -= watt * dt_s / 3600.0;
+            }
+            unsigned long millis = t - dev.boot_ms;
+            dev.gauge.set_positive_active_energy_total(
+                millis, (unsigned long)dev.pos_wh);
+            dev.gauge.set_negative_active_energy_total(
+                millis + 300, (unsigned long)dev.neg_wh);
+            dev.next_read_ms = t + READ_INTERVAL_MS;
+
+            /* STATE_MAYBE_PUBLISH */
+            unsigned long tdelta_s = (t - dev.last_publish_ms) / 1000;
+            int power = dev.gauge.get_instantaneous_power();
+            if (!policy.should_publish(
+                    tdelta_s, power, dev.gauge.has_significant_change())) {
+                continue;
+            }
+            int len = snprintf(payload, sizeof(payload),
+                PF_KEY_DEVICE_ID "=%s&" PF_KEY_E_POS_ACT_ENERGY_WH "=%lu&"
+                PF_KEY_E_NEG_ACT_ENERGY_WH "=%lu&" PF_KEY_E_INST_POWER_W "=%d&"
+                PF_KEY_DBG_UPTIME "=%lu",
+                dev.guid, dev.gauge.get_positive_active_energy_total(),
+                dev.gauge.get_negative_active_energy_total(), power, millis);
+            dev.gauge.reset();
+            if (broker) {
+                unsigned long long before = dev.mqtt.bytes_sent;
+                if (!dev.mqtt.publish(topic, payload, len)) {
+                    fprintf(stderr, "fleetsim: device %d: lost connection\n", i);
+                    return 1;
+                }
+                rep.bytes += dev.mqtt.bytes_sent - before;
+            } else {
+                /* Fixed header (2-3 bytes), topic length and topic */
+                size_t remaining = 2 + strlen(topic) + len;
+                rep.bytes += 1 + (remaining < 128 ? 1 : 2) + remaining;
+            }
+            ++rep.messages;
+            int bucket = (int)((t - dev.last_publish_ms) / 1000 / HIST_BUCKET_S);
+            ++rep.hist[bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1];
+            dev.last_publish_ms = t;
+        }
+
+        if (broker && t % 1000 == 0) {
+            for (int i = 0; i < ndevices; ++i) {
+                devices[i].mqtt.poll(t / 1000);
+            }
+        }
+        if (speed > 0) {
+            std::this_thread::sleep_until(wall0 + std::chrono::microseconds(
+                (long long)(t * 1000.0 / speed)));
+        }
+    }
+    double wall_s = std::chrono::duration<double>(clock::now() - wall0).count();
+    for (int i = 0; i < ndevices; ++i) {
+        devices[i].mqtt.disconnect();
+    }
+
+    double sim_s = end_ms / 1000.0;
+    printf("fleet:         %d devices, %.1f hours from %02d:%02d, %s\n",
+        ndevices, hours, (int)start_hour, (int)(start_hour * 60) % 60,
+        broker ? broker : "dry run");
+    printf("policy:        %u,%u,%u,%d\n", policy.max_interval_s,
+        policy.high_power_interval_s, policy.change_interval_s,
+        policy.high_power_w);
+    printf("messages:      %llu (%.1f per device per day)\n", rep.messages,
+        rep.messages * 86400.0 / sim_s / ndevices);
+    printf("rate:          %.1f msgs/s, %.0f bytes/s (simulated time)\n",
+        rep.messages / sim_s, rep.bytes / sim_s);
+    printf("wall:          %.2fs, %.0f msgs/s\n", wall_s,
+        wall_s > 0 ? rep.messages / wall_s : 0.0);
+    printf("intervals:\n");
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        if (!rep.hist[i]) {
+            continue;
+        }
+        printf("  %3d-%-3s s  %10llu  %5.1f%%\n", i * HIST_BUCKET_S,
+            (i == HIST_BUCKETS - 1 ? "" :
+             std::to_string((i + 1) * HIST_BUCKET_S).c_str()),
+            rep.hist[i], 100.0 * rep.hist[i] / rep.messages);
+    }
+    return 0;
+}
+
+// vim: set ts=8 sw=4 sts=4 et ai:
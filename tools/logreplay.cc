@@ -0,0 +1,483 @@
+/**
+ * logreplay: re-run the power estimators over archived serial logs
+ *
+ * Reads example.log-style transcripts (as captured by the Arduino IDE
+ * serial monitor, with timestamps), extracts the register reads:
+ *
+ *   22:35:08.711 -> on_response[1.8.0]: (0033402.264*kWh)
+ *
+ * and replays them through an estimator, like the device would. Prints
+ * the resulting power series on stdout and summary statistics on stderr.
+ *
+ * The files are memory mapped and split into chunks on line boundaries;
+ * the chunks are scanned by worker threads. Only the (cheap) replay
+ * itself is sequential. The timestamps have no date: whenever the time
+ * goes back by more than 12 hours, we assume that midnight passed.
+ *
+ * Usage:
+ *
+ *   logreplay [-e wattgauge|window:SECONDS] [-i SECONDS] [-j THREADS]
+ *             [-o STORE [-m METER] [-d YYYY-MM-DD]] [-q] FILE...
+ *
+ * -e  estimator: wattgauge (the EnergyGauge, reset after every output,
+ *     default) or window:SECONDS (net energy over a sliding window)
+ * -i  output interval in seconds (default 60)
+ * -j  number of worker threads (default: number of CPUs)
+ * -o  append the registers and the power series (as 16.7.0) to the
+ *     SampleStore file STORE, as meter METER (default 0)
+ * -d  the (UTC) date of the first line: the samples are then stored with
+ *     their absolute time [ms since 1970]. Without it, they are stored as
+ *     ms since the first sample, and only into an empty (new) STORE, as
+ *     runs would otherwise land on top of each other.
+ * -q  don't print the series, only the statistics
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "../SampleStore.h"
+#include "../WattGauge.h"
+
+static const char NEEDLE[] = "on_response[";
+static const unsigned long long DAY_MS = 86400000ULL;
+
+struct Sample {
+    unsigned long long t_ms;    /* time of day, later: time since start */
+    unsigned long wh;
+    unsigned char idx;          /* 0 = 1.8.0, 1 = 2.8.0 */
+};
+
+/* Parse "HH:MM:SS.mmm" at p; -1 if it isn't one */
+static long parse_time_of_day(const char *p, const char *end)
+{
+    static const char layout[] = "00:00:00.000";
+    if (end - p < 12) {
+        return -1;
+    }
+    for (int i = 0; i < 12; ++i) {
+        if (layout[i] == '0' ? (p[i] < '0' || p[i] > '9') : p[i] != layout[i]) {
+            return -1;
+        }
+    }
+#define D2(o) ((p[o] - '0') * 10 + (p[(o) + 1] - '0'))
+    return ((D2(0) * 60L + D2(3)) * 60L + D2(6)) * 1000L +
+        (p[9] - '0') * 100 + D2(10);
+#undef D2
+}
+
+/* Parse "(0033402.264*kWh)" or "(33402264*Wh)" as Wh; false if bad */
+static bool parse_watthour(const char *p, const char *end, unsigned long *wh)
+{
+    if (p >= end || *p++ != '(') {
+        return false;
+    }
+    unsigned long val = 0;
+    int decimals = -1;
+    for (; p < end && *p != '*'; ++p) {
+        if (*p == '.' && decimals < 0) {
+            decimals = 0;
+        } else if (*p >= '0' && *p <= '9') {
+            val = val * 10 + (*p - '0');
+            if (decimals >= 0) {
+                ++decimals;
+            }
+        } else {
+            return false;
+        }
+    }
+    if (end - p >= 5 && memcmp(p, "*kWh)", 5) == 0) {
+        for (decimals = (decimals < 0 ? 0 : decimals); decimals < 3;
+                ++decimals) {
+            val *= 10;
+        }
+        if (decimals != 3) {
+            return false;
+        }
+    } else if (!(end - p >= 4 && memcmp(p, "*Wh)", 4) == 0 && decimals < 0)) {
+        return false;
+    }
+    *wh = val;
+    return true;
+}
+
+/* Extract all 1.8.0/2.8.0 reads from [begin, end), which holds whole lines */
+static void scan_chunk(const char *begin, const char *end,
+                       std::vector<Sample> *out)
+{
+    const char *p = begin;
+    while (p < end) {
+        const char *hit = static_cast<const char *>(
+            memmem(p, end - p, NEEDLE, sizeof(NEEDLE) - 1));
+        if (!hit) {
+            break;
+        }
+        const char *bol = hit;
+        while (bol > begin && bol[-1] != '\n') {
+            --bol;
+        }
+        const char *eol = static_cast<const char *>(
+            memchr(hit, '\n', end - hit));
+        if (!eol) {
+            eol = end;
+        }
+        p = eol;
+
+        long tod = parse_time_of_day(bol, eol);
+        const char *reg = hit + sizeof(NEEDLE) - 1;
+        if (tod < 0 || eol - reg < 9 || memcmp(reg + 1, ".8.0]: ", 7) != 0 ||
+                (reg[0] != '1' && reg[0] != '2')) {
+            continue;
+        }
+        Sample s;
+        s.t_ms = tod;
+        s.idx = reg[0] - '1';
+        const char *val = reg + 8;
+        const char *valend = eol;
+        if (valend > val && valend[-1] == '\r') {
+            --valend;
+        }
+        if (parse_watthour(val, valend, &s.wh)) {
+            out->push_back(s);
+        }
+    }
+}
+
+/* Scan a file with nthreads workers; appends to samples in file order */
+static bool scan_file(const char *path, unsigned nthreads,
+                      std::vector<Sample> *samples, size_t *bytes)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    *bytes += size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    const char *data = static_cast<const char *>(map);
+
+    /* Chunks end right after a newline (or at the end of the file) */
+    std::vector<const char *> bounds(1, data);
+    for (unsigned i = 1; i < nthreads; ++i) {
+        const char *p = data + size * i / nthreads;
+        if (p <= bounds.back()) {
+            continue;
+        }
+        const char *nl = static_cast<const char *>(
+            memchr(p, '\n', data + size - p));
+        if (!nl) {
+            break;
+        }
+        bounds.push_back(nl + 1);
+    }
+    bounds.push_back(data + size);
+
+    std::vector<std::vector<Sample> > parts(bounds.size() - 1);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+        workers.push_back(std::thread(
+            scan_chunk, bounds[i], bounds[i + 1], &parts[i]));
+    }
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    for (size_t i = 0; i < parts.size(); ++i) {
+        samples->insert(samples->end(), parts[i].begin(), parts[i].end());
+    }
+    munmap(map, size);
+    return true;
+}
+
+/* Turn the time of day into a monotonic time, starting at 0 */
+static unsigned long long unwrap_days(std::vector<Sample> *samples)
+{
+    unsigned long long day = 0;
+    unsigned long long prev = 0;
+    unsigned long long first = 0;
+    for (size_t i = 0; i < samples->size(); ++i) {
+        Sample &s = (*samples)[i];
+        if (i != 0 && s.t_ms + DAY_MS / 2 < prev) {
+            day += DAY_MS;
+        }
+        prev = s.t_ms;
+        s.t_ms += day;
+        if (i == 0) {
+            first = s.t_ms;
+        }
+        s.t_ms -= first;
+    }
+    return first;
+}
+
+class Estimator
+{
+public:
+    virtual ~Estimator() {}
+    virtual void feed(const Sample &s) = 0;
+    virtual int get_power() = 0;
+    virtual void on_output() {}
+};
+
+/* The on-device estimator: EnergyGauge, reset after every publish */
+class GaugeEstimator : public Estimator
+{
+    EnergyGauge _gauge;
+public:
+    void feed(const Sample &s) {
+        if (s.idx == 0) {
+            _gauge.set_positive_active_energy_total(s.t_ms, s.wh);
+        } else {
+            _gauge.set_negative_active_energy_total(s.t_ms, s.wh);
+        }
+    }
+    int get_power() { return _gauge.get_instantaneous_power(); }
+    void on_output() { _gauge.reset(); }
+};
+
+/* Net energy between the oldest and newest sample of the last N seconds */
+class WindowEstimator : public Estimator
+{
+    struct Point { unsigned long long t; long long net; };
+    std::deque<Point> _points;
+    unsigned long long _window_ms;
+    unsigned long _wh[2];
+    bool _have[2];
+public:
+    WindowEstimator(unsigned long window_s) : _window_ms(window_s * 1000ULL) {
+        _have[0] = _have[1] = false;
+        _wh[0] = _wh[1] = 0;
+    }
+    void feed(const Sample &s) {
+        _wh[s.idx] = s.wh;
+        _have[s.idx] = true;
+        if (!_have[0] || !_have[1]) {
+            return; /* no net total until both are known */
+        }
+        Point pt = {s.t_ms, (long long)_wh[0] - (long long)_wh[1]};
+        _points.push_back(pt);
+        while (_points.size() > 2 &&
+                _points.back().t - _points[1].t >= _window_ms) {
+            _points.pop_front();
+        }
+    }
+    int get_power() {
+        if (_points.size() < 2) {
+            return 0;
+        }
+        unsigned long long dt = _points.back().t - _points.front().t;
+        if (dt == 0) {
+            return 0;
+        }
+        return (int)llround(
+            (_points.back().net - _points.front().net) * 3600000.0 / dt);
+    }
+};
+
+struct Stats {
+    size_t outputs;
+    double sum_w;
+    int min_w;
+    int max_w;
+    double sum_abs_err;     /* against the interval average */
+    double energy_wh;       /* integrated estimate */
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: logreplay [-e wattgauge|window:SECONDS] [-i SECONDS] "
+        "[-j THREADS] [-o STORE [-m METER] [-d YYYY-MM-DD]] [-q] "
+        "FILE...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *estimator_name = "wattgauge";
+    unsigned long interval_s = 60;
+    unsigned nthreads = std::thread::hardware_concurrency();
+    bool quiet = false;
+    const char *store_path = NULL;
+    unsigned meter = 0;
+    const char *date = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:e:i:j:m:o:q")) != -1) {
+        switch (opt) {
+        case 'd': date = optarg; break;
+        case 'e': estimator_name = optarg; break;
+        case 'i': interval_s = strtoul(optarg, NULL, 10); break;
+        case 'j': nthreads = strtoul(optarg, NULL, 10); break;
+        case 'm': meter = strtoul(optarg, NULL, 10); break;
+        case 'o': store_path = optarg; break;
+        case 'q': quiet = true; break;
+        default: usage();
+        }
+    }
+    if (optind >= argc || interval_s == 0) {
+        usage();
+    }
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+    long long base_ms = -1; /* midnight of date [ms since 1970] */
+    if (date) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        char tail;
+        if (sscanf(date, "%d-%d-%d%c", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                   &tail) != 3) {
+            usage();
+        }
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        base_ms = timegm(&tm) * 1000LL;
+    }
+
+    Estimator *estimator;
+    if (strcmp(estimator_name, "wattgauge") == 0) {
+        estimator = new GaugeEstimator();
+    } else if (strncmp(estimator_name, "window:", 7) == 0 &&
+            atoi(estimator_name + 7) > 0) {
+        estimator = new WindowEstimator(atoi(estimator_name + 7));
+    } else {
+        usage();
+        return 2;
+    }
+    SampleStore store;
+    if (store_path && !store.open(store_path)) {
+        fprintf(stderr, "logreplay: %s: cannot open store\n", store_path);
+        return 1;
+    }
+    if (store_path && base_ms < 0 && store.get_count()) {
+        fprintf(stderr, "logreplay: %s: not empty, use -d to store "
+            "absolute times\n", store_path);
+        return 1;
+    }
+
+    /* Scan (parallel) */
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    std::vector<Sample> samples;
+    size_t bytes = 0;
+    for (int i = optind; i < argc; ++i) {
+        if (!scan_file(argv[i], nthreads, &samples, &bytes)) {
+            return 1;
+        }
+    }
+    unsigned long long first_ms = unwrap_days(&samples);
+    /* Stored timestamps: absolute with -d, else relative to the start */
+    long long store_ms = (base_ms < 0 ? 0 : base_ms + (long long)first_ms);
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+
+    /* Replay (sequential) */
+    Stats st = {0, 0.0, 0, 0, 0.0, 0.0};
+    unsigned long long interval_ms = interval_s * 1000ULL;
+    unsigned long long next_out = interval_ms;
+    unsigned long long prev_out = 0;
+    long long wh[2] = {-1, -1};
+    long long prev_net = 0;
+    long long first_net = 0;
+    bool have_prev = false;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        const Sample &s = samples[i];
+        estimator->feed(s);
+        wh[s.idx] = s.wh;
+        if (store_path) {
+            store.append(store_ms + s.t_ms, meter, SampleStore::obis(
+                s.idx ? 2 : 1, 8, 0), s.wh);
+        }
+        if (s.t_ms < next_out || wh[0] < 0) {
+            continue;
+        }
+        int watt = estimator->get_power();
+        estimator->on_output();
+        long long net = wh[0] - (wh[1] < 0 ? 0 : wh[1]);
+        if (have_prev) {
+            /* Compare against the average over the same interval */
+            double dt = (double)(s.t_ms - prev_out);
+            double avg = (net - prev_net) * 3600000.0 / dt;
+            st.sum_abs_err += std::fabs(watt - avg);
+            st.energy_wh += watt * dt / 3600000.0;
+            st.sum_w += watt;
+            st.min_w = (st.outputs ? std::min(st.min_w, watt) : watt);
+            st.max_w = (st.outputs ? std::max(st.max_w, watt) : watt);
+            ++st.outputs;
+        }
+        if (!quiet) {
+            printf("%.3f\t%d\n", s.t_ms / 1000.0, watt);
+        }
+        if (store_path) {
+            store.append(
+                store_ms + s.t_ms, meter, SampleStore::obis(16, 7, 0), watt);
+        }
+        if (!have_prev) {
+            first_net = net;
+        }
+        prev_out = s.t_ms;
+        prev_net = net;
+        have_prev = true;
+        next_out = s.t_ms + interval_ms;
+    }
+    if (store_path && !store.flush()) {
+        fprintf(stderr, "logreplay: %s: write failed\n", store_path);
+        return 1;
+    }
+    std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+
+    double scan_s = std::chrono::duration<double>(t1 - t0).count();
+    double replay_s = std::chrono::duration<double>(t2 - t1).count();
+    fprintf(stderr, "estimator:     %s, every %lus\n",
+        estimator_name, interval_s);
+    fprintf(stderr, "input:         %zu bytes, %zu samples, %.1f hours\n",
+        bytes, samples.size(),
+        samples.empty() ? 0.0 : samples.back().t_ms / 3600000.0);
+    fprintf(stderr, "scan:          %.3fs (%u threads, %.0f MB/s)\n",
+        scan_s, nthreads, scan_s > 0 ? bytes / scan_s / 1e6 : 0.0);
+    fprintf(stderr, "replay:        %.3fs\n", replay_s);
+    if (store_path) {
+        fprintf(stderr, "store:         %llu samples, %zu chunks, "
+            "%zu bytes\n", (unsigned long long)store.get_count(),
+            store.get_chunks(), store.get_bytes());
+    }
+    if (st.outputs) {
+        fprintf(stderr, "power:         min %d, mean %.1f, max %d W "
+            "(%zu values)\n",
+            st.min_w, st.sum_w / st.outputs, st.max_w, st.outputs);
+        fprintf(stderr, "error:         %.1f W mean absolute, "
+            "against the interval average\n", st.sum_abs_err / st.outputs);
+        fprintf(stderr, "energy:        %.1f Wh estimated, %lld Wh metered\n",
+            st.energy_wh, prev_net - first_net);
+    }
+    delete estimator;
+    return 0;
+}
+
+// vim: set ts=8 sw=4 sts=4 et ai:
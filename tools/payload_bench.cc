@@ -0,0 +1,165 @@
+/**
+ * payload_bench: measure PayloadDecoder throughput on a single core
+ *
+ * Builds a corpus of payloads like the firmware publishes them (regular
+ * publishes, key/delta readouts, grid and load profile batches, and one
+ * legacy DATA= readout) and decodes it repeatedly, including the reg_
+ * and DATA= registers and the LIST values.
+ *
+ * Usage:
+ *
+ *   payload_bench [SECONDS]
+ *
+ * Build with -DPAYLOAD_DECODER_NO_SIMD to compare against the scalar
+ * delimiter scan.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../PayloadDecoder.h"
+
+static std::vector<std::string> make_corpus()
+{
+    std::vector<std::string> corpus;
+    char buf[512];
+    srand(1);
+    for (int i = 0; i < 1000; ++i) {
+        unsigned long pos = 33271493UL + i * 17;
+        int kind = i % 10;
+        if (kind < 7) {
+            snprintf(buf, sizeof(buf),
+                PF_KEY_DEVICE_ID "=EUI48:11:22:33:44:55:%02X&"
+                PF_KEY_E_POS_ACT_ENERGY_WH "=%lu&"
+                PF_KEY_E_NEG_ACT_ENERGY_WH "=%d&"
+                PF_KEY_E_INST_POWER_W "=%d&"
+                PF_KEY_DBG_UPTIME "=%d",
+                i & 0xff, pos, 7784 + i, (rand() % 6000) - 1000, i * 60000);
+        } else if (kind == 7 && i == 7) {
+            /* Legacy: the whole readout in one field */
+            snprintf(buf, sizeof(buf),
+                PF_KEY_DEVICE_ID "=EUI48:11:22:33:44:55:%02X&"
+                PF_KEY_ID "=ISK5ME162-0033&"
+                PF_KEY_DATA "=C.1.0(28342193)\r\n0.0.0(28342193)\r\n"
+                "1.8.0(%07lu.%03lu*kWh)\r\n1.8.1(0000000.000*kWh)\r\n"
+                "1.8.2(%07lu.%03lu*kWh)\r\n2.8.0(0000013.465*kWh)\r\n"
+                "2.8.1(0000000.000*kWh)\r\n2.8.2(0000013.465*kWh)\r\n"
+                "F.F(0000000)\r\n!\r\n",
+                i & 0xff, pos / 1000, pos % 1000, pos / 1000, pos % 1000);
+        } else if (kind == 7 && i / 10 % 10 == 0) {
+            /* Keyframe: every register, in readout order */
+            snprintf(buf, sizeof(buf),
+                PF_KEY_DEVICE_ID "=EUI48:11:22:33:44:55:%02X&"
+                PF_KEY_ID "=ISK5ME162-0033&" PF_KEY_READOUT "=key&"
+                PF_KEY_REG_PREFIX "C.1.0=28342193&"
+                PF_KEY_REG_PREFIX "0.0.0=28342193&"
+                PF_KEY_REG_PREFIX "1.8.0=%lu&"
+                PF_KEY_REG_PREFIX "1.8.1=0&"
+                PF_KEY_REG_PREFIX "1.8.2=%lu&"
+                PF_KEY_REG_PREFIX "2.8.0=13465&"
+                PF_KEY_REG_PREFIX "2.8.1=0&"
+                PF_KEY_REG_PREFIX "2.8.2=13465&"
+                PF_KEY_REG_PREFIX "F.F=0",
+                i & 0xff, pos, pos);
+        } else if (kind == 7) {
+            /* Delta: only the registers that changed */
+            snprintf(buf, sizeof(buf),
+                PF_KEY_DEVICE_ID "=EUI48:11:22:33:44:55:%02X&"
+                PF_KEY_READOUT "=delta&"
+                PF_KEY_REG_PREFIX "1.8.0=%lu&"
+                PF_KEY_REG_PREFIX "1.8.2=%lu",
+                i & 0xff, pos, pos);
+        } else if (kind == 8) {
+            int n = snprintf(buf, sizeof(buf),
+                PF_KEY_DEVICE_ID "=EUI48:11:22:33:44:55:%02X&"
+                PF_KEY_GRID_T0 "=%d&" PF_KEY_GRID_STEP_S "=10&"
+                PF_KEY_GRID_POWER_W "=",
+                i & 0xff, 1615761300 + i * 120);
+            for (int j = 0; j < 12; ++j) {
+                n += snprintf(buf + n, sizeof(buf) - n, "%s%d",
+                    j ? "," : "", (rand() % 6000) - 1000);
+            }
+        } else {
+            snprintf(buf, sizeof(buf),
+                PF_KEY_DEVICE_ID "=EUI48:11:22:33:44:55:%02X&"
+                PF_KEY_HIST_T0 "=%d&" PF_KEY_HIST_PERIOD_S "=900&"
+                PF_KEY_HIST_PREFIX "1.5_W=512,498,505,511,490,502,499,500&"
+                PF_KEY_HIST_PREFIX "2.5_W=0,0,0,0,0,0,0,0",
+                i & 0xff, 1615681800 + i * 900);
+        }
+        corpus.push_back(buf);
+    }
+    return corpus;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = (argc > 1 ? atof(argv[1]) : 2.0);
+    std::vector<std::string> corpus = make_corpus();
+    size_t corpus_bytes = 0;
+    for (size_t i = 0; i < corpus.size(); ++i) {
+        corpus_bytes += corpus[i].size();
+    }
+
+    typedef std::chrono::steady_clock clock;
+    clock::time_point t0 = clock::now();
+    unsigned long long messages = 0, bytes = 0, failed = 0;
+    long long checksum = 0;
+    double elapsed = 0;
+    PayloadMessage msg;
+    do {
+        for (size_t i = 0; i < corpus.size(); ++i) {
+            const std::string &s = corpus[i];
+            if (!PayloadDecoder::decode(s.data(), s.size(), &msg)) {
+                ++failed;
+                continue;
+            }
+            if (msg.has(PayloadMessage::E_INST_POWER_W)) {
+                checksum += msg.get_int(PayloadMessage::E_INST_POWER_W);
+            }
+            if (msg.has(PayloadMessage::DATA)) {
+                PayloadSlice data = msg.get_str(PayloadMessage::DATA);
+                const char *p = data.p;
+                PayloadRegister reg;
+                while (PayloadDecoder::next_register(
+                        p, data.p + data.len, &reg)) {
+                    checksum += reg.milli;
+                }
+            }
+            for (int j = 0; j < msg.reg_count; ++j) {
+                checksum += msg.reg_values[j];
+            }
+            if (msg.has(PayloadMessage::GRID_POWER_W)) {
+                PayloadSlice list = msg.get_str(PayloadMessage::GRID_POWER_W);
+                const char *p = list.p;
+                long long val;
+                while (PayloadDecoder::next_int(p, list.p + list.len, &val)) {
+                    checksum += val;
+                }
+            }
+        }
+        messages += corpus.size();
+        bytes += corpus_bytes;
+        elapsed = std::chrono::duration<double>(clock::now() - t0).count();
+    } while (elapsed < seconds);
+
+    printf("scan:          %s\n",
+#ifdef PAYLOAD_DECODER_SSE2
+        "sse2"
+#else
+        "scalar"
+#endif
+        );
+    printf("corpus:        %zu messages, %.0f bytes average\n",
+        corpus.size(), (double)corpus_bytes / corpus.size());
+    printf("decoded:       %llu messages in %.2fs (%llu failed)\n",
+        messages, elapsed, failed);
+    printf("throughput:    %.2f M msgs/s/core, %.0f MB/s/core\n",
+        messages / elapsed / 1e6, bytes / elapsed / 1e6);
+    printf("checksum:      %lld\n", checksum);
+    return (failed ? 1 : 0);
+}
+
+// vim: set ts=8 sw=4 sts=4 et ai:
@@ -0,0 +1,218 @@
+/**
+ * serial2mqtt: publish the SampleFrames of a network-less device to MQTT
+ *
+ * An Arduino Uno built with SERIAL_FRAMES writes its publish() values as
+ * binary frames (see SampleFrame.h) on its serial port, between the debug
+ * text. This bridge reads the port, decodes the frames and publishes them
+ * with the same payload as publish() on the ESP8266.
+ *
+ * DEVICE is a serial port (set to BAUD, 8N1, raw), or a file with a
+ * capture of one ("-" for stdin). Without -b, nothing is sent (dry run)
+ * and the payloads are printed on stdout.
+ *
+ * Usage:
+ *
+ *   serial2mqtt [-s BAUD] [-b BROKER[:PORT]] [-t TOPIC] [-i DEVICE_ID]
+ *               DEVICE
+ *
+ * -s  baud rate (default 115200, the SERMON_BAUD)
+ * -i  the device_id to publish (default: serial:<name of DEVICE>)
+ */
+#include <fcntl.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include "../PayloadFields.h"
+#include "../SampleFrame.h"
+#include "MiniMqtt.h"
+
+static const unsigned RECONNECT_S = 5;
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: serial2mqtt [-s BAUD] [-b BROKER[:PORT]] [-t TOPIC] "
+        "[-i DEVICE_ID] DEVICE\n");
+    exit(2);
+}
+
+static speed_t baud2speed(long baud)
+{
+    switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    default: return 0;
+    }
+}
+
+static int open_device(const char *path, long baud)
+{
+    if (strcmp(path, "-") == 0) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY | O_NOCTTY);
+    if (fd < 0 || !isatty(fd)) {
+        return fd;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0) {
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, baud2speed(baud));
+    cfsetospeed(&tio, baud2speed(baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Format the payload like publish() does; returns its length */
+static int format_publish(char *buf, size_t size, const char *device_id,
+                          const SampleFrame &frame)
+{
+    const unsigned char *p = frame.get_payload();
+    const unsigned char *end = p + frame.get_length();
+    int len = snprintf(buf, size,
+        PF_KEY_DEVICE_ID "=%s&" PF_KEY_E_POS_ACT_ENERGY_WH "=%lu&"
+        PF_KEY_E_NEG_ACT_ENERGY_WH "=%lu&" PF_KEY_E_INST_POWER_W "=%d&"
+        PF_KEY_DBG_UPTIME "=%lu",
+        device_id, SampleFrame::get_u32(p), SampleFrame::get_u32(p + 4),
+        (int)SampleFrame::get_u32(p + 8), SampleFrame::get_u32(p + 12));
+    p += 16;
+    if (frame.get_type() == SampleFrame::TYPE_PUBLISH_ALIGNED &&
+            end - p >= 8) {
+        len += snprintf(buf + len, size - len,
+            "&" PF_KEY_ALIGN_T "=%lu&" PF_KEY_E_AVG_POWER_W "=%d",
+            SampleFrame::get_u32(p), (int)SampleFrame::get_u32(p + 4));
+        p += 8;
+    }
+    if (end - p >= 4) {
+        /* OPTIONAL_LIGHT_SENSOR */
+        len += snprintf(buf + len, size - len, "&" PF_KEY_DBG_PULSE "=%d..%d",
+            (short)SampleFrame::get_u16(p), (short)SampleFrame::get_u16(p + 2));
+    }
+    if (end - p >= 6) {
+        len += snprintf(buf + len, size - len, "&" PF_KEY_DBG_LAG_MS "=%u",
+            SampleFrame::get_u16(p + 4));
+    }
+    return len;
+}
+
+int main(int argc, char **argv)
+{
+    long baud = 115200;
+    const char *broker = NULL;
+    int port = 1883;
+    const char *topic = "some/topic";
+    const char *device_id = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:b:t:i:")) != -1) {
+        switch (opt) {
+        case 's': baud = atol(optarg); break;
+        case 'b': broker = optarg; break;
+        case 't': topic = optarg; break;
+        case 'i': device_id = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || !baud2speed(baud)) {
+        usage();
+    }
+    const char *path = argv[optind];
+    std::string default_id = "serial:";
+    default_id += (strrchr(path, '/') ? strrchr(path, '/') + 1 : path);
+    if (!device_id) {
+        device_id = default_id.c_str();
+    }
+    std::string host;
+    if (broker) {
+        const char *colon = strrchr(broker, ':');
+        host.assign(broker, colon ? colon - broker : strlen(broker));
+        if (colon) {
+            port = atoi(colon + 1);
+        }
+    }
+
+    int fd = open_device(path, baud);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+
+    SampleFrame frame;
+    MiniMqtt mqtt;
+    time_t next_connect = 0;
+    unsigned long published = 0, dropped = 0;
+    char payload[256];
+
+    for (;;) {
+        time_t now = time(NULL);
+        if (broker && !mqtt.connected() && now >= next_connect) {
+            if (!mqtt.connect(host.c_str(), port, device_id, 60)) {
+                fprintf(stderr, "serial2mqtt: cannot connect to %s:%d\n",
+                    host.c_str(), port);
+                next_connect = now + RECONNECT_S;
+            }
+        }
+        mqtt.poll(now);
+
+        /* Wake up at least every second for the keepalive */
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        struct timeval tv = {1, 0};
+        if (select(fd + 1, &rfds, NULL, NULL, &tv) <= 0) {
+            continue;
+        }
+        unsigned char buf[512];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;  /* end of file, or the port went away */
+        }
+        for (ssize_t i = 0; i < n; ++i) {
+            if (!frame.push(buf[i])) {
+                continue;
+            }
+            if ((frame.get_type() != SampleFrame::TYPE_PUBLISH &&
+                    frame.get_type() != SampleFrame::TYPE_PUBLISH_ALIGNED) ||
+                    frame.get_length() < 16) {
+                continue;
+            }
+            int len = format_publish(payload, sizeof(payload), device_id, frame);
+            if (!broker) {
+                printf("%s\n", payload);
+                fflush(stdout);
+                ++published;
+            } else if (mqtt.publish(topic, payload, len)) {
+                ++published;
+            } else {
+                ++dropped;
+            }
+        }
+    }
+
+    mqtt.disconnect();
+    fprintf(stderr, "serial2mqtt: %lu frames, %lu published, %lu dropped, "
+        "%lu bad\n", frame.get_frames(), published, dropped,
+        frame.get_errors());
+    return 0;
+}
+
+// vim: set ts=8 sw=4 sts=4 et ai: